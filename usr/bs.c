@@ -33,6 +33,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
 #include <syscall.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
@@ -217,10 +218,38 @@ static void mutex_cleanup(void *mutex)
 	pthread_mutex_unlock(mutex);
 }
 
+/*
+ * Takes the next command to run, NULL if there is none or the QoS caps
+ * hold all back. Then *wait is how many ns until one may go.
+ */
+static struct scsi_cmd *bs_thread_dequeue(struct bs_thread_info *info,
+					  uint64_t *wait)
+{
+	struct scsi_cmd *cmd;
+
+	*wait = 0;
+	if (info->qos) {
+		cmd = qos_dequeue(info->qos, wait);
+		/* pending_list has what the scheduler had no memory for */
+		if (cmd || list_empty(&info->pending_list))
+			return cmd;
+	}
+
+	if (list_empty(&info->pending_list))
+		return NULL;
+
+	cmd = list_first_entry(&info->pending_list, struct scsi_cmd, bs_list);
+	list_del(&cmd->bs_list);
+
+	return cmd;
+}
+
 static void *bs_thread_worker_fn(void *arg)
 {
 	struct bs_thread_info *info = arg;
 	struct scsi_cmd *cmd;
+	struct timespec ts;
+	uint64_t wait;
 	sigset_t set;
 
 	sigfillset(&set);
@@ -230,14 +259,20 @@ static void *bs_thread_worker_fn(void *arg)
 		pthread_mutex_lock(&info->pending_lock);
 		pthread_cleanup_push(mutex_cleanup, &info->pending_lock);
 
-		while (list_empty(&info->pending_list))
-			pthread_cond_wait(&info->pending_cond,
-					  &info->pending_lock);
-
-		cmd = list_first_entry(&info->pending_list,
-				       struct scsi_cmd, bs_list);
+		while (!(cmd = bs_thread_dequeue(info, &wait))) {
+			if (!wait) {
+				pthread_cond_wait(&info->pending_cond,
+						  &info->pending_lock);
+				continue;
+			}
+			clock_gettime(CLOCK_REALTIME, &ts);
+			wait += ts.tv_nsec;
+			ts.tv_sec += wait / 1000000000;
+			ts.tv_nsec = wait % 1000000000;
+			pthread_cond_timedwait(&info->pending_cond,
+					       &info->pending_lock, &ts);
+		}
 
-		list_del(&cmd->bs_list);
 		pthread_cleanup_pop(1); /* Unlock pending_lock mutex */
 
 		info->request_fn(cmd);
@@ -441,6 +476,8 @@ destroy_threads:
 	pthread_cond_destroy(&info->pending_cond);
 	pthread_mutex_destroy(&info->pending_lock);
 	free(info->worker_thread);
+	qos_exit(info->qos);
+	info->qos = NULL;
 
 	return TGTADM_NOMEM;
 }
@@ -457,6 +494,8 @@ void bs_thread_close(struct bs_thread_info *info)
 	pthread_cond_destroy(&info->pending_cond);
 	pthread_mutex_destroy(&info->pending_lock);
 	free(info->worker_thread);
+	qos_exit(info->qos);
+	info->qos = NULL;
 }
 
 int bs_thread_cmd_submit(struct scsi_cmd *cmd)
@@ -466,7 +505,8 @@ int bs_thread_cmd_submit(struct scsi_cmd *cmd)
 
 	pthread_mutex_lock(&info->pending_lock);
 
-	list_add_tail(&cmd->bs_list, &info->pending_list);
+	if (!info->qos || qos_enqueue(info->qos, cmd))
+		list_add_tail(&cmd->bs_list, &info->pending_list);
 
 	pthread_mutex_unlock(&info->pending_lock);
 
@@ -466,49 +466,6 @@ static void bs_rbd_close(struct scsi_lu *lu)
 	}
 }
 
-// Slurp up and return a copy of everything to the next ';', and update p
-static char *slurp_to_semi(char **p)
-{
-	char *end = index(*p, ';');
-	char *ret;
-	int len;
-
-	if (end == NULL)
-		end = *p + strlen(*p);
-	len = end - *p;
-	ret = malloc(len + 1);
-	strncpy(ret, *p, len);
-	ret[len] = '\0';
-	*p = end;
-	/* Jump past the semicolon, if we stopped at one */
-	if (**p == ';')
-		*p = end + 1;
-	return ret;
-}
-
-static char *slurp_value(char **p)
-{
-	char *equal = index(*p, '=');
-	if (equal) {
-		*p = equal + 1;
-		return slurp_to_semi(p);
-	} else {
-		// uh...no?
-		return NULL;
-	}
-}
-
-static int is_opt(const char *opt, char *p)
-{
-	int ret = 0;
-	if ((strncmp(p, opt, strlen(opt)) == 0) &&
-	    (p[strlen(opt)] == '=')) {
-		ret = 1;
-	}
-	return ret;
-}
-
-
 static tgtadm_err bs_rbd_init(struct scsi_lu *lu, char *bsopts)
 {
 	struct bs_thread_info *info = BS_THREAD_I(lu);
@@ -24,6 +24,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,6 +33,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <linux/falloc.h>
 #include <linux/fs.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
@@ -44,12 +46,11 @@
 #include "scsi.h"
 #include "spc.h"
 #include "bs_thread.h"
+#include "xcopy.h"
 
 int master_fd = 0;
 char *master_path = NULL;
 
-// Allow up-to 4096 clients to connect
-#define FD_LIMIT 4096
 #define FD_MAP_SIZE (sizeof(int) * FD_LIMIT)
 int *fd_map = NULL;
 
@@ -63,13 +64,13 @@ int *fd_map = NULL;
  */
 int8_t *flag_map;
 int *fd_flag_map;
+/* master image version of each client, by the fd of its image */
+int *fd_master_map;
 int clients_count;
 static void *zero_buf;
 static const int filled = 0b11111111;
 
 static void __attribute__((constructor)) init_map(void) {
-	long hugepage;
-
 	fd_map = malloc(FD_MAP_SIZE);
 	if (!fd_map) {
 		perror("Failed to allocate fd_map");
@@ -86,6 +87,21 @@ static void __attribute__((constructor)) init_map(void) {
 	memset(fd_flag_map, 0, FD_MAP_SIZE);
 	printf("Allocated %ld bytes for fd_flag_map\n", FD_MAP_SIZE);
 
+	fd_master_map = malloc(FD_MAP_SIZE);
+	if (!fd_master_map) {
+		perror("Failed to allocate fd_master_map");
+		exit(1);
+	}
+	memset(fd_master_map, 0, FD_MAP_SIZE);
+}
+
+/*
+ * Called from main() once options are parsed, so that the hugepage is
+ * faulted in on the NUMA node tgtd was asked to run on.
+ */
+void init_flag_map(void) {
+	long hugepage;
+
 	hugepage = gethugepagesize();
 	if (hugepage != 1 * GB) {
 		fprintf(stderr, "Hugepage not set to 1 GB, current: %ld\n", hugepage);
@@ -104,7 +120,7 @@ static void __attribute__((constructor)) init_map(void) {
 }
 
 #define ____pread64(fd, tmpbuf, length, offset) \
-  pread64(memcmp(zero_buf, (void*)flag_map + (MAP_LEN * fd_flag_map[fd]) + (offset / BLK_SIZE), (length / BLK_SIZE) + 1) == 0 ? master_fd : fd, tmpbuf, length, offset);
+  pread64(memcmp(zero_buf, (void*)flag_map + (MAP_LEN * fd_flag_map[fd]) + (offset / BLK_SIZE), (length / BLK_SIZE) + 1) == 0 ? client_master_fd(fd) : fd, tmpbuf, length, offset);
 
 #define ____pwrite64(fd, tmpbuf, length, offset) \
   pwrite64(fd, tmpbuf, length, offset); \
@@ -173,6 +189,181 @@ static void __attribute__((constructor)) init_debug(void) {
 #define __pwrite64 ____pwrite64
 #endif
 
+ssize_t bs_rdwr_pread(int fd, void *buf, size_t length, off64_t offset)
+{
+	ssize_t ret;
+
+	ret = __pread64(fd, buf, length, offset);
+	return ret;
+}
+
+ssize_t bs_rdwr_pwrite(int fd, const void *buf, size_t length, off64_t offset)
+{
+	ssize_t ret;
+
+	ret = __pwrite64(fd, buf, length, offset);
+	return ret;
+}
+
+/* Access a client's image, through its RAM overlay or dedup pool */
+static ssize_t client_pread(int addr, int fd, void *buf, size_t length,
+			    uint64_t offset)
+{
+	if (ram_overlay_enabled())
+		return ram_read(addr, fd, buf, length, offset);
+	if (dedup_enabled())
+		return dedup_read(addr, fd, buf, length, offset);
+	return bs_rdwr_pread(fd, buf, length, offset);
+}
+
+static ssize_t client_pwrite(int addr, int fd, const void *buf, size_t length,
+			     uint64_t offset)
+{
+	if (ram_overlay_enabled())
+		return ram_write(addr, fd, buf, length, offset);
+	if (dedup_enabled())
+		return dedup_write(addr, fd, buf, length, offset);
+	return bs_rdwr_pwrite(fd, buf, length, offset);
+}
+
+/* Mark blocks of a client's image written behind the pwrite wrapper */
+static void bs_rdwr_dirty(int fd, uint64_t offset, uint64_t length)
+{
+	memset((void *)flag_map + (MAP_LEN * fd_flag_map[fd]) +
+	       (offset / BLK_SIZE), filled, length / BLK_SIZE);
+#ifdef RECORD_HOTMAP
+	for (uint64_t i = offset; i < offset + length; i += BLK_SIZE)
+		*(int8_t *)(debug_buf + (i / BLK_SIZE)) = -1;
+#endif
+}
+
+/*
+ * Deallocate part of a client's image. The blocks fully inside it are
+ * marked written, so that they read zeros from the punched hole rather
+ * than the master, as LBPRZ promises. A partial block the client never
+ * wrote keeps reading the master, so it is left alone.
+ */
+static int bs_rdwr_punch(int addr, int fd, uint64_t offset, uint64_t length)
+{
+	int8_t *map = (void *)flag_map + (MAP_LEN * fd_flag_map[fd]);
+	uint64_t end = offset + length;
+	uint64_t start = ALIGN(offset, BLK_SIZE);
+	uint64_t stop = end / BLK_SIZE * BLK_SIZE;
+
+	ram_unmap(addr, offset, length);
+	if (dedup_enabled() && dedup_unmap(addr, fd, offset, length))
+		return -1;
+
+	if (offset < start && !map[offset / BLK_SIZE])
+		offset = start;
+	if (end > stop && !map[stop / BLK_SIZE])
+		end = stop;
+	if (offset < end && unmap_file_region(fd, offset, end - offset))
+		return -1;
+	if (start < stop)
+		bs_rdwr_dirty(fd, start, stop - start);
+
+	return 0;
+}
+
+#define COPY_BOUNCE_SIZE (1 * MB)
+
+/* Copy through a buffer, back to front if dst overlaps the source's tail */
+static int bs_rdwr_copy_bounce(int addr, int fd, uint64_t src, uint64_t dst,
+			       uint64_t length)
+{
+	int backwards = src != XCOPY_ZEROES && dst > src && dst < src + length;
+	uint64_t done = 0, n, off;
+	void *buf = zero_buf;
+	int ret = 0;
+
+	if (src != XCOPY_ZEROES) {
+		buf = malloc(COPY_BOUNCE_SIZE);
+		if (!buf)
+			return -ENOMEM;
+	}
+
+	while (done < length) {
+		n = min_t(uint64_t, length - done, COPY_BOUNCE_SIZE);
+		off = backwards ? length - done - n : done;
+
+		if (src != XCOPY_ZEROES &&
+		    client_pread(addr, fd, buf, n, src + off) != n) {
+			ret = -EIO;
+			break;
+		}
+		if (client_pwrite(addr, fd, buf, n, dst + off) != n) {
+			ret = -EIO;
+			break;
+		}
+		done += n;
+	}
+
+	if (buf != zero_buf)
+		free(buf);
+	return ret;
+}
+
+/*
+ * Copy function for xcopy_execute(). Runs of clean blocks are copied
+ * from the master image and dirty ones from the client's own file with
+ * copy_file_range(), which shares the extents instead of copying on
+ * file systems with reflinks. Overlays, overlapping ranges and partial
+ * blocks go through a buffer.
+ */
+static int bs_rdwr_copy(struct scsi_cmd *cmd, uint64_t src, uint64_t dst,
+			uint64_t length)
+{
+	int addr = cmd->subnet_addr, fd = fd_map[addr];
+	int8_t *map = (void *)flag_map + (MAP_LEN * fd_flag_map[fd]);
+	uint64_t done = 0, n;
+	loff_t in, out;
+	ssize_t ret;
+	int clean;
+
+	if ((src != XCOPY_ZEROES && wb_flush(addr, src, length)) ||
+	    wb_flush(addr, dst, length))
+		return -EIO;
+
+	if (src == XCOPY_ZEROES || ram_overlay_enabled() || dedup_enabled() ||
+	    (src | dst | length) % BLK_SIZE ||
+	    (src < dst + length && dst < src + length)) {
+		ret = bs_rdwr_copy_bounce(addr, fd, src, dst, length);
+		if (!ret)
+			extmap_write(addr, dst, length);
+		return ret;
+	}
+
+	while (done < length) {
+		clean = map[(src + done) / BLK_SIZE] == 0;
+		for (n = BLK_SIZE; done + n < length; n += BLK_SIZE)
+			if ((map[(src + done + n) / BLK_SIZE] == 0) != clean)
+				break;
+
+		in = src + done;
+		out = dst + done;
+		while (out < dst + done + n) {
+			ret = copy_file_range(clean ? client_master_fd(fd) :
+					      fd, &in, fd, &out,
+					      dst + done + n - out, 0);
+			if (ret <= 0)
+				break;
+		}
+		if (out > dst + done)
+			bs_rdwr_dirty(fd, dst + done, out - dst - done);
+
+		/* not on this file system, or a short copy */
+		if (out < dst + done + n &&
+		    bs_rdwr_copy_bounce(addr, fd, in, out, dst + done + n - out))
+			return -EIO;
+
+		done += n;
+	}
+
+	extmap_write(addr, dst, length);
+	return 0;
+}
+
 static void set_medium_error(int *result, uint8_t *key, uint16_t *asc)
 {
 	*result = SAM_STAT_CHECK_CONDITION;
@@ -180,6 +371,281 @@ static void set_medium_error(int *result, uint8_t *key, uint16_t *asc)
 	*asc = ASC_READ_ERROR;
 }
 
+#define WRITE_SAME_BATCH (1 * MB)
+
+/* Repeats the WRITE SAME block over [offset, offset + length) */
+static int bs_rdwr_fill(struct scsi_cmd *cmd, int fd, uint64_t offset,
+			uint64_t length)
+{
+	uint32_t blocksize = 1 << cmd->dev->blk_shift;
+	char *pattern = scsi_get_out_buffer(cmd), *buf;
+	uint64_t batch, n, i;
+	int ret = 0;
+
+	if (!length)
+		return 0;
+
+	batch = min_t(uint64_t, length, WRITE_SAME_BATCH);
+	buf = malloc(batch);
+	if (!buf)
+		return -ENOMEM;
+	for (i = 0; i < batch; i += blocksize)
+		memcpy(buf + i, pattern, blocksize);
+
+	while (length) {
+		n = min_t(uint64_t, length, batch);
+
+		for (i = 0; i < n; i += blocksize) {
+			switch (cmd->scb[1] & 0x06) {
+			case 0x02: /* PBDATA==0 LBDATA==1 */
+				put_unaligned_be32(offset + i, buf + i);
+				break;
+			case 0x04: /* PBDATA==1 LBDATA==0 */
+				/* physical sector format */
+				put_unaligned_be64(offset + i, buf + i);
+				break;
+			}
+		}
+
+		if (client_pwrite(cmd->subnet_addr, fd, buf, n, offset) != n) {
+			ret = -EIO;
+			break;
+		}
+
+		offset += n;
+		length -= n;
+	}
+
+	free(buf);
+	return ret;
+}
+
+/*
+ * WRITE SAME without UNMAP. A block of zeros becomes one zeroed range
+ * of the client's image, marked written; partial BLK_SIZE blocks at
+ * either end and other patterns are written in large batches.
+ */
+static int bs_rdwr_write_same(struct scsi_cmd *cmd, int fd, uint64_t offset,
+			      uint64_t length)
+{
+	uint32_t blocksize = 1 << cmd->dev->blk_shift;
+	uint64_t head, mid;
+
+	if ((cmd->scb[1] & 0x06) || ram_overlay_enabled() || dedup_enabled() ||
+	    memcmp(scsi_get_out_buffer(cmd), zero_buf, blocksize))
+		return bs_rdwr_fill(cmd, fd, offset, length);
+
+	head = min_t(uint64_t, ALIGN(offset, BLK_SIZE) - offset, length);
+	mid = (length - head) & ~((uint64_t)BLK_SIZE - 1);
+	if (!mid || fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+			      offset + head, mid))
+		return bs_rdwr_fill(cmd, fd, offset, length);
+
+	bs_rdwr_dirty(fd, offset + head, mid);
+
+	return bs_rdwr_fill(cmd, fd, offset, head) ? :
+		bs_rdwr_fill(cmd, fd, offset + head + mid,
+			     length - head - mid);
+}
+
+struct unmap_range {
+	uint64_t offset;
+	uint64_t length;
+};
+
+static int unmap_range_cmp(const void *a, const void *b)
+{
+	const struct unmap_range *x = a, *y = b;
+
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/*
+ * UNMAP. The descriptors are checked, sorted and merged first, so that
+ * each run of adjacent or overlapping ranges is punched at once.
+ */
+static int bs_rdwr_unmap(struct scsi_cmd *cmd, int fd, uint8_t *key,
+			 uint16_t *asc)
+{
+	uint32_t length = scsi_get_out_length(cmd);
+	char *p = scsi_get_out_buffer(cmd);
+	struct unmap_range *r;
+	unsigned int i, n = 0;
+	uint64_t offset, tl;
+	int ret = 0;
+
+	if (length < 8)
+		return SAM_STAT_GOOD;
+
+	r = malloc((length - 8) / 16 * sizeof(*r) + 1);
+	if (!r) {
+		*key = HARDWARE_ERROR;
+		*asc = ASC_INTERNAL_TGT_FAILURE;
+		return SAM_STAT_CHECK_CONDITION;
+	}
+
+	for (p += 8, length -= 8; length >= 16; p += 16, length -= 16) {
+		offset = get_unaligned_be64(&p[0]) << cmd->dev->blk_shift;
+		tl = (uint64_t)get_unaligned_be32(&p[8]) <<
+			cmd->dev->blk_shift;
+
+		if (offset + tl > cmd->dev->size) {
+			eprintf("UNMAP beyond EOF\n");
+			free(r);
+			*key = ILLEGAL_REQUEST;
+			*asc = ASC_LBA_OUT_OF_RANGE;
+			return SAM_STAT_CHECK_CONDITION;
+		}
+
+		if (tl) {
+			r[n].offset = offset;
+			r[n++].length = tl;
+		}
+	}
+
+	qsort(r, n, sizeof(*r), unmap_range_cmp);
+
+	for (i = 0; i < n; i++) {
+		offset = r[i].offset;
+		tl = r[i].length;
+		while (i + 1 < n && r[i + 1].offset <= offset + tl) {
+			i++;
+			tl = max_t(uint64_t, tl,
+				   r[i].offset + r[i].length - offset);
+		}
+
+		ret = bs_rdwr_punch(cmd->subnet_addr, fd, offset, tl);
+		if (ret != 0) {
+			eprintf("Failed to punch hole for UNMAP at offset:%"
+				PRIu64 " length:%" PRIu64 "\n", offset, tl);
+			break;
+		}
+		extmap_unmap(cmd->subnet_addr, offset, tl);
+	}
+
+	free(r);
+
+	if (ret) {
+		*key = HARDWARE_ERROR;
+		*asc = ASC_INTERNAL_TGT_FAILURE;
+		return SAM_STAT_CHECK_CONDITION;
+	}
+
+	return SAM_STAT_GOOD;
+}
+
+/*
+ * Each worker thread keeps the buffer it reads the current data into for
+ * COMPARE AND WRITE, ORWRITE and VERIFY, grown to the largest transfer
+ * it has seen, and freed when the thread exits.
+ */
+struct scratch {
+	void *buf;
+	size_t len;
+};
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_free(void *arg)
+{
+	struct scratch *s = arg;
+
+	free(s->buf);
+	free(s);
+}
+
+static void scratch_key_init(void)
+{
+	pthread_key_create(&scratch_key, scratch_free);
+}
+
+static void *bs_rdwr_scratch(size_t len)
+{
+	struct scratch *s;
+	void *buf;
+
+	pthread_once(&scratch_once, scratch_key_init);
+	s = pthread_getspecific(scratch_key);
+	if (!s) {
+		s = zalloc(sizeof(*s));
+		if (!s)
+			return NULL;
+		if (pthread_setspecific(scratch_key, s)) {
+			free(s);
+			return NULL;
+		}
+	}
+
+	if (s->len < len) {
+		len = ALIGN(len, 64 * KB);
+		if (posix_memalign(&buf, BLK_SIZE, len))
+			return NULL;
+		free(s->buf);
+		s->buf = buf;
+		s->len = len;
+	}
+
+	return s->buf;
+}
+
+/*
+ * Offset of the first byte where a and b differ, or len. memcmp() finds
+ * whether a chunk differs, only that chunk is looked at bytewise.
+ */
+#define MISMATCH_CHUNK 256
+
+static size_t bs_rdwr_mismatch(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t pos, n;
+
+	for (pos = 0; pos < len; pos += n) {
+		n = min_t(size_t, len - pos, MISMATCH_CHUNK);
+		if (memcmp(a + pos, b + pos, n))
+			break;
+	}
+	for (; pos < len && a[pos] == b[pos]; pos++)
+		;
+
+	return pos;
+}
+
+/* dst |= src, a word at a time so that the compiler vectorizes it */
+static void bs_rdwr_or(uint8_t *restrict dst, const uint8_t *restrict src,
+		       size_t len)
+{
+	uint64_t d, v;
+	size_t i;
+
+	for (i = 0; i + sizeof(d) <= len; i += sizeof(d)) {
+		memcpy(&d, dst + i, sizeof(d));
+		memcpy(&v, src + i, sizeof(v));
+		d |= v;
+		memcpy(dst + i, &d, sizeof(d));
+	}
+	for (; i < len; i++)
+		dst[i] |= src[i];
+}
+
+/* Offset of the first miscompared byte, in fixed format sense data */
+static void set_miscompare_info(struct scsi_cmd *cmd, uint32_t pos)
+{
+	if (cmd->dev->attrs.sense_format)
+		return;
+
+	put_unaligned_be32(pos, cmd->sense_buffer + 3);
+	cmd->sense_buffer[0] |= 0x80;
+}
+
+/* WCE bit of the caching mode page */
+static int bs_rdwr_wce(struct scsi_lu *lu)
+{
+	struct mode_pg *pg;
+
+	pg = find_mode_page(lu, 0x08, 0);
+	return pg && (pg->mode_data[0] & 0x04);
+}
+
 static void bs_rdwr_request(struct scsi_cmd *cmd)
 {
 	int ret, fd;
@@ -188,23 +654,43 @@ static void bs_rdwr_request(struct scsi_cmd *cmd)
 	uint8_t key;
 	uint16_t asc;
 	char *tmpbuf;
-	size_t blocksize;
 	uint64_t offset = cmd->offset;
 	uint32_t tl     = cmd->tl;
 	int do_verify = 0;
-	int i;
-	char *ptr;
+	uint32_t miscompare = 0;
 	const char *write_buf = NULL;
 	ret = length = 0;
 	key = asc = 0;
 	fd = fd_map[cmd->subnet_addr];
 
+	switch (cmd->scb[0]) {
+	case ORWRITE_16:
+	case COMPARE_AND_WRITE:
+	case VERIFY_10:
+	case VERIFY_12:
+	case VERIFY_16:
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+	case PRE_FETCH_10:
+	case PRE_FETCH_16:
+		ret = wb_flush(cmd->subnet_addr, offset, tl);
+		break;
+	case UNMAP:
+		ret = wb_flush(cmd->subnet_addr, 0, 0);
+		break;
+	}
+
+	if (ret) {
+		set_medium_error(&result, &key, &asc);
+		goto out;
+	}
+
 	switch (cmd->scb[0])
 	{
 	case ORWRITE_16:
 		length = scsi_get_out_length(cmd);
 
-		tmpbuf = malloc(length);
+		tmpbuf = bs_rdwr_scratch(length);
 		if (!tmpbuf) {
 			result = SAM_STAT_CHECK_CONDITION;
 			key = HARDWARE_ERROR;
@@ -212,19 +698,15 @@ static void bs_rdwr_request(struct scsi_cmd *cmd)
 			break;
 		}
 
-		ret = __pread64(fd, tmpbuf, length, offset);
+		ret = client_pread(cmd->subnet_addr, fd, tmpbuf, length,
+				   offset);
 
 		if (ret != length) {
 			set_medium_error(&result, &key, &asc);
-			free(tmpbuf);
 			break;
 		}
 
-		ptr = scsi_get_out_buffer(cmd);
-		for (i = 0; i < length; i++)
-			ptr[i] |= tmpbuf[i];
-
-		free(tmpbuf);
+		bs_rdwr_or(scsi_get_out_buffer(cmd), (uint8_t *)tmpbuf, length);
 
 		write_buf = scsi_get_out_buffer(cmd);
 		goto write;
@@ -241,7 +723,7 @@ static void bs_rdwr_request(struct scsi_cmd *cmd)
 			break;
 		}
 
-		tmpbuf = malloc(length);
+		tmpbuf = bs_rdwr_scratch(length);
 		if (!tmpbuf) {
 			result = SAM_STAT_CHECK_CONDITION;
 			key = HARDWARE_ERROR;
@@ -249,32 +731,20 @@ static void bs_rdwr_request(struct scsi_cmd *cmd)
 			break;
 		}
 
-		ret = __pread64(fd, tmpbuf, length, offset);
+		ret = client_pread(cmd->subnet_addr, fd, tmpbuf, length,
+				   offset);
 
 		if (ret != length) {
 			set_medium_error(&result, &key, &asc);
-			free(tmpbuf);
 			break;
 		}
 
-		if (memcmp(scsi_get_out_buffer(cmd), tmpbuf, length)) {
-			uint32_t pos = 0;
-			char *spos = scsi_get_out_buffer(cmd);
-			char *dpos = tmpbuf;
-
-			/*
-			 * Data differed, this is assumed to be 'rare'
-			 * so use a much more expensive byte-by-byte
-			 * comparasion to find out at which offset the
-			 * data differs.
-			 */
-			for (pos = 0; pos < length && *spos++ == *dpos++;
-			     pos++)
-				;
+		miscompare = bs_rdwr_mismatch(scsi_get_out_buffer(cmd),
+					      (uint8_t *)tmpbuf, length);
+		if (miscompare < length) {
 			result = SAM_STAT_CHECK_CONDITION;
 			key = MISCOMPARE;
 			asc = ASC_MISCOMPARE_DURING_VERIFY_OPERATION;
-			free(tmpbuf);
 			break;
 		}
 
@@ -282,20 +752,26 @@ static void bs_rdwr_request(struct scsi_cmd *cmd)
 			posix_fadvise(fd, offset, length,
 				      POSIX_FADV_NOREUSE);
 
-		free(tmpbuf);
-
 		write_buf = scsi_get_out_buffer(cmd) + length;
 		goto write;
 	case SYNCHRONIZE_CACHE:
 	case SYNCHRONIZE_CACHE_16:
-		/* TODO */
-		length = (cmd->scb[0] == SYNCHRONIZE_CACHE) ? 0 : 0;
-
 		if (cmd->scb[1] & 0x2) {
 			result = SAM_STAT_CHECK_CONDITION;
 			key = ILLEGAL_REQUEST;
 			asc = ASC_INVALID_FIELD_IN_CDB;
+			break;
 		}
+
+		/* zero blocks means everything from the lba on */
+		offset = scsi_rw_offset(cmd->scb) << cmd->dev->blk_shift;
+		length = scsi_rw_count(cmd->scb) << cmd->dev->blk_shift;
+		if (offset && !length)
+			length = cmd->dev->size - offset;
+
+		ret = wb_sync(cmd->subnet_addr, fd, offset, length);
+		if (ret)
+			set_medium_error(&result, &key, &asc);
 		break;
 	case WRITE_VERIFY:
 	case WRITE_VERIFY_12:
@@ -308,11 +784,28 @@ static void bs_rdwr_request(struct scsi_cmd *cmd)
 		length = scsi_get_out_length(cmd);
 		write_buf = scsi_get_out_buffer(cmd);
 write:
-		ret = __pwrite64(fd, write_buf, length,
-			       offset);
+		/*
+		 * FUA writes, writes with WCE cleared and WRITE AND VERIFY,
+		 * which reads the image back, go straight out
+		 */
+		if ((cmd->scb[0] == WRITE_6 || !(cmd->scb[1] & 0x08)) &&
+		    !do_verify && !ram_overlay_enabled() && !dedup_enabled() &&
+		    bs_rdwr_wce(cmd->dev))
+			ret = wb_write(cmd->subnet_addr, fd, write_buf, length,
+				       offset);
+		else
+			ret = wb_flush(cmd->subnet_addr, offset, length) ? : 1;
+
+		if (ret == 0)
+			ret = length;
+		else if (ret == 1)
+			ret = client_pwrite(cmd->subnet_addr, fd, write_buf,
+					    length, offset);
 		if (ret == length) {
 			struct mode_pg *pg;
 
+			extmap_write(cmd->subnet_addr, offset, length);
+
 			/*
 			 * it would be better not to access to pg
 			 * directy.
@@ -327,6 +820,12 @@ write:
 		} else
 			set_medium_error(&result, &key, &asc);
 
+		/* FUA */
+		if (result == SAM_STAT_GOOD && cmd->scb[0] != WRITE_6 &&
+		    (cmd->scb[1] & 0x08) &&
+		    wb_sync(cmd->subnet_addr, fd, offset, length))
+			set_medium_error(&result, &key, &asc);
+
 		if ((cmd->scb[0] != WRITE_6) && (cmd->scb[1] & 0x10))
 			posix_fadvise(fd, offset, length,
 				      POSIX_FADV_NOREUSE);
@@ -337,7 +836,7 @@ write:
 	case WRITE_SAME_16:
 		/* WRITE_SAME used to punch hole in file */
 		if (cmd->scb[1] & 0x08) {
-			ret = unmap_file_region(fd, offset, tl);
+			ret = bs_rdwr_punch(cmd->subnet_addr, fd, offset, tl);
 			if (ret != 0) {
 				eprintf("Failed to punch hole for WRITE_SAME"
 					" command\n");
@@ -346,37 +845,27 @@ write:
 				asc = ASC_INTERNAL_TGT_FAILURE;
 				break;
 			}
+			extmap_unmap(cmd->subnet_addr, offset, tl);
 			break;
 		}
-		while (tl > 0) {
-			blocksize = 1 << cmd->dev->blk_shift;
-			tmpbuf = scsi_get_out_buffer(cmd);
-
-			switch(cmd->scb[1] & 0x06) {
-			case 0x02: /* PBDATA==0 LBDATA==1 */
-				put_unaligned_be32(offset, tmpbuf);
-				break;
-			case 0x04: /* PBDATA==1 LBDATA==0 */
-				/* physical sector format */
-				put_unaligned_be64(offset, tmpbuf);
-				break;
-			}
-
-			ret = __pwrite64(fd, tmpbuf, blocksize, offset);
-			if (ret != blocksize)
-				set_medium_error(&result, &key, &asc);
-
-			offset += blocksize;
-			tl     -= blocksize;
-		}
+		extmap_write(cmd->subnet_addr, offset, tl);
+		if (bs_rdwr_write_same(cmd, fd, offset, tl))
+			set_medium_error(&result, &key, &asc);
 		break;
 	case READ_6:
 	case READ_10:
 	case READ_12:
 	case READ_16:
 		length = scsi_get_in_length(cmd);
-		ret = __pread64(fd, scsi_get_in_buffer(cmd), length,
-			      offset);
+		ra_read(cmd->subnet_addr, offset, length);
+		ret = wb_read(cmd->subnet_addr, scsi_get_in_buffer(cmd),
+			      length, offset);
+		if (ret == 0)
+			ret = length;
+		else if (ret == 1)
+			ret = client_pread(cmd->subnet_addr, fd,
+					   scsi_get_in_buffer(cmd), length,
+					   offset);
 
 		if (ret != length)
 			set_medium_error(&result, &key, &asc);
@@ -400,7 +889,7 @@ write:
 verify:
 		length = scsi_get_out_length(cmd);
 
-		tmpbuf = malloc(length);
+		tmpbuf = bs_rdwr_scratch(length);
 		if (!tmpbuf) {
 			result = SAM_STAT_CHECK_CONDITION;
 			key = HARDWARE_ERROR;
@@ -408,21 +897,25 @@ verify:
 			break;
 		}
 
-		ret = __pread64(fd, tmpbuf, length, offset);
+		ret = client_pread(cmd->subnet_addr, fd, tmpbuf, length,
+				   offset);
 
 		if (ret != length)
 			set_medium_error(&result, &key, &asc);
-		else if (memcmp(scsi_get_out_buffer(cmd), tmpbuf, length)) {
-			result = SAM_STAT_CHECK_CONDITION;
-			key = MISCOMPARE;
-			asc = ASC_MISCOMPARE_DURING_VERIFY_OPERATION;
+		else {
+			miscompare = bs_rdwr_mismatch(scsi_get_out_buffer(cmd),
+						      (uint8_t *)tmpbuf,
+						      length);
+			if (miscompare < length) {
+				result = SAM_STAT_CHECK_CONDITION;
+				key = MISCOMPARE;
+				asc = ASC_MISCOMPARE_DURING_VERIFY_OPERATION;
+			}
 		}
 
 		if (cmd->scb[1] & 0x10)
 			posix_fadvise(fd, offset, length,
 				      POSIX_FADV_NOREUSE);
-
-		free(tmpbuf);
 		break;
 	case UNMAP:
 		if (!cmd->dev->attrs.thinprovisioning) {
@@ -432,51 +925,16 @@ verify:
 			break;
 		}
 
-		length = scsi_get_out_length(cmd);
-		tmpbuf = scsi_get_out_buffer(cmd);
-
-		if (length < 8)
-			break;
-
-		length -= 8;
-		tmpbuf += 8;
-
-		while (length >= 16) {
-			offset = get_unaligned_be64(&tmpbuf[0]);
-			offset = offset << cmd->dev->blk_shift;
-
-			tl = get_unaligned_be32(&tmpbuf[8]);
-			tl = tl << cmd->dev->blk_shift;
-
-			if (offset + tl > cmd->dev->size) {
-				eprintf("UNMAP beyond EOF\n");
-				result = SAM_STAT_CHECK_CONDITION;
-				key = ILLEGAL_REQUEST;
-				asc = ASC_LBA_OUT_OF_RANGE;
-				break;
-			}
-
-			if (tl > 0) {
-				if (unmap_file_region(fd, offset, tl) != 0) {
-					eprintf("Failed to punch hole for"
-						" UNMAP at offset:%" PRIu64
-						" length:%d\n",
-						offset, tl);
-					result = SAM_STAT_CHECK_CONDITION;
-					key = HARDWARE_ERROR;
-					asc = ASC_INTERNAL_TGT_FAILURE;
-					break;
-				}
-			}
-
-			length -= 16;
-			tmpbuf += 16;
-		}
+		result = bs_rdwr_unmap(cmd, fd, &key, &asc);
+		break;
+	case EXTENDED_COPY:
+		result = xcopy_execute(cmd, bs_rdwr_copy, &key, &asc);
 		break;
 	default:
 		break;
 	}
 
+out:
 	dprintf("io done %p %x %d %u\n", cmd, cmd->scb[0], ret, length);
 
 	scsi_set_result(cmd, result);
@@ -485,6 +943,8 @@ verify:
 		eprintf("io error %p %x %d %d %" PRIu64 ", %m\n",
 			cmd, cmd->scb[0], ret, length, offset);
 		sense_data_build(cmd, key, asc);
+		if (key == MISCOMPARE)
+			set_miscompare_info(cmd, miscompare);
 	}
 }
 
@@ -506,6 +966,8 @@ static int bs_rdwr_open(struct scsi_lu *lu, char *path, int *fd, uint64_t *size)
 	if (!lu->attrs.no_auto_lbppbe)
 		update_lbppbe(lu, blksize);
 
+	ra_master_open(*fd);
+
 	return 0;
 }
 
@@ -514,11 +976,217 @@ static void bs_rdwr_close(struct scsi_lu *lu)
 	close(lu->fd);
 }
 
+/*
+ * Write-back, RAM overlays, dedup, read-ahead and spares serve all
+ * clients of the process, so they are shared by the LUs. The first LU
+ * starts them, later ones may only repeat its settings, and the last
+ * one to go stops them.
+ */
+struct rdwr_conf {
+	uint32_t wb_kb, ram_mb, ra_kb, ra_hot;
+	int spares;			/* -1 if not given */
+	char *dedup_path;
+};
+
+/* spares kept unless told otherwise, resets should not wait on clones */
+#define RDWR_SPARES	4
+
+static struct rdwr_conf rdwr_conf;
+static int rdwr_users;
+
+static void rdwr_conf_stop(void)
+{
+	spare_exit();
+	ra_exit();
+	ram_overlay_exit();
+	wb_exit();
+	dedup_exit();
+	free(rdwr_conf.dedup_path);
+	memset(&rdwr_conf, 0, sizeof(rdwr_conf));
+}
+
+/* Takes over c->dedup_path */
+static tgtadm_err rdwr_conf_get(struct rdwr_conf *c)
+{
+	struct rdwr_conf *r = &rdwr_conf;
+
+	if (rdwr_users) {
+		if ((c->wb_kb && c->wb_kb != r->wb_kb) ||
+		    (c->ram_mb && c->ram_mb != r->ram_mb) ||
+		    (c->ra_kb && c->ra_kb != r->ra_kb) ||
+		    (c->ra_hot && c->ra_hot != r->ra_hot) ||
+		    (c->spares >= 0 && c->spares != r->spares) ||
+		    (c->dedup_path && (!r->dedup_path ||
+				       strcmp(c->dedup_path, r->dedup_path)))) {
+			eprintf("bs_rdwr: writeback, ramoverlay, dedup, "
+				"readahead and spares differ from the LUs "
+				"already open\n");
+			free(c->dedup_path);
+			return TGTADM_INVALID_REQUEST;
+		}
+		free(c->dedup_path);
+		rdwr_users++;
+		return TGTADM_SUCCESS;
+	}
+
+	*r = *c;
+	if (r->spares < 0)
+		r->spares = RDWR_SPARES;
+	if ((r->dedup_path && dedup_init(r->dedup_path)) ||
+	    (r->wb_kb && wb_init(r->wb_kb * KB)) ||
+	    ram_overlay_init(r->ram_mb) ||
+	    ra_init(r->ra_kb, r->ra_hot) ||
+	    spare_init(r->spares)) {
+		rdwr_conf_stop();
+		return TGTADM_UNKNOWN_ERR;
+	}
+	rdwr_users++;
+
+	return TGTADM_SUCCESS;
+}
+
+static void rdwr_conf_put(void)
+{
+	if (!--rdwr_users)
+		rdwr_conf_stop();
+}
+
 static tgtadm_err bs_rdwr_init(struct scsi_lu *lu, char *bsopts)
 {
 	struct bs_thread_info *info = BS_THREAD_I(lu);
+	uint32_t wb_kb = 0, ram_mb = 0, ra_kb = 0, ra_hot = 0;
+	struct qos_conf qos = { 0 };
+	struct rdwr_conf conf;
+	char *val, *dedup_path = NULL;
+	tgtadm_err adm_err;
+	int err, use_qos = 0, spares = -1;
+
+	while (bsopts && strlen(bsopts)) {
+		if (is_opt("writeback", bsopts)) {
+			/* KiB of write-back buffer per client */
+			val = slurp_value(&bsopts);
+			err = str_to_int(val, wb_kb);
+			free(val);
+			if (err || wb_kb > 1024 * 1024) {
+				eprintf("bs_rdwr: invalid writeback size\n");
+				free(dedup_path);
+				return TGTADM_INVALID_REQUEST;
+			}
+		} else if (is_opt("ramoverlay", bsopts)) {
+			/* MiB of RAM overlay per client */
+			val = slurp_value(&bsopts);
+			err = str_to_int(val, ram_mb);
+			free(val);
+			if (err || ram_mb > 1024 * 1024) {
+				eprintf("bs_rdwr: invalid ramoverlay size\n");
+				free(dedup_path);
+				return TGTADM_INVALID_REQUEST;
+			}
+		} else if (is_opt("readahead", bsopts)) {
+			/* KiB a client's sequential reads are prefetched */
+			val = slurp_value(&bsopts);
+			err = str_to_int(val, ra_kb);
+			free(val);
+			if (err || ra_kb > 64 * 1024) {
+				eprintf("bs_rdwr: invalid readahead size\n");
+				free(dedup_path);
+				return TGTADM_INVALID_REQUEST;
+			}
+		} else if (is_opt("readahead_hot", bsopts)) {
+			/* hotmap count from which blocks are loaded at boot */
+			val = slurp_value(&bsopts);
+			err = str_to_int(val, ra_hot);
+			free(val);
+			if (err || ra_hot > INT8_MAX - 1) {
+				eprintf("bs_rdwr: invalid readahead_hot count\n");
+				free(dedup_path);
+				return TGTADM_INVALID_REQUEST;
+			}
+		} else if (is_opt("qos", bsopts)) {
+			/* fair queueing across clients */
+			val = slurp_value(&bsopts);
+			use_qos = !strcmp(val, "on");
+			if (!use_qos && strcmp(val, "off")) {
+				eprintf("bs_rdwr: qos is on or off\n");
+				free(val);
+				free(dedup_path);
+				return TGTADM_INVALID_REQUEST;
+			}
+			free(val);
+		} else if (is_opt("qos_iops", bsopts) ||
+			   is_opt("qos_bw", bsopts) ||
+			   is_opt("qos_boot", bsopts)) {
+			/* per-client caps and boot window, imply qos=on */
+			uint32_t *v = &qos.boot_secs;
+
+			if (is_opt("qos_iops", bsopts))
+				v = &qos.iops;
+			else if (is_opt("qos_bw", bsopts))
+				v = &qos.bw_mb;
+
+			val = slurp_value(&bsopts);
+			err = str_to_int(val, *v);
+			free(val);
+			if (err || *v > 1000000) {
+				eprintf("bs_rdwr: invalid qos setting\n");
+				free(dedup_path);
+				return TGTADM_INVALID_REQUEST;
+			}
+			use_qos = 1;
+		} else if (is_opt("spares", bsopts)) {
+			/* fresh client images kept ready */
+			val = slurp_value(&bsopts);
+			err = str_to_int(val, spares);
+			free(val);
+			if (err || spares < 0 || spares > 64) {
+				eprintf("bs_rdwr: invalid number of spares\n");
+				free(dedup_path);
+				return TGTADM_INVALID_REQUEST;
+			}
+		} else if (is_opt("dedup", bsopts)) {
+			/* pool file shared by the clients' overlays */
+			free(dedup_path);
+			dedup_path = slurp_value(&bsopts);
+		} else {
+			val = slurp_to_semi(&bsopts);
+			eprintf("bs_rdwr: ignoring unknown option \"%s\"\n",
+				val);
+			free(val);
+		}
+	}
+
+	if (ram_mb && dedup_path) {
+		eprintf("bs_rdwr: ramoverlay and dedup are exclusive\n");
+		free(dedup_path);
+		return TGTADM_INVALID_REQUEST;
+	}
+
+	conf.wb_kb = wb_kb;
+	conf.ram_mb = ram_mb;
+	conf.ra_kb = ra_kb;
+	conf.ra_hot = ra_hot;
+	conf.spares = spares;
+	conf.dedup_path = dedup_path;
+	adm_err = rdwr_conf_get(&conf);
+	if (adm_err != TGTADM_SUCCESS)
+		return adm_err;
+
+	if (use_qos) {
+		info->qos = qos_init(&qos);
+		if (!info->qos) {
+			rdwr_conf_put();
+			return TGTADM_NOMEM;
+		}
+	}
+
+	adm_err = bs_thread_open(info, bs_rdwr_request, nr_iothreads);
+	if (adm_err != TGTADM_SUCCESS) {
+		qos_exit(info->qos);
+		info->qos = NULL;
+		rdwr_conf_put();
+	}
 
-	return bs_thread_open(info, bs_rdwr_request, nr_iothreads);
+	return adm_err;
 }
 
 static void bs_rdwr_exit(struct scsi_lu *lu)
@@ -526,6 +1194,7 @@ static void bs_rdwr_exit(struct scsi_lu *lu)
 	struct bs_thread_info *info = BS_THREAD_I(lu);
 
 	bs_thread_close(info);
+	rdwr_conf_put();
 }
 
 static struct backingstore_template rdwr_bst = {
@@ -566,6 +1235,7 @@ __attribute__((constructor)) static void bs_rdwr_constructor(void)
 	unsigned char sbc_opcodes[] = {
 		ALLOW_MEDIUM_REMOVAL,
 		COMPARE_AND_WRITE,
+		EXTENDED_COPY,
 		FORMAT_UNIT,
 		INQUIRY,
 		MAINT_PROTOCOL_IN,
@@ -583,6 +1253,7 @@ __attribute__((constructor)) static void bs_rdwr_constructor(void)
 		READ_16,
 		READ_6,
 		READ_CAPACITY,
+		RECEIVE_COPY_RESULTS,
 		RELEASE,
 		REPORT_LUNS,
 		REQUEST_SENSE,
@@ -277,11 +277,12 @@ struct sheepdog_access_info {
 	 * maximum length of fd_list_head: nr_iothreads + 1
 	 * (+ 1 is for main thread)
 	 *
-	 * TODO: more effective data structure for handling massive parallel
-	 * access
+	 * Each thread finds its own entry through fd_key, the list is
+	 * only walked to close them all.
 	 */
 	struct list_head fd_list_head;
 	pthread_rwlock_t fd_list_lock;
+	pthread_key_t fd_key;
 
 	struct sheepdog_inode inode;
 	pthread_rwlock_t inode_lock;
@@ -289,7 +290,8 @@ struct sheepdog_access_info {
 	pthread_mutex_t inode_version_mutex;
 	uint64_t inode_version;
 
-	struct list_head inflight_list_head;
+	/* one bit per data object some request is working on */
+	unsigned long *inflight_map;
 	pthread_mutex_t inflight_list_mutex;
 	pthread_cond_t inflight_list_cond;
 };
@@ -460,14 +462,9 @@ static int get_my_fd(struct sheepdog_access_info *ai)
 	struct sheepdog_fd_list *p;
 	int fd;
 
-	pthread_rwlock_rdlock(&ai->fd_list_lock);
-	list_for_each_entry(p, &ai->fd_list_head, list) {
-		if (p->id == self_id) {
-			pthread_rwlock_unlock(&ai->fd_list_lock);
-			return p->fd;
-		}
-	}
-	pthread_rwlock_unlock(&ai->fd_list_lock);
+	p = pthread_getspecific(ai->fd_key);
+	if (p)
+		return p->fd;
 
 	if (ai->is_unix)
 		fd = connect_to_sdog_unix(ai->uds_path);
@@ -490,6 +487,8 @@ static int get_my_fd(struct sheepdog_access_info *ai)
 	list_add_tail(&p->list, &ai->fd_list_head);
 	pthread_rwlock_unlock(&ai->fd_list_lock);
 
+	pthread_setspecific(ai->fd_key, p);
+
 	return p->fd;
 }
 
@@ -501,6 +500,8 @@ static void close_my_fd(struct sheepdog_access_info *ai, int fd)
 	pthread_rwlock_wrlock(&ai->fd_list_lock);
 	list_for_each_entry(p, &ai->fd_list_head, list) {
 		if (p->fd == fd) {
+			if (pthread_getspecific(ai->fd_key) == p)
+				pthread_setspecific(ai->fd_key, NULL);
 			close(fd);
 			list_del(&p->list);
 			free(p);
@@ -915,6 +916,121 @@ static int is_refresh_required(struct sheepdog_access_info *ai)
 	return need_reload_inode;
 }
 
+/* object requests one command may have outstanding on its connection */
+#define SD_PIPELINE_MAX 32
+
+/*
+ * The fast path of sd_io() for a request spanning several data objects
+ * that all exist, and for a write all belong to the working VDI: the
+ * requests for all objects go out back to back on the thread's
+ * connection, and the replies are matched to them by id in whatever
+ * order sheep completes them. Returns 1 for anything else, a COW, a
+ * hole, a reply other than success or a broken connection, and sd_io()
+ * then does the request object by object, as it can handle all of
+ * those. Reads and writes to existing objects can be repeated.
+ */
+static int sd_io_pipelined(struct sheepdog_access_info *ai, int write,
+			   char *buf, int len, uint64_t offset)
+{
+	static __thread uint32_t next_id;
+	uint32_t object_size = (UINT32_C(1) << ai->inode.block_size_shift);
+	unsigned long idx = offset / object_size;
+	unsigned long max = (offset + len + (object_size - 1)) / object_size;
+	uint32_t pos[SD_PIPELINE_MAX], size[SD_PIPELINE_MAX];
+	uint8_t done[SD_PIPELINE_MAX];
+	uint32_t vid, base, obj_offset, rest = len;
+	struct sheepdog_obj_req hdr;
+	struct sheepdog_obj_rsp *rsp = (struct sheepdog_obj_rsp *)&hdr;
+	unsigned int i, nr = max - idx, wlen;
+	int sockfd, ret = 0;
+
+	if (nr < 2 || nr > SD_PIPELINE_MAX)
+		return 1;
+
+	pthread_rwlock_rdlock(&ai->inode_lock);
+
+	vid = ai->inode.vdi_id;
+	for (i = 0; i < nr; i++) {
+		if (write ? ai->inode.data_vdi_id[idx + i] != vid :
+		    !ai->inode.data_vdi_id[idx + i]) {
+			ret = 1;
+			goto out;
+		}
+	}
+
+	sockfd = get_my_fd(ai);
+	if (sockfd < 0) {
+		ret = 1;
+		goto out;
+	}
+
+	base = next_id;
+	next_id += nr;
+	obj_offset = offset % object_size;
+	for (i = 0; i < nr; i++) {
+		pos[i] = len - rest;
+		size[i] = min_t(uint32_t, object_size - obj_offset, rest);
+		done[i] = 0;
+
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.proto_ver = SD_PROTO_VER;
+		hdr.id = base + i;
+		hdr.oid = vid_to_data_oid(ai->inode.data_vdi_id[idx + i],
+					  idx + i);
+		hdr.data_length = size[i];
+		hdr.offset = obj_offset;
+		hdr.copies = ai->inode.nr_copies;
+		hdr.flags = SD_FLAG_CMD_TGT;
+		if (write) {
+			/* as in sd_io(), sheep may cache */
+			hdr.opcode = SD_OP_WRITE_OBJ;
+			hdr.flags |= SD_FLAG_CMD_WRITE | SD_FLAG_CMD_CACHE;
+			wlen = size[i];
+		} else {
+			hdr.opcode = SD_OP_READ_OBJ;
+			wlen = 0;
+		}
+
+		if (send_req(sockfd, (struct sheepdog_req *)&hdr,
+			     buf + pos[i], &wlen))
+			goto broken;
+
+		rest -= size[i];
+		obj_offset = 0;
+	}
+
+	for (nr = i; nr; nr--) {
+		if (do_read(sockfd, rsp, sizeof(*rsp)))
+			goto broken;
+
+		i = rsp->id - base;
+		if (i >= SD_PIPELINE_MAX || i >= max - idx || done[i] ||
+		    (!write && rsp->data_length > size[i])) {
+			eprintf("unexpected reply %u from the sheep\n",
+				rsp->id);
+			goto broken;
+		}
+		done[i] = 1;
+
+		if (!write && rsp->data_length &&
+		    do_read(sockfd, buf + pos[i], rsp->data_length))
+			goto broken;
+
+		/* the other replies are still read, to keep in step */
+		if (rsp->result != SD_RES_SUCCESS ||
+		    (!write && rsp->data_length != size[i]))
+			ret = 1;
+	}
+
+out:
+	pthread_rwlock_unlock(&ai->inode_lock);
+	return ret;
+broken:
+	close_my_fd(ai, sockfd);
+	pthread_rwlock_unlock(&ai->inode_lock);
+	return 1;
+}
+
 static int sd_io(struct sheepdog_access_info *ai, int write, char *buf, int len,
 		 uint64_t offset)
 {
@@ -934,6 +1050,9 @@ static int sd_io(struct sheepdog_access_info *ai, int write, char *buf, int len,
 	int read_reload_snap = 0;
 	uint32_t min_dirty_data_idx = UINT32_MAX, max_dirty_data_idx = 0;
 
+	if (!sd_io_pipelined(ai, write, buf, len, offset))
+		return 0;
+
 	goto do_req;
 
 reload_in_read_path:
@@ -1254,7 +1373,13 @@ static int sd_open(struct sheepdog_access_info *ai, char *filename, int flags)
 
 	ret = 0;
 
-	INIT_LIST_HEAD(&ai->inflight_list_head);
+	if (!ai->inflight_map)
+		ai->inflight_map = zalloc(BITS_TO_LONGS(MAX_DATA_OBJS) *
+					  sizeof(unsigned long));
+	if (!ai->inflight_map) {
+		ret = -1;
+		goto out;
+	}
 	pthread_mutex_init(&ai->inflight_list_mutex, NULL);
 	pthread_cond_init(&ai->inflight_list_cond, NULL);
 
@@ -1294,37 +1419,46 @@ static void set_medium_error(int *result, uint8_t *key, uint16_t *asc)
 
 struct inflight_thread {
 	unsigned long min_idx, max_idx;
-	struct list_head list;
 };
 
+/*
+ * Waits until no other request works on the data objects min_idx to
+ * max_idx, then claims them. A request touches one object or two, so
+ * checking their bits beats walking the other requests.
+ */
 static void inflight_block(struct sheepdog_access_info *ai,
 			   struct inflight_thread *myself)
 {
-	struct inflight_thread *inflight;
+	unsigned long idx;
 
 	pthread_mutex_lock(&ai->inflight_list_mutex);
 
 retry:
-	list_for_each_entry(inflight, &ai->inflight_list_head, list) {
-		if (!(myself->max_idx < inflight->min_idx ||
-		      inflight->max_idx < myself->min_idx)) {
+	for (idx = myself->min_idx; idx <= myself->max_idx; idx++) {
+		if (test_bit(idx, ai->inflight_map)) {
 			pthread_cond_wait(&ai->inflight_list_cond,
 					  &ai->inflight_list_mutex);
 			goto retry;
 		}
 	}
 
-	list_add_tail(&myself->list, &ai->inflight_list_head);
+	for (idx = myself->min_idx; idx <= myself->max_idx; idx++)
+		set_bit(idx, ai->inflight_map);
 	pthread_mutex_unlock(&ai->inflight_list_mutex);
 }
- void inflight_release(struct sheepdog_access_info *ai,
+
+static void inflight_release(struct sheepdog_access_info *ai,
 			     struct inflight_thread *myself)
 {
+	unsigned long idx;
+
 	pthread_mutex_lock(&ai->inflight_list_mutex);
-	list_del(&myself->list);
+	for (idx = myself->min_idx; idx <= myself->max_idx; idx++)
+		clear_bit(idx, ai->inflight_map);
 	pthread_mutex_unlock(&ai->inflight_list_mutex);
 
-	pthread_cond_signal(&ai->inflight_list_cond);
+	/* waiters may be after different objects, wake them all */
+	pthread_cond_broadcast(&ai->inflight_list_cond);
 }
 
 static void bs_sheepdog_request(struct scsi_cmd *cmd)
@@ -1343,7 +1477,6 @@ static void bs_sheepdog_request(struct scsi_cmd *cmd)
 	int inflight = 0;
 
 	memset(&myself, 0, sizeof(myself));
-	INIT_LIST_HEAD(&myself.list);
 
 	switch (cmd->scb[0]) {
 	case SYNCHRONIZE_CACHE:
@@ -1359,7 +1492,7 @@ static void bs_sheepdog_request(struct scsi_cmd *cmd)
 		length = scsi_get_out_length(cmd);
 
 		myself.min_idx = cmd->offset / object_size;
-		myself.max_idx = (cmd->offset + length + (object_size - 1))
+		myself.max_idx = (cmd->offset + max_t(uint32_t, length, 1) - 1)
 			/ object_size;
 		inflight_block(ai, &myself);
 		inflight = 1;
@@ -1377,7 +1510,7 @@ static void bs_sheepdog_request(struct scsi_cmd *cmd)
 		length = scsi_get_in_length(cmd);
 
 		myself.min_idx = cmd->offset / object_size;
-		myself.max_idx = (cmd->offset + length + (object_size - 1))
+		myself.max_idx = (cmd->offset + max_t(uint32_t, length, 1) - 1)
 			/ object_size;
 		inflight_block(ai, &myself);
 		inflight = 1;
@@ -1440,6 +1573,7 @@ static tgtadm_err bs_sheepdog_init(struct scsi_lu *lu, char *bsopts)
 
 	INIT_LIST_HEAD(&ai->fd_list_head);
 	pthread_rwlock_init(&ai->fd_list_lock, NULL);
+	pthread_key_create(&ai->fd_key, NULL);
 	pthread_rwlock_init(&ai->inode_lock, NULL);
 	pthread_mutex_init(&ai->inode_version_mutex, NULL);
 
@@ -1462,8 +1596,10 @@ static void bs_sheepdog_exit(struct scsi_lu *lu)
 		free(p);
 	}
 
+	pthread_key_delete(ai->fd_key);
 	pthread_rwlock_destroy(&ai->fd_list_lock);
 	pthread_rwlock_destroy(&ai->inode_lock);
+	free(ai->inflight_map);
 
 	dprintf("cleaned logical unit %p safely\n", lu);
 }
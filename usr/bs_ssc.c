@@ -28,6 +28,7 @@
 
 #include <linux/fs.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
 
 #include "list.h"
 #include "util.h"
@@ -44,6 +45,9 @@
 #define SENSE_EOM	0x40
 #define SENSE_ILI	0X20
 
+/* blocks read or written with one system call */
+#define SSC_BATCH	64
+
 static void ssc_sense_data_build(struct scsi_cmd *cmd, uint8_t key,
 				 uint16_t asc, uint8_t *info, int info_len)
 {
@@ -79,38 +83,32 @@ static int skip_next_header(struct scsi_lu *lu)
 	return ssc_read_blkhdr(lu->fd, h, h->next);
 }
 
-static int skip_prev_header(struct scsi_lu *lu)
+static inline uint64_t ssc_eod(struct ssc_info *ssc)
+{
+	return ssc->index.hdr->nr - 1;
+}
+
+/* Moves to block n, BOT being block 0 */
+static int locate_blk(struct scsi_lu *lu, uint64_t n)
 {
-	ssize_t rd;
 	struct ssc_info *ssc = dtype_priv(lu);
-	struct blk_header_info *h = &ssc->c_blk;
 
-	rd = ssc_read_blkhdr(lu->fd, h, h->prev);
-	if (rd)
+	if (n >= ssc->index.hdr->nr)
 		return 1;
-	if (h->blk_type == BLK_BOT)
-		return skip_next_header(lu);
-	return 0;
+
+	return ssc_read_blkhdr(lu->fd, &ssc->c_blk, ssc->index.e[n].offset);
 }
 
 static int resp_rewind(struct scsi_lu *lu)
 {
-	int fd;
-	ssize_t rd;
-	struct ssc_info *ssc = dtype_priv(lu);
-	struct blk_header_info *h = &ssc->c_blk;
+	dprintf("*** Backing store fd: %s %d ***\n", lu->path, lu->fd);
 
-	fd = lu->fd;
-
-	dprintf("*** Backing store fd: %s %d %d ***\n", lu->path, lu->fd, fd);
-
-	rd = ssc_read_blkhdr(fd, h, 0);
-	if (rd) {
+	if (locate_blk(lu, 1)) {
 		eprintf("fail to read the first block header\n");
 		return 1;
 	}
 
-	return skip_next_header(lu);
+	return 0;
 }
 
 static uint64_t current_size(struct scsi_cmd *cmd)
@@ -119,131 +117,159 @@ static uint64_t current_size(struct scsi_cmd *cmd)
 	return ssc->c_blk.curr;
 }
 
-static int append_blk(struct scsi_cmd *cmd, uint8_t *data,
-		      int size, int orig_sz, int type)
+/*
+ * Writes count blocks of size from data at the current position, and
+ * a new EOD after them, SSC_BATCH blocks and their headers at a time.
+ */
+static int append_blks(struct scsi_cmd *cmd, uint8_t *data,
+		       int size, int orig_sz, int count, int type)
 {
-	int fd;
 	struct ssc_info *ssc = dtype_priv(cmd->dev);
-	struct blk_header_info c, *curr = &c;
-	struct blk_header_info e, *eod = &e;
-	ssize_t ret;
+	struct blk_header_info info[SSC_BATCH + 1], *h;
+	struct blk_header hdr[SSC_BATCH + 1];
+	struct iovec iov[SSC_BATCH * 2 + 1];
+	int i, n, nr_iov;
+	ssize_t len, ret;
+
+	while (count > 0) {
+		n = min(count, SSC_BATCH);
+		nr_iov = 0;
+		len = 0;
+
+		dprintf("Appending %d blocks of %d at %" PRId64 ", num: %"
+			PRIx64 "\n", n, size, ssc->c_blk.curr,
+			ssc->c_blk.blk_num);
+
+		/* the current block is replaced */
+		info[0] = ssc->c_blk;
+		for (i = 0; i <= n; i++) {
+			h = &info[i];
+			if (i) {
+				h->prev = info[i - 1].curr;
+				h->curr = info[i - 1].next;
+				h->blk_num = info[i - 1].blk_num + 1;
+			}
+			if (i < n) {
+				h->blk_type = type;
+				h->ondisk_sz = size;
+				h->blk_sz = orig_sz;
+				h->next = h->curr + SSC_BLK_HDR_SIZE + size;
+			} else {
+				/* EOD points at itself */
+				h->blk_type = BLK_EOD;
+				h->ondisk_sz = 0;
+				h->blk_sz = 0;
+				h->next = h->curr;
+			}
 
-	fd = cmd->dev->fd;
-	*curr = ssc->c_blk;
-
-	dprintf("B4 update     : prev/curr/next"
-		" <%" PRId64 "/%" PRId64 "/%" PRId64 "> type: %d,"
-		" num: %" PRIx64 ", ondisk sz: %d, about to write %d\n",
-		curr->prev, curr->curr, curr->next,
-		curr->blk_type, curr->blk_num,
-		curr->ondisk_sz, size);
-
-	curr->next = curr->curr + size + SSC_BLK_HDR_SIZE;
-	curr->blk_type = type;
-	curr->ondisk_sz = size;
-	curr->blk_sz = orig_sz;
-	eod->prev = curr->curr;
-	eod->curr = curr->next;
-	eod->next = curr->next;
-	eod->ondisk_sz = 0;
-	eod->blk_sz = 0;
-	eod->blk_type = BLK_EOD;
-	eod->blk_num = curr->blk_num + 1;
-
-	memcpy(&ssc->c_blk, eod, sizeof(*eod));
-
-	dprintf("After update  : prev/curr/next <%" PRId64 "/%" PRId64
-		"/%" PRId64 "> type: %d, num: %" PRIx64 ", ondisk sz: %d\n",
-		curr->prev, curr->curr, curr->next, curr->blk_type,
-		curr->blk_num, curr->ondisk_sz);
-
-	dprintf("EOD blk header: prev/curr/next <%" PRId64 "/%" PRId64
-		"/%" PRId64 "> type: %d, num: %" PRIx64 ", ondisk sz: %d\n",
-		eod->prev, eod->curr, eod->next, eod->blk_type, eod->blk_num,
-		eod->ondisk_sz);
-
-	/* Rewrite previous header with updated positioning info */
-	ret = ssc_write_blkhdr(fd, curr, curr->curr);
-	if (ret) {
-		eprintf("Rewrite of blk header failed: %m\n");
-		sense_data_build(cmd, MEDIUM_ERROR, ASC_WRITE_ERROR);
-		return SAM_STAT_CHECK_CONDITION;
-	}
-	/* Write new EOD blk header */
-	ret = ssc_write_blkhdr(fd, eod, eod->curr);
-	if (ret) {
-		eprintf("Write of EOD blk header failed: %m\n");
-		sense_data_build(cmd, MEDIUM_ERROR, ASC_WRITE_ERROR);
-		return SAM_STAT_CHECK_CONDITION;
-	}
+			ssc_pack_blkhdr(h, &hdr[i]);
+			iov[nr_iov].iov_base = &hdr[i];
+			iov[nr_iov++].iov_len = SSC_BLK_HDR_SIZE;
+			len += SSC_BLK_HDR_SIZE;
+			if (i < n && size) {
+				iov[nr_iov].iov_base = data;
+				iov[nr_iov++].iov_len = size;
+				len += size;
+				data += size;
+			}
+		}
 
-	/* Write any data */
-	if (size) {
-		ret = pwrite64(fd, data, size,
-			       curr->curr + SSC_BLK_HDR_SIZE);
-		if (ret != size) {
-			eprintf("Write of data failed: %m\n");
+		ret = pwritev64(cmd->dev->fd, iov, nr_iov, info[0].curr);
+		if (ret != len) {
+			eprintf("Write of blocks failed: %m\n");
 			sense_data_build(cmd, MEDIUM_ERROR, ASC_WRITE_ERROR);
 			return SAM_STAT_CHECK_CONDITION;
 		}
+
+		for (i = 0; i <= n; i++) {
+			if (ssc_index_put(&ssc->index, &info[i])) {
+				eprintf("Update of tape index failed\n");
+				sense_data_build(cmd, MEDIUM_ERROR,
+						 ASC_WRITE_ERROR);
+				return SAM_STAT_CHECK_CONDITION;
+			}
+		}
+
+		ssc->c_blk = info[n];
+		count -= n;
 	}
-	/* Write new EOD blk header */
 
 	return SAM_STAT_GOOD;
 }
 
+/*
+ * Spacing is done on the index. A block's filemark count includes the
+ * block itself, so the n-th filemark from block c on is the first block
+ * whose count reaches that of block c - 1 plus n.
+ */
 static int space_filemark_reverse(struct scsi_cmd *cmd, int32_t count)
 {
 	struct ssc_info *ssc = dtype_priv(cmd->dev);
-	struct blk_header_info *h = &ssc->c_blk;
+	struct blk_index *e = ssc->index.e;
+	uint64_t c = ssc->c_blk.blk_num, lo = 1, hi, mid, marks;
 
 	count *= -1;
 
-again:
-	if (!h->prev) {
+	/*
+	 * end up before the count-th filemark back from here, c included,
+	 * or on block 1 if that is the filemark, as BOT is no position
+	 */
+	if (e[c].marks - e[0].marks < count) {
+		if (locate_blk(cmd->dev, 1))
+			goto corrupt;
 		sense_data_build(cmd, NO_SENSE, ASC_BOM);
 		return SAM_STAT_CHECK_CONDITION;
 	}
 
-	if (h->blk_type == BLK_FILEMARK)
-		count--;
-
-	if (skip_prev_header(cmd->dev)) {
-		sense_data_build(cmd, MEDIUM_ERROR,
-				 ASC_MEDIUM_FORMAT_CORRUPT);
-		return SAM_STAT_CHECK_CONDITION;
+	marks = e[c].marks - count;
+	hi = c - 1;
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (e[mid].marks <= marks)
+			lo = mid;
+		else
+			hi = mid - 1;
 	}
 
-	if (count > 0)
-		goto again;
+	if (locate_blk(cmd->dev, lo))
+		goto corrupt;
 
 	return SAM_STAT_GOOD;
+corrupt:
+	sense_data_build(cmd, MEDIUM_ERROR, ASC_MEDIUM_FORMAT_CORRUPT);
+	return SAM_STAT_CHECK_CONDITION;
 }
 
 static int space_filemark_forward(struct scsi_cmd *cmd, int32_t count)
 {
 	struct ssc_info *ssc = dtype_priv(cmd->dev);
-	struct blk_header_info *h = &ssc->c_blk;
-
-again:
-	if (h->blk_type == BLK_EOD) {
+	struct blk_index *e = ssc->index.e;
+	uint64_t lo = ssc->c_blk.blk_num, hi = ssc_eod(ssc), mid, marks;
+
+	/* end up after the count-th filemark from here, lo included */
+	marks = e[lo - 1].marks + count;
+	if (e[hi].marks < marks) {
+		if (locate_blk(cmd->dev, hi))
+			goto corrupt;
 		sense_data_build(cmd, NO_SENSE, ASC_END_OF_DATA);
 		return SAM_STAT_CHECK_CONDITION;
 	}
 
-	if (h->blk_type == BLK_FILEMARK)
-		count--;
-
-	if (skip_next_header(cmd->dev)) {
-		sense_data_build(cmd, MEDIUM_ERROR,
-				 ASC_MEDIUM_FORMAT_CORRUPT);
-		return SAM_STAT_CHECK_CONDITION;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (e[mid].marks < marks)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	if (count > 0)
-		goto again;
+	if (locate_blk(cmd->dev, lo + 1))
+		goto corrupt;
 
 	return SAM_STAT_GOOD;
+corrupt:
+	sense_data_build(cmd, MEDIUM_ERROR, ASC_MEDIUM_FORMAT_CORRUPT);
+	return SAM_STAT_CHECK_CONDITION;
 }
 
 static int space_filemark(struct scsi_cmd *cmd, int32_t count)
@@ -270,40 +296,42 @@ static int space_blocks(struct scsi_cmd *cmd, int32_t count)
 {
 	struct ssc_info *ssc = dtype_priv(cmd->dev);
 	struct blk_header_info *h = &ssc->c_blk;
+	uint64_t c = h->blk_num, eod = ssc_eod(ssc), n;
+	int result = SAM_STAT_GOOD;
+	uint16_t asc = 0;
 
 	dprintf("*** space %d blocks, %" PRIu64 "\n", count, h->curr);
 
-	while (count != 0) {
-		if (count > 0) {
-			if (skip_next_header(cmd->dev)) {
-				sense_data_build(cmd, MEDIUM_ERROR,
-						ASC_MEDIUM_FORMAT_CORRUPT);
-				return SAM_STAT_CHECK_CONDITION;
-			}
-			if (h->blk_type == BLK_EOD) {
-				sense_data_build(cmd, NO_SENSE,
-						ASC_END_OF_DATA);
-				return SAM_STAT_CHECK_CONDITION;
-			}
-			count--;
-		} else {
-			if (skip_prev_header(cmd->dev)) {
-				sense_data_build(cmd, MEDIUM_ERROR,
-						ASC_MEDIUM_FORMAT_CORRUPT);
-				return SAM_STAT_CHECK_CONDITION;
-			}
-			if (h->blk_type == BLK_BOT) {
-				/* Can't leave at BOT */
-				skip_next_header(cmd->dev);
+	if (!count)
+		return SAM_STAT_GOOD;
 
-				sense_data_build(cmd, NO_SENSE, ASC_BOM);
-				return SAM_STAT_CHECK_CONDITION;
-			}
-			count++;
+	if (count > 0) {
+		n = c + count;
+		if (n >= eod) {
+			n = eod;
+			asc = ASC_END_OF_DATA;
 		}
+	} else {
+		n = -(int64_t)count;
+		if (c <= n) {
+			/* Can't leave at BOT */
+			n = 1;
+			asc = ASC_BOM;
+		} else
+			n = c - n;
+	}
+
+	if (locate_blk(cmd->dev, n)) {
+		sense_data_build(cmd, MEDIUM_ERROR, ASC_MEDIUM_FORMAT_CORRUPT);
+		return SAM_STAT_CHECK_CONDITION;
+	}
+	if (asc) {
+		sense_data_build(cmd, NO_SENSE, asc);
+		result = SAM_STAT_CHECK_CONDITION;
 	}
+
 	dprintf("%" PRIu64 "\n", h->curr);
-	return SAM_STAT_GOOD;
+	return result;
 }
 
 static int resp_var_read(struct scsi_cmd *cmd, uint8_t *buf, uint32_t length,
@@ -367,12 +395,62 @@ out:
 	return result;
 }
 
+/*
+ * Reads up to count data blocks of block_length from the current one
+ * on, with their headers and the one following them, in one go. Only
+ * done where the index shows blocks back to back without a filemark,
+ * and only used if all headers turn out as expected. Returns the blocks
+ * read, 0 if the caller has to go block by block.
+ */
+static int read_blks(struct scsi_cmd *cmd, uint8_t *buf,
+		     uint32_t block_length, int count)
+{
+	struct ssc_info *ssc = dtype_priv(cmd->dev);
+	struct blk_index *e = ssc->index.e;
+	struct blk_header hdr[SSC_BATCH + 1];
+	struct blk_header_info h;
+	struct iovec iov[SSC_BATCH * 2 + 1];
+	uint64_t c = ssc->c_blk.blk_num;
+	uint64_t stride = SSC_BLK_HDR_SIZE + block_length;
+	ssize_t len;
+	int i, n;
+
+	n = min_t(uint64_t, min(count, SSC_BATCH), ssc_eod(ssc) - c);
+	while (n && e[c + n - 1].marks != e[c - 1].marks)
+		n--;
+	if (n < 2 || e[c + n].offset - e[c].offset != n * stride)
+		return 0;
+
+	for (i = 0; i <= n; i++) {
+		iov[i * 2].iov_base = &hdr[i];
+		iov[i * 2].iov_len = SSC_BLK_HDR_SIZE;
+		if (i < n) {
+			iov[i * 2 + 1].iov_base = buf + i * block_length;
+			iov[i * 2 + 1].iov_len = block_length;
+		}
+	}
+
+	len = n * stride + SSC_BLK_HDR_SIZE;
+	if (preadv64(cmd->dev->fd, iov, n * 2 + 1, e[c].offset) != len)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		ssc_unpack_blkhdr(&hdr[i], &h);
+		if (h.blk_type != BLK_UNCOMPRESS_DATA ||
+		    h.blk_sz != block_length || h.ondisk_sz != block_length)
+			return 0;
+	}
+	ssc_unpack_blkhdr(&hdr[n], &ssc->c_blk);
+
+	return n;
+}
+
 static int resp_fixed_read(struct scsi_cmd *cmd, uint8_t *buf, uint32_t length,
 			   int *transferred)
 {
 	struct ssc_info *ssc = dtype_priv(cmd->dev);
 	struct blk_header_info *h = &ssc->c_blk;
-	int i, ret, result = SAM_STAT_GOOD;
+	int i, n, ret, result = SAM_STAT_GOOD;
 	int count;
 	ssize_t residue;
 	int fd;
@@ -383,6 +461,14 @@ static int resp_fixed_read(struct scsi_cmd *cmd, uint8_t *buf, uint32_t length,
 	ret = 0;
 
 	for (i = 0; i < count; i++) {
+		n = read_blks(cmd, buf, block_length, count - i);
+		if (n) {
+			ret += n * block_length;
+			buf += n * block_length;
+			i += n - 1;
+			continue;
+		}
+
 		if (h->blk_type == BLK_FILEMARK) {
 			uint8_t info[4];
 
@@ -464,9 +550,7 @@ static void tape_rdwr_request(struct scsi_cmd *cmd)
 		dprintf("*** Write %d filemark%s ***\n", ret,
 			((ret > 1) || (ret < 0)) ? "s" : "");
 
-		for (i = 0; i < ret; i++)
-			append_blk(cmd, scsi_get_out_buffer(cmd), 0,
-					0, BLK_FILEMARK);
+		result = append_blks(cmd, NULL, 0, 0, ret, BLK_FILEMARK);
 		break;
 
 	case READ_6:
@@ -508,17 +592,13 @@ static void tape_rdwr_request(struct scsi_cmd *cmd)
 			count = 1;
 		}
 
-		for (i = 0, ret = 0; i < count; i++) {
-			if (append_blk(cmd, buf, block_length,
-				       block_length, BLK_UNCOMPRESS_DATA)) {
-				sense_data_build(cmd, MEDIUM_ERROR,
-						ASC_WRITE_ERROR);
-				result = SAM_STAT_CHECK_CONDITION;
-				break;
-			}
-			buf += block_length;
-			ret += block_length;
-		}
+		ret = 0;
+		if (append_blks(cmd, buf, block_length, block_length,
+				count, BLK_UNCOMPRESS_DATA)) {
+			sense_data_build(cmd, MEDIUM_ERROR, ASC_WRITE_ERROR);
+			result = SAM_STAT_CHECK_CONDITION;
+		} else
+			ret = count * block_length;
 
 		dprintf("*** WRITE_6 count: %d, length: %d, ret: %d, fixed: %s,"
 			" ssc->blk_sz: %d\n",
@@ -550,13 +630,11 @@ static void tape_rdwr_request(struct scsi_cmd *cmd)
 			result = space_filemark(cmd, count);
 			break;
 		} else if (code == 3) { /* End of data */
-			while (h->blk_type != BLK_EOD)
-				if (skip_next_header(cmd->dev)) {
-					sense_data_build(cmd, MEDIUM_ERROR,
-						ASC_MEDIUM_FORMAT_CORRUPT);
-					result = SAM_STAT_CHECK_CONDITION;
-					break;
-				}
+			if (locate_blk(cmd->dev, ssc_eod(ssc))) {
+				sense_data_build(cmd, MEDIUM_ERROR,
+						 ASC_MEDIUM_FORMAT_CORRUPT);
+				result = SAM_STAT_CHECK_CONDITION;
+			}
 		} else { /* Unsupported */
 			sense_data_build(cmd, ILLEGAL_REQUEST,
 						ASC_INVALID_FIELD_IN_CDB);
@@ -564,6 +642,34 @@ static void tape_rdwr_request(struct scsi_cmd *cmd)
 		}
 		break;
 
+	case LOCATE_10:
+	{
+		uint64_t blk = get_unaligned_be32(&cmd->scb[3]) + 1ULL;
+
+		dprintf("**** Locate %" PRIu64 " ****\n", blk - 1);
+
+		/* a single partition only */
+		if (cmd->scb[1] & 0x02) {
+			sense_data_build(cmd, ILLEGAL_REQUEST,
+						ASC_INVALID_FIELD_IN_CDB);
+			result = SAM_STAT_CHECK_CONDITION;
+			break;
+		}
+
+		code = blk > ssc_eod(ssc);
+		if (code)
+			blk = ssc_eod(ssc);
+		if (locate_blk(cmd->dev, blk)) {
+			sense_data_build(cmd, MEDIUM_ERROR,
+						ASC_MEDIUM_FORMAT_CORRUPT);
+			result = SAM_STAT_CHECK_CONDITION;
+		} else if (code) {
+			sense_data_build(cmd, BLANK_CHECK, ASC_END_OF_DATA);
+			result = SAM_STAT_CHECK_CONDITION;
+		}
+		break;
+	}
+
 	case READ_POSITION:
 	{
 		int service_action = cmd->scb[1] & 0x1f;
@@ -576,7 +682,10 @@ static void tape_rdwr_request(struct scsi_cmd *cmd)
 
 		if (service_action == 0) {	/* Short form - block ID */
 			memset(data, 0, 20);
-			data[0] = 20;
+			/* BYCU, and BOP at the first block */
+			data[0] = h->blk_num == 1 ? 0x90 : 0x10;
+			put_unaligned_be32(h->blk_num - 1, &data[4]);
+			put_unaligned_be32(h->blk_num - 1, &data[8]);
 		} else if (service_action == 1) { /* Short form - vendor uniq */
 			memset(data, 0, 20);
 			data[0] = 20;
@@ -655,6 +764,19 @@ static int bs_ssc_open(struct scsi_lu *lu, char *path, int *fd, uint64_t *size)
 		return -1;
 	}
 
+	ret = ssc_index_open(&ssc->index, path, *fd,
+			     ssc->mam.medium_serial_number);
+	if (ret > 0) {
+		eprintf("Indexing %s\n", path);
+		ret = ssc_index_build(&ssc->index, *fd,
+				      ssc->mam.medium_serial_number);
+	}
+	if (ret) {
+		eprintf("Failed to index %s, medium format corrupt\n", path);
+		ssc_index_close(&ssc->index);
+		return -1;
+	}
+
 	switch (ssc->mam.medium_type) {
 	case CART_CLEAN:
 		cart = "Cleaning cartridge";
@@ -682,7 +804,10 @@ static void bs_ssc_exit(struct scsi_lu *lu)
 
 static void bs_ssc_close(struct scsi_lu *lu)
 {
+	struct ssc_info *ssc = dtype_priv(lu);
+
 	dprintf("##### Close #####\n");
+	ssc_index_close(&ssc->index);
 	close(lu->fd);
 }
 
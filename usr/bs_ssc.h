@@ -42,6 +42,30 @@ struct blk_header {
 	uint64_t next;
 };
 
+/*
+ * Index of a tape image, kept next to it as <image>.idx and mapped by
+ * tgtd. Entry n is block n of the image, BOT and EOD included, so
+ * positioning needs no walk along the list above. It is in host byte
+ * order, and rebuilt from the list when it doesn't match the image or
+ * was left dirty.
+ */
+#define SSC_INDEX_MAGIC		"TGTSSCIX"
+#define SSC_INDEX_VERSION	1
+
+struct blk_index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t dirty;		/* set while entries are being changed */
+	uint64_t nr;		/* entries in use */
+	uint8_t serial[32];	/* medium serial number of the image */
+	uint8_t __pad[8];
+};
+
+struct blk_index {
+	uint64_t offset;	/* of the block header */
+	uint64_t marks;		/* filemarks up to and including this block */
+};
+
 /*
  * MAM (media access memory) structure based from IBM Ultrium SCSI
  * Reference WB1109-02
@@ -1,5 +1,14 @@
 typedef void (request_func_t) (struct scsi_cmd *);
 
+/* per-client scheduling of a logical unit's commands, see qos.c */
+struct qos_conf {
+	uint32_t iops;		/* per client, 0 for no cap */
+	uint32_t bw_mb;		/* MiB/s per client, 0 for no cap */
+	uint32_t boot_secs;	/* reads first this long after a reset */
+};
+
+struct qos_sched;
+
 struct bs_thread_info {
 	pthread_t *worker_thread;
 	int nr_worker_threads;
@@ -10,6 +19,8 @@ struct bs_thread_info {
 	pthread_mutex_t pending_lock;
 	/* protected by pending_lock */
 	struct list_head pending_list;
+	/* instead of pending_list if set, protected by pending_lock */
+	struct qos_sched *qos;
 
 	request_func_t *request_fn;
 };
@@ -24,3 +35,8 @@ extern tgtadm_err bs_thread_open(struct bs_thread_info *info, request_func_t *rf
 extern void bs_thread_close(struct bs_thread_info *info);
 extern int bs_thread_cmd_submit(struct scsi_cmd *cmd);
 extern int nr_iothreads;
+
+extern struct qos_sched *qos_init(struct qos_conf *conf);
+extern void qos_exit(struct qos_sched *q);
+extern int qos_enqueue(struct qos_sched *q, struct scsi_cmd *cmd);
+extern struct scsi_cmd *qos_dequeue(struct qos_sched *q, uint64_t *wait);
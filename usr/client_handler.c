@@ -16,6 +16,7 @@
 
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <arpa/inet.h>
@@ -48,6 +49,12 @@ static const char msg[] =
 
 static pthread_mutex_t map_lock;
 
+/*
+ * Bumped by the reset handler whenever a client's image is reset.
+ * Shared with tgtd so that it can drop state it keeps for the old one.
+ */
+unsigned int *reset_gen;
+
 static void __attribute__((constructor)) init_mutex(void) {
 	pthread_mutex_init(&map_lock, NULL);
 }
@@ -56,7 +63,7 @@ void map_new_fd(int addr, bool skip) {
 	struct stat master_st_buf;
 	struct stat st_buf;
 	int flags = O_RDWR | O_CREAT | O_TRUNC;
-	int ret, new_fd;
+	int ret, new_fd, src_fd;
 	char path[PATH_MAX];
 
 	if (master_path == NULL) {
@@ -71,11 +78,28 @@ void map_new_fd(int addr, bool skip) {
 		map_del_fd(addr);
 	}
 
+	/*
+	 * A reset client moves to the newest version of the master image,
+	 * one that keeps its data stays on the version it was cloned from
+	 */
+	src_fd = master_bind(addr, skip);
+	if (src_fd < 0) {
+		fprintf(stderr, "Failed to open master image for addr %d: %s\n",
+			addr, strerror(-src_fd));
+		exit(1);
+	}
+
 	if (skip) // Do not remove existing data
 		flags &= ~O_TRUNC;
 
 	sprintf(path, "%s_%03d", master_path, addr);
-	new_fd = open(path, flags, 0644);
+
+	// A fresh image, take a ready-made one if there is
+	new_fd = -1;
+	if (flags & O_TRUNC)
+		new_fd = spare_take(path, master_version(addr));
+	if (new_fd == -1)
+		new_fd = open(path, flags, 0644);
 	if (new_fd == -1) {
 		fprintf(stderr, "Failed to create new path %s: %s\n",
 			path, strerror(errno));
@@ -86,7 +110,7 @@ void map_new_fd(int addr, bool skip) {
 	 * Check new file size and copy with reflink(CoW)
 	 * if it differs from the master image
 	 */
-	ret = fstat(master_fd, &master_st_buf);
+	ret = fstat(src_fd, &master_st_buf);
 	if (ret == -1) {
 		perror("Failed to fstat() master file");
 		exit(1);
@@ -94,7 +118,7 @@ void map_new_fd(int addr, bool skip) {
 
 	ret = fstat(new_fd, &st_buf);
 	if (ret == -1 || st_buf.st_size != master_st_buf.st_size) {
-		ret = ioctl(new_fd, FICLONE, master_fd);
+		ret = ioctl(new_fd, FICLONE, src_fd);
 		if (ret == -1) {
 			fprintf(stderr, "Failed to ioctl(FICLONE) to new path %s: %s\n",
 				path, strerror(errno));
@@ -105,6 +129,9 @@ void map_new_fd(int addr, bool skip) {
 
 	fd_map[addr] = new_fd;
 	fd_flag_map[addr] = clients_count;
+	fd_master_map[new_fd] = src_fd;
+	if (!skip)
+		__atomic_add_fetch(&reset_gen[addr], 1, __ATOMIC_RELEASE);
 
 	// Reset flag_map buffer for this client
 	memset((void*)flag_map + (MAP_LEN * clients_count), 0, IMG_SIZE_GB / BLK_SIZE);
@@ -121,6 +148,10 @@ void map_del_fd(int addr) {
 		return;
 	}
 
+	if (wb_flush(addr, 0, 0))
+		fprintf(stderr, "Failed to write back data for addr %d\n", addr);
+
+	fd_master_map[fd_map[addr]] = 0;
 	close(fd_map[addr]);
 
 	/*
@@ -253,6 +284,14 @@ void start_client_handler(void) {
 
 	signal(SIGCHLD, SIG_IGN);
 
+	reset_gen = mmap(NULL, sizeof(*reset_gen) * FD_LIMIT,
+			 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			 -1, 0);
+	if (reset_gen == MAP_FAILED) {
+		perror("Failed to mmap reset_gen");
+		exit(1);
+	}
+
 	printf("Starting reset slave handler\n");
 
 	do {
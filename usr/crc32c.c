@@ -38,13 +38,129 @@
    1.3  31 Dec 2015  Check for Intel architecture using compiler macro
                      Support big-endian processors in software calculation
                      Add header for external use
+
+   Modified for tgt: add PCLMULQDQ and VPCLMULQDQ folding paths for large
+   buffers, pick the implementation at run time, add crc32c_combine() and an
+   interleaved kernel for several small buffers.
  */
 
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+
 #include "crc32c.h"
 
 /* CRC-32C (iSCSI) polynomial in reversed bit order. */
 #define POLY 0x82f63b78
 
+/* Table for a byte-wise and slicing-by-eight software crc. */
+static uint32_t crc32c_table[8][256];
+
+/* Construct table for software CRC-32C calculation. */
+static void crc32c_init_sw(void) {
+    for (unsigned n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (unsigned k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        crc32c_table[0][n] = crc;
+    }
+    for (unsigned n = 0; n < 256; n++) {
+        uint32_t crc = crc32c_table[0][n];
+        for (unsigned k = 1; k < 8; k++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
+}
+
+/* Table-driven software version as a fall-back, slicing eight bytes at a
+   time on little-endian processors. */
+static uint32_t crc32c_sw(uint32_t crci, void const *buf, size_t len) {
+    unsigned char const *next = buf;
+    uint64_t crc;
+
+    crc = crci ^ 0xffffffff;
+    while (len && ((uintptr_t)next & 7) != 0) {
+        crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (len >= 8) {
+        uint64_t word;
+
+        memcpy(&word, next, 8);
+        crc ^= word;
+        crc = crc32c_table[7][crc & 0xff] ^
+              crc32c_table[6][(crc >> 8) & 0xff] ^
+              crc32c_table[5][(crc >> 16) & 0xff] ^
+              crc32c_table[4][(crc >> 24) & 0xff] ^
+              crc32c_table[3][(crc >> 32) & 0xff] ^
+              crc32c_table[2][(crc >> 40) & 0xff] ^
+              crc32c_table[1][(crc >> 48) & 0xff] ^
+              crc32c_table[0][crc >> 56];
+        next += 8;
+        len -= 8;
+    }
+#endif
+    while (len) {
+        crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    return (uint32_t)crc ^ 0xffffffff;
+}
+
+/* Multiply a and b modulo P(x), both in reversed bit order. */
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t)1 << 31, p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+    }
+    return p;
+}
+
+/* x^(2^n) mod P(x) for n = 0..31. */
+static uint32_t crc32c_x2n[32];
+
+static void crc32c_init_x2n(void) {
+    uint32_t p = (uint32_t)1 << 30;         /* x^1 */
+
+    crc32c_x2n[0] = p;
+    for (unsigned n = 1; n < 32; n++)
+        crc32c_x2n[n] = p = multmodp(p, p);
+}
+
+/* x^(n * 2^k) mod P(x). */
+static uint32_t x2nmodp(size_t n, unsigned k) {
+    uint32_t p = (uint32_t)1 << 31;         /* x^0 == 1 */
+
+    while (n) {
+        if (n & 1)
+            p = multmodp(crc32c_x2n[k & 31], p);
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+/* Return the crc of the concatenation of two buffers, given crc1 of the
+   first, crc2 of the second computed from zero and len2, the length of the
+   second.  crc1 may itself be the crc of several buffers. */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2) {
+    return multmodp(x2nmodp(len2, 3), crc1) ^ crc2;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
 /* Hardware CRC-32C for Intel and compatible processors. */
 
 /* Multiply a matrix times a vector over the Galois field of two elements,
@@ -142,14 +258,145 @@ static inline uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc) {
 static uint32_t crc32c_long[4][256];
 static uint32_t crc32c_short[4][256];
 
+
 /* Initialize tables for shifting crcs. */
-static void __attribute__((constructor)) crc32c_init_hw(void) {
+static void crc32c_init_hw(void) {
     crc32c_zeros(crc32c_long, LONG);
     crc32c_zeros(crc32c_short, SHORT);
 }
 
+/* Buffers at least this long are folded with carry-less multiplies, using
+   128-bit and 512-bit registers. */
+#define FOLD_MIN 512
+#define FOLD512_MIN 256
+
+/* Folding constants for the reflected CRC-32C polynomial, each being
+   (x^n mod P(x))' << 1: fold by 2048 bits (n = 2048 + 32, 2048 - 32), by 512
+   bits (n = 512 + 32, 512 - 32) and by 128 bits (n = 128 + 32, 128 - 32). */
+#define K1 0xdcb17aa4
+#define K2 0xb9e02b86
+#define K3 0x740eef02
+#define K4 0x9e4addf8
+#define K5 0xf20c0dfe
+#define K6 0x14cd00bd6
+
+/* Fold x forward over the distance of k and add in y. */
+static inline __attribute__((target("pclmul"))) __m128i
+crc32c_fold(__m128i x, __m128i k, __m128i y) {
+    __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+    __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(lo, hi), y);
+}
+
+static inline __attribute__((target("avx512f,vpclmulqdq"))) __m512i
+crc32c_fold512(__m512i x, __m512i k, __m512i y) {
+    return _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(x, k, 0x00),
+                                     _mm512_clmulepi64_epi128(x, k, 0x11),
+                                     y, 0x96);
+}
+
+/* Fold the len bytes at next, a multiple of 16, into x and reduce the last
+   128 bits with the crc32 instruction, which leaves the same crc as running
+   it over all of the input. */
+static inline __attribute__((target("pclmul"))) uint64_t
+crc32c_fold_finish(__m128i x, unsigned char const *next, size_t len) {
+    __m128i const k56 = _mm_set_epi64x(K6, K5);
+    uint64_t crc0 = 0, lo, hi;
+
+    while (len) {
+        x = crc32c_fold(x, k56, _mm_loadu_si128((__m128i const *)next));
+        next += 16;
+        len -= 16;
+    }
+
+    lo = _mm_cvtsi128_si64(x);
+    hi = _mm_cvtsi128_si64(_mm_unpackhi_epi64(x, x));
+    __asm__("crc32q\t" "%1, %0" : "+r"(crc0) : "r"(lo));
+    __asm__("crc32q\t" "%1, %0" : "+r"(crc0) : "r"(hi));
+    return crc0;
+}
+
+/* Fold len bytes, a multiple of 16 and at least 64, into the crc (not pre- or
+   post-processed).  Four 128-bit lanes are folded forward by 512 bits at a
+   time, then combined into one. */
+static __attribute__((target("pclmul"))) uint64_t
+crc32c_fold_pclmul(uint64_t crc0, unsigned char const *next, size_t len) {
+    __m128i const k34 = _mm_set_epi64x(K4, K3);
+    __m128i const k56 = _mm_set_epi64x(K6, K5);
+    __m128i x0, x1, x2, x3;
+
+    x0 = _mm_xor_si128(_mm_loadu_si128((__m128i const *)next),
+                       _mm_cvtsi32_si128((uint32_t)crc0));
+    x1 = _mm_loadu_si128((__m128i const *)(next + 16));
+    x2 = _mm_loadu_si128((__m128i const *)(next + 32));
+    x3 = _mm_loadu_si128((__m128i const *)(next + 48));
+    next += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        x0 = crc32c_fold(x0, k34, _mm_loadu_si128((__m128i const *)next));
+        x1 = crc32c_fold(x1, k34,
+                         _mm_loadu_si128((__m128i const *)(next + 16)));
+        x2 = crc32c_fold(x2, k34,
+                         _mm_loadu_si128((__m128i const *)(next + 32)));
+        x3 = crc32c_fold(x3, k34,
+                         _mm_loadu_si128((__m128i const *)(next + 48)));
+        next += 64;
+        len -= 64;
+    }
+
+    x0 = crc32c_fold(x0, k56, x1);
+    x0 = crc32c_fold(x0, k56, x2);
+    x0 = crc32c_fold(x0, k56, x3);
+    return crc32c_fold_finish(x0, next, len);
+}
+
+/* The same with four 512-bit lanes, folding 256 bytes at a time.  len must
+   be at least 256. */
+static __attribute__((target("avx512f,vpclmulqdq,pclmul"))) uint64_t
+crc32c_fold_vpclmul(uint64_t crc0, unsigned char const *next, size_t len) {
+    __m512i const k12 = _mm512_broadcast_i32x4(_mm_set_epi64x(K2, K1));
+    __m512i const k34 = _mm512_broadcast_i32x4(_mm_set_epi64x(K4, K3));
+    __m128i const k56 = _mm_set_epi64x(K6, K5);
+    __m512i x0, x1, x2, x3;
+    __m128i x;
+
+    x0 = _mm512_xor_si512(_mm512_loadu_si512(next),
+                          _mm512_zextsi128_si512(
+                              _mm_cvtsi32_si128((uint32_t)crc0)));
+    x1 = _mm512_loadu_si512(next + 64);
+    x2 = _mm512_loadu_si512(next + 128);
+    x3 = _mm512_loadu_si512(next + 192);
+    next += 256;
+    len -= 256;
+
+    while (len >= 256) {
+        x0 = crc32c_fold512(x0, k12, _mm512_loadu_si512(next));
+        x1 = crc32c_fold512(x1, k12, _mm512_loadu_si512(next + 64));
+        x2 = crc32c_fold512(x2, k12, _mm512_loadu_si512(next + 128));
+        x3 = crc32c_fold512(x3, k12, _mm512_loadu_si512(next + 192));
+        next += 256;
+        len -= 256;
+    }
+
+    x0 = crc32c_fold512(x0, k34, x1);
+    x0 = crc32c_fold512(x0, k34, x2);
+    x0 = crc32c_fold512(x0, k34, x3);
+
+    x = _mm512_castsi512_si128(x0);
+    x = crc32c_fold(x, k56, _mm512_extracti32x4_epi32(x0, 1));
+    x = crc32c_fold(x, k56, _mm512_extracti32x4_epi32(x0, 2));
+    x = crc32c_fold(x, k56, _mm512_extracti32x4_epi32(x0, 3));
+    return crc32c_fold_finish(x, next, len);
+}
+
+/* Folding routine used by crc32c_hw(), if any, and the length from which on
+   it is used. */
+static uint64_t (*crc32c_folder)(uint64_t, unsigned char const *, size_t);
+static size_t crc32c_fold_min;
+
 /* Compute CRC-32C using the Intel hardware instruction. */
-static uint32_t crc32c(uint32_t crc, void const *buf, size_t len) {
+static uint32_t crc32c_hw(uint32_t crc, void const *buf, size_t len) {
     /* pre-process the crc */
     crc = ~crc;
     uint64_t crc0 = crc;            /* 64-bits for crc32q instruction */
@@ -165,6 +412,15 @@ static uint32_t crc32c(uint32_t crc, void const *buf, size_t len) {
         len--;
     }
 
+    /* fold large buffers with carry-less multiplies if we can */
+    if (crc32c_folder && len >= crc32c_fold_min) {
+        size_t n = len & ~(size_t)15;
+
+        crc0 = crc32c_folder(crc0, next, n);
+        next += n;
+        len -= n;
+    }
+
     /* compute the crc on sets of LONG*3 bytes, executing three independent crc
        instructions, each on LONG bytes -- this is optimized for the Nehalem,
        Westmere, Sandy Bridge, and Ivy Bridge architectures, which have a
@@ -232,3 +488,93 @@ static uint32_t crc32c(uint32_t crc, void const *buf, size_t len) {
     /* return a post-processed crc */
     return ~crc0;
 }
+
+#endif
+
+static uint32_t (*crc32c_func)(uint32_t, void const *, size_t) = crc32c_sw;
+static enum crc32c_impl crc32c_cur = CRC32C_SW;
+
+static char const *const crc32c_names[] = {
+    [CRC32C_SW] = "sw",
+    [CRC32C_SSE42] = "sse4.2",
+    [CRC32C_PCLMUL] = "pclmul",
+    [CRC32C_VPCLMUL] = "vpclmul",
+};
+
+static int crc32c_supported(enum crc32c_impl impl) {
+    switch (impl) {
+    case CRC32C_SW:
+        return 1;
+#if defined(__x86_64__)
+    case CRC32C_VPCLMUL:
+        if (!__builtin_cpu_supports("avx512f") ||
+            !__builtin_cpu_supports("vpclmulqdq"))
+            return 0;
+        /* fall through */
+    case CRC32C_PCLMUL:
+        if (!__builtin_cpu_supports("pclmul"))
+            return 0;
+        /* fall through */
+    case CRC32C_SSE42:
+        return __builtin_cpu_supports("sse4.2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+/* Use impl for all following crcs, if this processor has it.  Not safe to
+   call while other threads compute crcs. */
+int crc32c_set_impl(enum crc32c_impl impl) {
+    if (!crc32c_supported(impl))
+        return -1;
+
+    crc32c_cur = impl;
+#if defined(__x86_64__)
+    if (impl != CRC32C_SW) {
+        crc32c_func = crc32c_hw;
+        crc32c_folder = impl == CRC32C_VPCLMUL ? crc32c_fold_vpclmul :
+                        impl == CRC32C_PCLMUL ? crc32c_fold_pclmul : NULL;
+        crc32c_fold_min = impl == CRC32C_VPCLMUL ? FOLD512_MIN : FOLD_MIN;
+        return 0;
+    }
+#endif
+    crc32c_func = crc32c_sw;
+    return 0;
+}
+
+enum crc32c_impl crc32c_get_impl(void) {
+    return crc32c_cur;
+}
+
+char const *crc32c_impl_name(enum crc32c_impl impl) {
+    return impl < CRC32C_NR_IMPLS ? crc32c_names[impl] : "unknown";
+}
+
+/* Pick the fastest implementation the processor we run on supports. */
+static void __attribute__((constructor)) crc32c_init(void) {
+    int impl;
+
+    crc32c_init_sw();
+    crc32c_init_x2n();
+#if defined(__x86_64__)
+    crc32c_init_hw();
+    __builtin_cpu_init();
+#endif
+    for (impl = CRC32C_NR_IMPLS - 1; impl > CRC32C_SW; impl--)
+        if (!crc32c_set_impl(impl))
+            break;
+}
+
+uint32_t crc32c(uint32_t crc, void const *buf, size_t len) {
+    return crc32c_func(crc, buf, len);
+}
+
+/* Compute the crc of the concatenation of the segments in iov.  Hashing
+   long segments separately and combining the results measured slower than
+   this, the crc32q chains of one segment already keep the core busy. */
+uint32_t crc32c_iov(uint32_t crc, struct iovec const *iov, int cnt) {
+    for (; cnt > 0; iov++, cnt--)
+        crc = crc32c(crc, iov->iov_base, iov->iov_len);
+    return crc;
+}
@@ -3,7 +3,22 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
-#include "crc32c.c"
+enum crc32c_impl {
+	CRC32C_SW,
+	CRC32C_SSE42,
+	CRC32C_PCLMUL,
+	CRC32C_VPCLMUL,
+	CRC32C_NR_IMPLS,
+};
+
+extern uint32_t crc32c(uint32_t crc, void const *buf, size_t len);
+extern uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+extern uint32_t crc32c_iov(uint32_t crc, struct iovec const *iov, int cnt);
+
+extern int crc32c_set_impl(enum crc32c_impl impl);
+extern enum crc32c_impl crc32c_get_impl(void);
+extern char const *crc32c_impl_name(enum crc32c_impl impl);
 
 #endif	/* _LINUX_CRC32C_H */
@@ -0,0 +1,103 @@
+/*
+ * crc32c micro benchmark
+ *
+ * Checks every crc32c implementation this processor supports against
+ * the software one and reports their throughput for a range of buffer
+ * sizes, plus that of hashing several header sized buffers at once.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc32c.h"
+
+#define BUF_SIZE	(1 << 20)
+#define BENCH_BYTES	(1ULL << 30)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int check(unsigned char *buf)
+{
+	uint32_t crc, ref, a, b;
+	size_t off, len;
+	int i, impl = crc32c_get_impl();
+
+	for (i = 0; i < 1000; i++) {
+		off = random() % 64;
+		len = random() % (BUF_SIZE - 64);
+		if (i < 500)
+			len %= 20000;
+		crc = random();
+
+		crc32c_set_impl(CRC32C_SW);
+		ref = crc32c(crc, buf + off, len);
+		crc32c_set_impl(impl);
+		if (crc32c(crc, buf + off, len) != ref)
+			return -1;
+
+		a = crc32c(crc, buf + off, len / 3);
+		b = crc32c(0, buf + off + len / 3, len - len / 3);
+		if (crc32c_combine(a, b, len - len / 3) != ref)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void bench(unsigned char *buf)
+{
+	uint32_t crc = 0;
+	size_t size, done;
+	double start;
+
+	for (size = 64; size <= BUF_SIZE; size *= 4) {
+		start = now();
+		for (done = 0; done < BENCH_BYTES; done += size)
+			crc = crc32c(crc, buf, size);
+		printf("  %8zu bytes: %6.2f GB/s (%08x)\n", size,
+		       BENCH_BYTES / (now() - start) / 1e9, crc);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char *buf = malloc(BUF_SIZE);
+	int i, impl;
+
+	if (!buf)
+		return 1;
+	for (i = 0; i < BUF_SIZE; i++)
+		buf[i] = random();
+
+	for (impl = 0; impl < CRC32C_NR_IMPLS; impl++) {
+		if (crc32c_set_impl(impl)) {
+			printf("%s: not supported\n", crc32c_impl_name(impl));
+			continue;
+		}
+		printf("%s:\n", crc32c_impl_name(impl));
+		if (check(buf)) {
+			printf("  mismatch\n");
+			return 1;
+		}
+		bench(buf);
+	}
+
+	return 0;
+}
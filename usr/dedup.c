@@ -0,0 +1,653 @@
+/*
+ * Content-deduplicated CoW overlays
+ *
+ * Blocks written by clients are stored once in a shared pool file no
+ * matter how many clients write the same content, e.g. when they all
+ * install the same updates. Blocks are bucketed by CRC32C and matched
+ * by SHA1. Each client keeps a map from its block numbers to pool
+ * entries. Blocks it never wrote are read through the regular
+ * flag_map routing.
+ *
+ * The maps only live in memory, so like RAM overlays the pool holds
+ * scratch data that does not survive a restart of tgtd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+#include "crc32c.h"
+#include "iscsi/sha1.h"
+
+#define DEDUP_DIGEST_LEN	20
+#define DEDUP_BUCKETS		(1 << 20)
+
+/* pool entry value of a client block that is all zeros */
+#define DEDUP_ZERO		UINT32_MAX
+
+#define MAP_EMPTY		0
+#define MAP_DELETED		UINT32_MAX
+
+/* a unique block, stored at idx * BLK_SIZE in the pool file */
+struct dedup_entry {
+	uint32_t crc;
+	uint32_t refcnt;	/* 0 if free */
+	uint32_t next;		/* bucket chain or free list, idx + 1 */
+	uint8_t digest[DEDUP_DIGEST_LEN];
+};
+
+struct map_slot {
+	uint32_t key;		/* block number + 1 */
+	uint32_t idx;		/* pool entry or DEDUP_ZERO */
+};
+
+struct dedup_client {
+	pthread_rwlock_t lock;
+	unsigned int gen;	/* reset_gen[] this map belongs to */
+	struct map_slot *table;
+	uint32_t table_mask;
+	uint32_t used;		/* live and deleted slots */
+};
+
+static int pool_fd = -1;
+
+/* protected by dedup_lock */
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dedup_entry *entries;
+static uint32_t nr_entries, max_entries;
+static uint32_t free_head;
+static uint32_t *buckets;
+
+static struct dedup_client *dedup_clients[FD_LIMIT];
+static pthread_mutex_t dedup_clients_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char zero_block[BLK_SIZE];
+
+static void dedup_hash(const char *buf, uint32_t *crc, uint8_t *digest)
+{
+	struct sha1_ctx ctx;
+
+	*crc = crc32c(0, buf, BLK_SIZE);
+
+	sha1_init(&ctx);
+	sha1_update(&ctx, (const uint8_t *)buf, BLK_SIZE);
+	sha1_final(&ctx, digest);
+}
+
+/* called with dedup_lock held */
+static uint32_t dedup_find(uint32_t crc, const uint8_t *digest)
+{
+	uint32_t i = buckets[crc & (DEDUP_BUCKETS - 1)];
+
+	for (; i; i = entries[i - 1].next) {
+		struct dedup_entry *e = &entries[i - 1];
+
+		if (e->crc == crc && !memcmp(e->digest, digest,
+					     DEDUP_DIGEST_LEN))
+			return i - 1;
+	}
+
+	return DEDUP_ZERO;
+}
+
+/* called with dedup_lock held */
+static uint32_t dedup_alloc(void)
+{
+	struct dedup_entry *n;
+	uint32_t idx;
+
+	if (free_head) {
+		idx = free_head - 1;
+		free_head = entries[idx].next;
+		return idx;
+	}
+
+	if (nr_entries == max_entries) {
+		if (max_entries >= DEDUP_ZERO / 2)
+			return DEDUP_ZERO;
+		n = realloc(entries, max_entries * 2 * sizeof(*entries));
+		if (!n)
+			return DEDUP_ZERO;
+		entries = n;
+		max_entries *= 2;
+	}
+
+	return nr_entries++;
+}
+
+/* called with dedup_lock held */
+static void dedup_put(uint32_t idx)
+{
+	struct dedup_entry *e;
+	uint32_t *p;
+
+	if (idx == DEDUP_ZERO)
+		return;
+
+	e = &entries[idx];
+	if (--e->refcnt)
+		return;
+
+	for (p = &buckets[e->crc & (DEDUP_BUCKETS - 1)]; *p;
+	     p = &entries[*p - 1].next) {
+		if (*p == idx + 1) {
+			*p = e->next;
+			break;
+		}
+	}
+
+	e->next = free_head;
+	free_head = idx + 1;
+}
+
+/*
+ * Store a block in the pool, or take a reference on an identical one.
+ * Returns the pool entry, DEDUP_ZERO for a zero block or -1.
+ */
+static int64_t dedup_store(const char *buf)
+{
+	uint8_t digest[DEDUP_DIGEST_LEN];
+	uint32_t crc, idx, dup;
+	ssize_t ret;
+
+	if (!memcmp(buf, zero_block, BLK_SIZE))
+		return DEDUP_ZERO;
+
+	dedup_hash(buf, &crc, digest);
+
+	pthread_mutex_lock(&dedup_lock);
+	idx = dedup_find(crc, digest);
+	if (idx != DEDUP_ZERO) {
+		entries[idx].refcnt++;
+		pthread_mutex_unlock(&dedup_lock);
+		return idx;
+	}
+
+	idx = dedup_alloc();
+	pthread_mutex_unlock(&dedup_lock);
+	if (idx == DEDUP_ZERO)
+		return -1;
+
+	/* not visible to others until the data is in the pool */
+	ret = pwrite64(pool_fd, buf, BLK_SIZE, (off64_t)idx * BLK_SIZE);
+
+	pthread_mutex_lock(&dedup_lock);
+	if (ret != BLK_SIZE) {
+		entries[idx].next = free_head;
+		free_head = idx + 1;
+		pthread_mutex_unlock(&dedup_lock);
+		return -1;
+	}
+
+	dup = dedup_find(crc, digest);
+	if (dup != DEDUP_ZERO) {
+		/* someone stored the same block meanwhile */
+		entries[dup].refcnt++;
+		entries[idx].next = free_head;
+		free_head = idx + 1;
+		idx = dup;
+	} else {
+		struct dedup_entry *e = &entries[idx];
+
+		e->crc = crc;
+		e->refcnt = 1;
+		memcpy(e->digest, digest, DEDUP_DIGEST_LEN);
+		e->next = buckets[crc & (DEDUP_BUCKETS - 1)];
+		buckets[crc & (DEDUP_BUCKETS - 1)] = idx + 1;
+	}
+	pthread_mutex_unlock(&dedup_lock);
+
+	return idx;
+}
+
+static struct map_slot *map_lookup(struct dedup_client *dc, uint32_t blk)
+{
+	uint32_t key = blk + 1, i;
+
+	if (!dc->table)
+		return NULL;
+
+	for (i = (key * 2654435761U) & dc->table_mask;;
+	     i = (i + 1) & dc->table_mask) {
+		struct map_slot *slot = &dc->table[i];
+
+		if (slot->key == key)
+			return slot;
+		if (slot->key == MAP_EMPTY)
+			return NULL;
+	}
+}
+
+/* called with dc->lock held for writing */
+static int map_resize(struct dedup_client *dc)
+{
+	struct map_slot *old = dc->table, *table;
+	uint32_t size = dc->table ? (dc->table_mask + 1) * 2 : 1024;
+	uint32_t i, j, live = 0;
+
+	for (i = 0; old && i <= dc->table_mask; i++)
+		if (old[i].key != MAP_EMPTY && old[i].key != MAP_DELETED)
+			live++;
+
+	/* just clean out deleted slots if that leaves enough room */
+	if (old && live < (dc->table_mask + 1) / 4)
+		size = dc->table_mask + 1;
+
+	table = calloc(size, sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+
+	for (i = 0; old && i <= dc->table_mask; i++) {
+		if (old[i].key == MAP_EMPTY || old[i].key == MAP_DELETED)
+			continue;
+		for (j = (old[i].key * 2654435761U) & (size - 1);
+		     table[j].key != MAP_EMPTY; j = (j + 1) & (size - 1))
+			;
+		table[j] = old[i];
+	}
+
+	free(old);
+	dc->table = table;
+	dc->table_mask = size - 1;
+	dc->used = live;
+
+	return 0;
+}
+
+/*
+ * Point a client block at a pool entry. Returns the entry it pointed
+ * at before, DEDUP_ZERO if none, or -1. Called with dc->lock held for
+ * writing.
+ */
+static int64_t map_set(struct dedup_client *dc, uint32_t blk, uint32_t idx,
+		       int *was_mapped)
+{
+	uint32_t key = blk + 1, i, old;
+	struct map_slot *slot = map_lookup(dc, blk), *del = NULL;
+
+	*was_mapped = 0;
+	if (slot) {
+		old = slot->idx;
+		slot->idx = idx;
+		*was_mapped = 1;
+		return old;
+	}
+
+	if ((!dc->table || dc->used + 1 > (dc->table_mask + 1) / 2) &&
+	    map_resize(dc))
+		return -1;
+
+	for (i = (key * 2654435761U) & dc->table_mask;;
+	     i = (i + 1) & dc->table_mask) {
+		slot = &dc->table[i];
+		if (slot->key == MAP_DELETED && !del)
+			del = slot;
+		if (slot->key == MAP_EMPTY)
+			break;
+	}
+
+	if (del)
+		slot = del;
+	else
+		dc->used++;
+
+	slot->key = key;
+	slot->idx = idx;
+
+	return DEDUP_ZERO;
+}
+
+/* called with dc->lock held for writing */
+static void map_drop(struct dedup_client *dc)
+{
+	uint32_t i;
+
+	if (!dc->table)
+		return;
+
+	pthread_mutex_lock(&dedup_lock);
+	for (i = 0; i <= dc->table_mask; i++)
+		if (dc->table[i].key != MAP_EMPTY &&
+		    dc->table[i].key != MAP_DELETED)
+			dedup_put(dc->table[i].idx);
+	pthread_mutex_unlock(&dedup_lock);
+
+	free(dc->table);
+	dc->table = NULL;
+	dc->table_mask = 0;
+	dc->used = 0;
+}
+
+static struct dedup_client *dedup_client_get(int addr, int create)
+{
+	struct dedup_client *dc;
+
+	if (addr < 0 || addr >= FD_LIMIT)
+		return NULL;
+
+	dc = __atomic_load_n(&dedup_clients[addr], __ATOMIC_ACQUIRE);
+	if (dc || !create)
+		return dc;
+
+	pthread_mutex_lock(&dedup_clients_lock);
+	dc = dedup_clients[addr];
+	if (!dc) {
+		dc = zalloc(sizeof(*dc));
+		if (dc) {
+			pthread_rwlock_init(&dc->lock, NULL);
+			dc->gen = reset_gen[addr];
+			__atomic_store_n(&dedup_clients[addr], dc,
+					 __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&dedup_clients_lock);
+
+	return dc;
+}
+
+/* take the client's lock, dropping its map if it was reset meanwhile */
+static void dedup_client_lock(struct dedup_client *dc, int addr, int write)
+{
+	unsigned int gen = __atomic_load_n(&reset_gen[addr], __ATOMIC_ACQUIRE);
+
+	if (dc->gen != gen) {
+		pthread_rwlock_wrlock(&dc->lock);
+		if (dc->gen != gen) {
+			map_drop(dc);
+			dc->gen = gen;
+		}
+		pthread_rwlock_unlock(&dc->lock);
+	}
+
+	if (write)
+		pthread_rwlock_wrlock(&dc->lock);
+	else
+		pthread_rwlock_rdlock(&dc->lock);
+}
+
+/* read one block of a client, called with dc->lock held */
+static int dedup_read_block(struct dedup_client *dc, int fd, uint32_t blk,
+			    char *buf)
+{
+	struct map_slot *slot = map_lookup(dc, blk);
+	off64_t off = (off64_t)blk * BLK_SIZE;
+
+	if (!slot)
+		return bs_rdwr_pread(fd, buf, BLK_SIZE, off) == BLK_SIZE ?
+			0 : -1;
+
+	if (slot->idx == DEDUP_ZERO) {
+		memset(buf, 0, BLK_SIZE);
+		return 0;
+	}
+
+	return pread64(pool_fd, buf, BLK_SIZE,
+		       (off64_t)slot->idx * BLK_SIZE) == BLK_SIZE ? 0 : -1;
+}
+
+int dedup_enabled(void)
+{
+	return pool_fd >= 0;
+}
+
+/*
+ * Read from a client's image. Returns the number of bytes read or -1.
+ */
+ssize_t dedup_read(int addr, int fd, char *buf, size_t length,
+		   uint64_t offset)
+{
+	struct dedup_client *dc = dedup_client_get(addr, 0);
+	struct map_slot *slot;
+	uint64_t pos = offset, end = offset + length, run = offset;
+	uint32_t in, n;
+	char tmp[BLK_SIZE];
+	ssize_t ret;
+
+	if (!dc || !dc->table)
+		return bs_rdwr_pread(fd, buf, length, offset);
+
+	dedup_client_lock(dc, addr, 0);
+
+	while (pos < end) {
+		in = pos % BLK_SIZE;
+		n = min_t(uint64_t, BLK_SIZE - in, end - pos);
+
+		slot = map_lookup(dc, pos / BLK_SIZE);
+		if (slot) {
+			/* read the unmapped run in front of this block */
+			if (run < pos) {
+				ret = bs_rdwr_pread(fd, buf + (run - offset),
+						    pos - run, run);
+				if (ret != pos - run)
+					goto err;
+			}
+
+			if (n == BLK_SIZE) {
+				if (dedup_read_block(dc, fd, pos / BLK_SIZE,
+						     buf + (pos - offset)))
+					goto err;
+			} else {
+				if (dedup_read_block(dc, fd, pos / BLK_SIZE,
+						     tmp))
+					goto err;
+				memcpy(buf + (pos - offset), tmp + in, n);
+			}
+			run = pos + n;
+		}
+		pos += n;
+	}
+
+	if (run < end) {
+		ret = bs_rdwr_pread(fd, buf + (run - offset), end - run, run);
+		if (ret != end - run)
+			goto err;
+	}
+
+	pthread_rwlock_unlock(&dc->lock);
+	return length;
+err:
+	pthread_rwlock_unlock(&dc->lock);
+	return -1;
+}
+
+/*
+ * Write to a client's image. buf may be NULL to write zeros. Returns
+ * the number of bytes written or -1.
+ */
+static ssize_t __dedup_write(int addr, int fd, const char *buf, size_t length,
+			     uint64_t offset)
+{
+	struct dedup_client *dc = dedup_client_get(addr, 1);
+	uint64_t pos = offset, end = offset + length;
+	uint32_t in, n;
+	char tmp[BLK_SIZE];
+	const char *blk;
+	int64_t idx, old;
+	int mapped;
+
+	if (!dc)
+		return -1;
+
+	dedup_client_lock(dc, addr, 1);
+
+	while (pos < end) {
+		in = pos % BLK_SIZE;
+		n = min_t(uint64_t, BLK_SIZE - in, end - pos);
+
+		if (n == BLK_SIZE && buf)
+			blk = buf + (pos - offset);
+		else {
+			/* a partial block starts out with the old data */
+			if (n != BLK_SIZE &&
+			    dedup_read_block(dc, fd, pos / BLK_SIZE, tmp))
+				goto err;
+			if (buf)
+				memcpy(tmp + in, buf + (pos - offset), n);
+			else
+				memset(tmp + in, 0, n);
+			blk = tmp;
+		}
+
+		idx = dedup_store(blk);
+		if (idx < 0)
+			goto err;
+
+		old = map_set(dc, pos / BLK_SIZE, idx, &mapped);
+		pthread_mutex_lock(&dedup_lock);
+		if (old < 0)
+			dedup_put(idx);
+		else if (mapped)
+			dedup_put(old);
+		pthread_mutex_unlock(&dedup_lock);
+		if (old < 0)
+			goto err;
+
+		pos += n;
+	}
+
+	pthread_rwlock_unlock(&dc->lock);
+	return length;
+err:
+	pthread_rwlock_unlock(&dc->lock);
+	return -1;
+}
+
+ssize_t dedup_write(int addr, int fd, const char *buf, size_t length,
+		    uint64_t offset)
+{
+	return __dedup_write(addr, fd, buf, length, offset);
+}
+
+/*
+ * Forget the blocks fully inside an unmapped range, so that they read
+ * from the client's image again, which the caller punches and marks
+ * written. Only the unmapped part of the others becomes zeros in the
+ * map, so a whole-disk trim leaves no entries behind.
+ */
+int dedup_unmap(int addr, int fd, uint64_t offset, uint64_t length)
+{
+	struct dedup_client *dc;
+	struct map_slot *slot;
+	uint64_t end = offset + length;
+	uint64_t head = min_t(uint64_t, ALIGN(offset, BLK_SIZE), end);
+	uint64_t tail = max_t(uint64_t, end / BLK_SIZE * BLK_SIZE, head);
+	uint32_t i, blk;
+
+	if (head > offset &&
+	    __dedup_write(addr, fd, NULL, head - offset, offset) != head - offset)
+		return -1;
+	if (tail < end &&
+	    __dedup_write(addr, fd, NULL, end - tail, tail) != end - tail)
+		return -1;
+
+	dc = dedup_client_get(addr, 0);
+	if (!dc || head == tail)
+		return 0;
+
+	dedup_client_lock(dc, addr, 1);
+	if (!dc->table)
+		goto out;
+
+	pthread_mutex_lock(&dedup_lock);
+	if ((tail - head) / BLK_SIZE > dc->table_mask) {
+		/* the map is smaller than the range */
+		for (i = 0; i <= dc->table_mask; i++) {
+			slot = &dc->table[i];
+			if (slot->key == MAP_EMPTY || slot->key == MAP_DELETED ||
+			    slot->key - 1 < head / BLK_SIZE ||
+			    slot->key - 1 >= tail / BLK_SIZE)
+				continue;
+			dedup_put(slot->idx);
+			slot->key = MAP_DELETED;
+		}
+	} else {
+		for (blk = head / BLK_SIZE; blk < tail / BLK_SIZE; blk++) {
+			slot = map_lookup(dc, blk);
+			if (!slot)
+				continue;
+			dedup_put(slot->idx);
+			slot->key = MAP_DELETED;
+		}
+	}
+
+	pthread_mutex_unlock(&dedup_lock);
+out:
+	pthread_rwlock_unlock(&dc->lock);
+
+	return 0;
+}
+
+int dedup_init(char *path)
+{
+	if (pool_fd >= 0)
+		return 0;
+
+	entries = malloc(DEDUP_BUCKETS * sizeof(*entries));
+	buckets = calloc(DEDUP_BUCKETS, sizeof(*buckets));
+	if (!entries || !buckets) {
+		free(entries);
+		free(buckets);
+		return -ENOMEM;
+	}
+	max_entries = DEDUP_BUCKETS;
+
+	/* the pool only holds data of the running tgtd */
+	pool_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+	if (pool_fd < 0) {
+		eprintf("failed to open dedup pool %s, %m\n", path);
+		free(entries);
+		free(buckets);
+		return -errno;
+	}
+
+	eprintf("dedup pool %s enabled\n", path);
+
+	return 0;
+}
+
+/* The last LU is gone, forget all clients' maps and the pool */
+void dedup_exit(void)
+{
+	struct dedup_client *dc;
+	int i;
+
+	if (pool_fd < 0)
+		return;
+
+	for (i = 0; i < FD_LIMIT; i++) {
+		dc = dedup_clients[i];
+		if (!dc)
+			continue;
+		free(dc->table);
+		pthread_rwlock_destroy(&dc->lock);
+		free(dc);
+		dedup_clients[i] = NULL;
+	}
+
+	close(pool_fd);
+	pool_fd = -1;
+	free(entries);
+	free(buckets);
+	entries = NULL;
+	buckets = NULL;
+	nr_entries = max_entries = 0;
+	free_head = 0;
+}
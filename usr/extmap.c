@@ -0,0 +1,381 @@
+/*
+ * Provisioning status of the clients' images, for GET LBA STATUS
+ *
+ * A client sees its written blocks in its own image and all others in
+ * the master image, so whether a block is mapped depends on both. The
+ * holes of each master image version are looked up once, with
+ * SEEK_DATA and SEEK_HOLE, and kept in memory. On top of that each
+ * client has a list of the written ranges it deallocated by UNMAP since
+ * its image was reset, which its later writes take out again.
+ * Everything else follows the client's dirty map: written blocks are
+ * mapped, the rest is as in the master.
+ *
+ * So GET LBA STATUS is answered from memory, without a system call per
+ * descriptor.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+
+/* master image versions whose holes are kept */
+#define EXT_MASTERS	16
+
+struct ext {
+	uint64_t start, end;
+	int state;
+};
+
+/* sorted, non-overlapping */
+struct ext_list {
+	struct ext *e;
+	unsigned int nr, alloc;
+};
+
+struct ext_master {
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	uint64_t used;
+	struct ext_list holes;
+};
+
+struct ext_client {
+	pthread_mutex_t lock;
+	unsigned int gen;	/* reset_gen[] the list belongs to */
+	struct ext_list changed;
+};
+
+static struct ext_client *ext_clients[FD_LIMIT];
+static pthread_mutex_t ext_clients_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ext_master ext_masters[EXT_MASTERS];
+static pthread_mutex_t ext_masters_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t ext_tick;
+
+/* Index of the first extent ending after offset */
+static unsigned int ext_find(struct ext_list *l, uint64_t offset)
+{
+	unsigned int lo = 0, hi = l->nr, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (l->e[mid].end <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Sets [start, end) to state, or clears it for a negative state */
+static int ext_set(struct ext_list *l, uint64_t start, uint64_t end,
+		   int state)
+{
+	struct ext new[3], *e;
+	unsigned int i, j, n = 0;
+
+	i = ext_find(l, start);
+	for (j = i; j < l->nr && l->e[j].start < end; j++)
+		;
+
+	/* merge with what it touches or overlaps in the same state */
+	if (state >= 0) {
+		if (i > 0 && l->e[i - 1].end == start &&
+		    l->e[i - 1].state == state)
+			i--;
+		if (j < l->nr && l->e[j].start == end &&
+		    l->e[j].state == state)
+			j++;
+		if (i < j && l->e[i].state == state)
+			start = min_t(uint64_t, start, l->e[i].start);
+		if (i < j && l->e[j - 1].state == state)
+			end = max_t(uint64_t, end, l->e[j - 1].end);
+	}
+
+	if (i < j && l->e[i].start < start) {
+		new[n] = l->e[i];
+		new[n++].end = start;
+	}
+	if (state >= 0) {
+		new[n].start = start;
+		new[n].end = end;
+		new[n++].state = state;
+	}
+	if (i < j && l->e[j - 1].end > end) {
+		new[n] = l->e[j - 1];
+		new[n++].start = end;
+	}
+
+	if (i == j && !n)
+		return 0;
+
+	if (l->nr - (j - i) + n > l->alloc) {
+		l->alloc = l->alloc ? l->alloc * 2 : 64;
+		e = realloc(l->e, l->alloc * sizeof(*e));
+		if (!e)
+			return -ENOMEM;
+		l->e = e;
+	}
+
+	memmove(&l->e[i + n], &l->e[j], (l->nr - j) * sizeof(*e));
+	memcpy(&l->e[i], new, n * sizeof(*e));
+	l->nr = l->nr - (j - i) + n;
+
+	return 0;
+}
+
+/*
+ * State of the list at offset, -1 if none, with *next lowered to where
+ * that ends.
+ */
+static int ext_state(struct ext_list *l, uint64_t offset, uint64_t *next)
+{
+	unsigned int i = ext_find(l, offset);
+
+	if (i == l->nr)
+		return -1;
+	if (l->e[i].start > offset) {
+		*next = min_t(uint64_t, *next, l->e[i].start);
+		return -1;
+	}
+
+	*next = min_t(uint64_t, *next, l->e[i].end);
+	return l->e[i].state;
+}
+
+static int ext_load_holes(struct ext_master *m, uint64_t size)
+{
+	off_t hole, data = 0;
+
+	while ((uint64_t)data < size) {
+		hole = lseek(m->fd, data, SEEK_HOLE);
+		if (hole < 0)
+			return -errno;
+		if ((uint64_t)hole >= size)
+			break;
+
+		data = lseek(m->fd, hole, SEEK_DATA);
+		if (data < 0 && errno != ENXIO)
+			return -errno;
+		if (data < 0 || (uint64_t)data > size)
+			data = size;
+
+		if (ext_set(&m->holes, hole, data, 1))
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Holes of the master image version fd, loaded on first use. Called
+ * and used with ext_masters_lock held, NULL if they can't be had.
+ */
+static struct ext_master *ext_master(int fd, uint64_t size)
+{
+	struct ext_master *m, *old = &ext_masters[0];
+	struct stat st;
+	int i;
+
+	if (fstat(fd, &st))
+		return NULL;
+
+	for (i = 0; i < EXT_MASTERS; i++) {
+		m = &ext_masters[i];
+		if (m->holes.e && m->fd == fd && m->dev == st.st_dev &&
+		    m->ino == st.st_ino) {
+			m->used = ++ext_tick;
+			return m;
+		}
+		if (m->used < old->used)
+			old = m;
+	}
+
+	m = old;
+	free(m->holes.e);
+	memset(m, 0, sizeof(*m));
+	m->fd = fd;
+	m->dev = st.st_dev;
+	m->ino = st.st_ino;
+	m->used = ++ext_tick;
+
+	/* an empty list still marks the version as loaded */
+	m->holes.alloc = 1;
+	m->holes.e = malloc(sizeof(*m->holes.e));
+	if (!m->holes.e || ext_load_holes(m, size)) {
+		free(m->holes.e);
+		memset(m, 0, sizeof(*m));
+		return NULL;
+	}
+
+	return m;
+}
+
+/* The list of a client, locked and emptied if the client was reset */
+static struct ext_client *ext_client_lock(int addr)
+{
+	struct ext_client *ec;
+	unsigned int gen;
+
+	ec = __atomic_load_n(&ext_clients[addr], __ATOMIC_ACQUIRE);
+	if (!ec) {
+		pthread_mutex_lock(&ext_clients_lock);
+		ec = ext_clients[addr];
+		if (!ec) {
+			ec = zalloc(sizeof(*ec));
+			if (ec) {
+				pthread_mutex_init(&ec->lock, NULL);
+				if (reset_gen)
+					ec->gen = reset_gen[addr];
+				__atomic_store_n(&ext_clients[addr], ec,
+						 __ATOMIC_RELEASE);
+			}
+		}
+		pthread_mutex_unlock(&ext_clients_lock);
+		if (!ec)
+			return NULL;
+	}
+
+	pthread_mutex_lock(&ec->lock);
+	if (reset_gen) {
+		gen = __atomic_load_n(&reset_gen[addr], __ATOMIC_ACQUIRE);
+		if (ec->gen != gen) {
+			ec->gen = gen;
+			ec->changed.nr = 0;
+		}
+	}
+
+	return ec;
+}
+
+/*
+ * A client wrote [offset, offset + length), which then follows its
+ * dirty map again. Until the write-back cache has written it, a block
+ * the master has a hole at still shows as deallocated.
+ */
+void extmap_write(int addr, uint64_t offset, uint64_t length)
+{
+	struct ext_client *ec;
+
+	if (addr < 0 || addr >= FD_LIMIT)
+		return;
+
+	ec = ext_client_lock(addr);
+	if (!ec)
+		return;
+	/* out of memory, fall back to the dirty map and the master's holes */
+	if (ext_set(&ec->changed, offset, offset + length, -1))
+		ec->changed.nr = 0;
+	pthread_mutex_unlock(&ec->lock);
+}
+
+/*
+ * A client unmapped [offset, offset + length), after its write-back
+ * cache was flushed. Written blocks are holes in its image now, the
+ * others still read from the master.
+ */
+void extmap_unmap(int addr, uint64_t offset, uint64_t length)
+{
+	struct ext_client *ec;
+	uint64_t end = offset + length, next;
+	int8_t *map;
+	int fd, dirty;
+
+	if (addr < 0 || addr >= FD_LIMIT || !fd_map[addr])
+		return;
+
+	fd = fd_map[addr];
+	map = (void *)flag_map + (MAP_LEN * fd_flag_map[fd]);
+
+	ec = ext_client_lock(addr);
+	if (!ec)
+		return;
+
+	while (offset < end) {
+		dirty = map[offset / BLK_SIZE] != 0;
+		for (next = (offset / BLK_SIZE + 1) * BLK_SIZE;
+		     next < end && (map[next / BLK_SIZE] != 0) == dirty;
+		     next += BLK_SIZE)
+			;
+		next = min_t(uint64_t, next, end);
+		if (ext_set(&ec->changed, offset, next, dirty ? 1 : -1)) {
+			/* unmapped blocks then only show as mapped */
+			ec->changed.nr = 0;
+			break;
+		}
+		offset = next;
+	}
+
+	pthread_mutex_unlock(&ec->lock);
+}
+
+/*
+ * Provisioning status of a client's image at offset, 0 if mapped and 1
+ * if deallocated, with *next set to where the status may change. size
+ * is that of the image. Returns -1 if the client has no image.
+ */
+int extmap_status(int addr, uint64_t offset, uint64_t size, uint64_t *next)
+{
+	struct ext_client *ec;
+	struct ext_master *m;
+	int8_t *map;
+	uint64_t blk;
+	int fd, state, dirty;
+
+	if (addr < 0 || addr >= FD_LIMIT || !fd_map[addr])
+		return -1;
+
+	fd = fd_map[addr];
+	*next = size;
+
+	ec = ext_client_lock(addr);
+	if (!ec)
+		return -1;
+	state = ext_state(&ec->changed, offset, next);
+	pthread_mutex_unlock(&ec->lock);
+	if (state >= 0)
+		return state;
+
+	/*
+	 * The master's extent bounds the dirty map scan, so a descriptor
+	 * costs the blocks it covers, not those up to the end of the image
+	 */
+	pthread_mutex_lock(&ext_masters_lock);
+	m = ext_master(client_master_fd(fd), size);
+	if (m) {
+		state = ext_state(&m->holes, offset, next);
+		state = state < 0 ? 0 : state;
+	} else
+		state = -1;
+	pthread_mutex_unlock(&ext_masters_lock);
+
+	/* written blocks are mapped in the client's own image */
+	map = (void *)flag_map + (MAP_LEN * fd_flag_map[fd]);
+	blk = offset / BLK_SIZE;
+	dirty = map[blk] != 0;
+	while (++blk * BLK_SIZE < *next && (map[blk] != 0) == dirty)
+		;
+	*next = min_t(uint64_t, *next, blk * BLK_SIZE);
+
+	return dirty ? 0 : state;
+}
@@ -167,12 +167,14 @@ static void decode_base64_string(char *string, uint8_t *intnum, int int_len)
 
 static inline void encode_hex_string(uint8_t *intnum, long length, char *string)
 {
+	static const char hexcode[] = "0123456789abcdef";
 	int i;
-	char *strptr;
 
-	strptr = string;
-	for (i = 0; i < length; i++, strptr += 2)
-			sprintf(strptr, "%.2hhx", intnum[i]);
+	for (i = 0; i < length; i++) {
+		*string++ = hexcode[intnum[i] >> 4];
+		*string++ = hexcode[intnum[i] & 0xf];
+	}
+	*string = '\0';
 }
 
 /* Base64 encoding, taken from UNH iSCSI "IntegerToBase64String()" */
@@ -370,14 +372,10 @@ static int chap_initiator_auth_create_challenge(struct iscsi_connection *conn)
 	if (!conn->auth.chap.challenge)
 		return CHAP_TARGET_ERROR;
 
-	p = text;
-	strcpy(p, "0x");
-	p += 2;
-	for (i = 0; i < conn->auth.chap.challenge_size; i++) {
+	for (i = 0; i < conn->auth.chap.challenge_size; i++)
 		conn->auth.chap.challenge[i] = rand();
-		sprintf(p, "%.2hhx", conn->auth.chap.challenge[i]);
-		p += 2;
-	}
+	chap_encode_string(conn->auth.chap.challenge,
+			   conn->auth.chap.challenge_size, text, HEX_FORMAT);
 	text_key_add(conn, "CHAP_C",  text);
 
 	return 0;
@@ -386,7 +384,8 @@ static int chap_initiator_auth_create_challenge(struct iscsi_connection *conn)
 static int chap_initiator_auth_check_response(struct iscsi_connection *conn)
 {
 	char *value;
-	uint8_t *his_digest = NULL, *our_digest = NULL;
+	uint8_t his_digest[CHAP_SHA1_DIGEST_LEN];
+	uint8_t our_digest[CHAP_SHA1_DIGEST_LEN];
 	int digest_len = 0, retval = 0, encoding_format, err;
 	char pass[ISCSI_NAME_LEN];
 
@@ -436,15 +435,6 @@ static int chap_initiator_auth_check_response(struct iscsi_connection *conn)
 		goto out;
 	}
 
-	if (!(his_digest = malloc(digest_len))) {
-		retval = CHAP_TARGET_ERROR;
-		goto out;
-	}
-	if (!(our_digest = malloc(digest_len))) {
-		retval = CHAP_TARGET_ERROR;
-		goto out;
-	}
-
 	if (chap_decode_string(value, his_digest, digest_len, encoding_format) < 0) {
 		retval = CHAP_INITIATOR_ERROR;
 		goto out;
@@ -478,18 +468,15 @@ static int chap_initiator_auth_check_response(struct iscsi_connection *conn)
 
 	conn->state = CHAP_AUTH_STATE_RESPONSE;
  out:
-	if (his_digest)
-		free(his_digest);
-	if (our_digest)
-		free(our_digest);
 	return retval;
 }
 
 static int chap_target_auth_create_response(struct iscsi_connection *conn)
 {
-	char chap_id, *value, *response = NULL;
-	uint8_t *challenge = NULL, *digest = NULL;
-	int encoding_format, response_len;
+	char chap_id, *value;
+	char response[2 * CHAP_SHA1_DIGEST_LEN + 3];
+	uint8_t *challenge = NULL, digest[CHAP_SHA1_DIGEST_LEN];
+	int encoding_format;
 	int challenge_len = 0, digest_len = 0, retval = 0, err;
 	char pass[ISCSI_NAME_LEN], name[ISCSI_NAME_LEN];
 
@@ -552,22 +539,6 @@ static int chap_target_auth_create_response(struct iscsi_connection *conn)
 		goto out;
 	}
 
-	if (encoding_format == HEX_FORMAT)
-		response_len = 2 * digest_len;
-	else
-		response_len = ((digest_len - 1) / 3 + 1) * 4;
-	//"0x" / "0b" and "\0":
-	response_len += 3;
-
-	if (!(digest = malloc(digest_len))) {
-		retval = CHAP_TARGET_ERROR;
-		goto out;
-	}
-	if (!(response = malloc(response_len))) {
-		retval = CHAP_TARGET_ERROR;
-		goto out;
-	}
-
 	if (chap_decode_string(value, challenge, challenge_len, encoding_format) < 0) {
 		retval = CHAP_INITIATOR_ERROR;
 		goto out;
@@ -600,7 +571,7 @@ static int chap_target_auth_create_response(struct iscsi_connection *conn)
 		goto out;
 	}
 
-	memset(response, 0x0, response_len);
+	memset(response, 0x0, sizeof(response));
 	chap_encode_string(digest, digest_len, response, encoding_format);
 	text_key_add(conn, "CHAP_N", name);
 	text_key_add(conn, "CHAP_R", response);
@@ -609,10 +580,6 @@ static int chap_target_auth_create_response(struct iscsi_connection *conn)
  out:
 	if (challenge)
 		free(challenge);
-	if (digest)
-		free(digest);
-	if (response)
-		free(response);
 	return retval;
 }
 
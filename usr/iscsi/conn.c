@@ -85,6 +85,7 @@ void conn_exit(struct iscsi_connection *conn)
 
 void conn_close(struct iscsi_connection *conn)
 {
+	struct iscsi_connection *ent;
 	struct iscsi_task *task, *tmp;
 	int ret;
 
@@ -108,6 +109,21 @@ void conn_close(struct iscsi_connection *conn)
 
 	dprintf("session %p %d\n", conn->session, conn->session->refcount);
 
+	/*
+	 * At ErrorRecoveryLevel 0 a connection failure is a session
+	 * failure: the commands lost with this connection leave holes in
+	 * the session wide CmdSN window that the others can't fill.
+	 */
+	if (!conn->logout &&
+	    !conn->session->session_param[ISCSI_PARAM_ERL].val) {
+		list_for_each_entry(ent, &conn->session->conn_list, clist) {
+			if (ent == conn || ent->closed)
+				continue;
+			ent->logout = 1;
+			ent->tp->ep_force_close(ent);
+		}
+	}
+
 	/*
 	 * We just closed the ep so we are not going to send/recv anything.
 	 * Just free these up since they are not going to complete.
@@ -225,6 +241,20 @@ struct iscsi_connection *conn_find(struct iscsi_session *session, uint32_t cid)
 	return NULL;
 }
 
+/* connections of the session that are still up */
+int conn_count(struct iscsi_session *session)
+{
+	struct iscsi_connection *conn;
+	int count = 0;
+
+	list_for_each_entry(conn, &session->conn_list, clist) {
+		if (!conn->closed)
+			count++;
+	}
+
+	return count;
+}
+
 int conn_take_fd(struct iscsi_connection *conn)
 {
 	dprintf("%u %u %u %" PRIx64 "\n", conn->cid, conn->stat_sn,
@@ -262,8 +262,10 @@ static void login_security_done(struct iscsi_connection *conn)
 
 	session = session_find_name(conn->tid, conn->initiator, req->isid);
 	if (session) {
+		struct iscsi_connection *ent;
+
 		if (!req->tsih) {
-			struct iscsi_connection *ent, *next;
+			struct iscsi_connection *next;
 
 			/* do session reinstatement */
 			session_get(session);
@@ -280,8 +282,18 @@ static void login_security_done(struct iscsi_connection *conn)
 			rsp->status_detail = ISCSI_LOGIN_STATUS_TGT_NOT_FOUND;
 			conn->state = STATE_EXIT;
 			return;
-		} else if (conn_find(session, conn->cid)) {
+		} else if ((ent = conn_find(session, conn->cid))) {
 			/* do connection reinstatement */
+			session_get(session);
+			ent->logout = 1;
+			conn_close(ent);
+			session_put(session);
+		} else if (conn_count(session) >=
+			   session->session_param[ISCSI_PARAM_MAXCONNECTIONS].val) {
+			rsp->status_class = ISCSI_STATUS_CLS_INITIATOR_ERR;
+			rsp->status_detail = ISCSI_LOGIN_STATUS_CONN_ADD_FAILED;
+			conn->state = STATE_EXIT;
+			return;
 		}
 
 		/* add a new connection to the session */
@@ -356,8 +368,11 @@ static void text_scan_login(struct iscsi_connection *conn)
 
 			switch (conn->session_param[idx].state) {
 			case KEY_STATE_START:
-				if (idx >= ISCSI_PARAM_FIRST_LOCAL)
+				if (idx >= ISCSI_PARAM_FIRST_LOCAL) {
+					conn->session_param[idx].state =
+						KEY_STATE_DONE;
 					break;
+				}
 				memset(buf, 0, sizeof(buf));
 				param_val_to_str(session_keys, idx, val, buf);
 				text_key_add(conn, key, buf);
@@ -405,7 +420,13 @@ static int text_check_param(struct iscsi_connection *conn)
 		if (p[i].state == KEY_STATE_START && p[i].val != session_keys[i].def) {
 			if (conn->state == STATE_LOGIN) {
 				if (i >= ISCSI_PARAM_FIRST_LOCAL) {
-					if (p[i].val > session_keys[i].def)
+					/*
+					 * Only the initiator may raise what we
+					 * send per PDU, which text_scan_login()
+					 * has already marked done.
+					 */
+					if (i == ISCSI_PARAM_MAX_XMIT_DLENGTH &&
+					    p[i].val > session_keys[i].def)
 						p[i].val = session_keys[i].def;
 					p[i].state = KEY_STATE_DONE;
 					continue;
@@ -430,6 +451,102 @@ static int text_check_param(struct iscsi_connection *conn)
 	return cnt;
 }
 
+/*
+ * Operational negotiation results by the exact request text and what
+ * the target offered, so an initiator logging in again with the same
+ * keys gets its previous reply without parsing them another time.
+ */
+#define LOGIN_CACHE_SIZE	1024
+
+struct login_cache_ent {
+	uint32_t hash;
+	int req_len;
+	char *req;
+	int rsp_len;
+	char *rsp;
+	int stay;
+	struct param offer[ISCSI_PARAM_MAX];
+	struct param result[ISCSI_PARAM_MAX];
+};
+
+static struct login_cache_ent *login_cache[LOGIN_CACHE_SIZE];
+
+static void login_cache_replay(struct iscsi_connection *conn,
+			       struct login_cache_ent *ent)
+{
+	char buf[ent->rsp_len + 1], *key, *value, *data = buf;
+	int datasize = ent->rsp_len;
+
+	memcpy(buf, ent->rsp, ent->rsp_len);
+	while ((key = next_key(&data, &datasize, &value)))
+		text_key_add(conn, key, value);
+
+	memcpy(conn->session_param, ent->result, sizeof(ent->result));
+}
+
+static int login_negotiate(struct iscsi_connection *conn)
+{
+	struct iscsi_login_rsp *rsp = (struct iscsi_login_rsp *)&conn->rsp.bhs;
+	struct login_cache_ent *ent;
+	struct param offer[ISCSI_PARAM_MAX];
+	int len = conn->req.datasize, rsp_start, stay;
+	uint32_t hash;
+	char *req;
+
+	hash = crc32c(0, conn->req.data, len);
+	ent = login_cache[hash % LOGIN_CACHE_SIZE];
+	if (ent && ent->hash == hash && ent->req_len == len &&
+	    !memcmp(ent->req, conn->req.data, len) &&
+	    !memcmp(ent->offer, conn->session_param, sizeof(ent->offer))) {
+		login_cache_replay(conn, ent);
+		return ent->stay;
+	}
+
+	/* text_scan_login() cuts up the request */
+	req = malloc(len);
+	if (req)
+		memcpy(req, conn->req.data, len);
+	memcpy(offer, conn->session_param, sizeof(offer));
+	rsp_start = conn->rsp.datasize;
+
+	text_scan_login(conn);
+	if (rsp->status_class) {
+		free(req);
+		return 0;
+	}
+	stay = text_check_param(conn);
+
+	if (!req)
+		return stay;
+
+	if (!ent) {
+		ent = zalloc(sizeof(*ent));
+		if (!ent) {
+			free(req);
+			return stay;
+		}
+		login_cache[hash % LOGIN_CACHE_SIZE] = ent;
+	}
+	free(ent->req);
+	free(ent->rsp);
+
+	ent->hash = hash;
+	ent->req_len = len;
+	ent->req = req;
+	ent->rsp_len = conn->rsp.datasize - rsp_start;
+	ent->rsp = malloc(ent->rsp_len);
+	if (ent->rsp_len && !ent->rsp) {
+		ent->req_len = -1;
+		return stay;
+	}
+	memcpy(ent->rsp, conn->rsp.data + rsp_start, ent->rsp_len);
+	ent->stay = stay;
+	memcpy(ent->offer, offer, sizeof(offer));
+	memcpy(ent->result, conn->session_param, sizeof(ent->result));
+
+	return stay;
+}
+
 static void login_start(struct iscsi_connection *conn)
 {
 	struct iscsi_login *req = (struct iscsi_login *)&conn->req.bhs;
@@ -741,16 +858,14 @@ static void cmnd_exec_login(struct iscsi_connection *conn)
 				goto auth_err;
 			if (rsp->status_class)
 				return;
-			text_scan_login(conn);
+			stay = login_negotiate(conn);
 			if (rsp->status_class)
 				return;
-			stay = text_check_param(conn);
 			break;
 		case STATE_LOGIN:
-			text_scan_login(conn);
+			stay = login_negotiate(conn);
 			if (rsp->status_class)
 				return;
-			stay = text_check_param(conn);
 			break;
 		default:
 			goto init_err;
@@ -1165,12 +1280,52 @@ static int iscsi_data_rsp_build(struct iscsi_task *task)
 	return 0;
 }
 
+/*
+ * Queue the task to solicit more of its data. Up to MaxOutstandingR2T
+ * R2Ts are kept in flight so that a large write streams instead of
+ * waiting a round trip per burst.
+ */
+static void iscsi_r2t_queue(struct iscsi_task *task, int head)
+{
+	struct iscsi_connection *conn = task->conn;
+	struct iscsi_cmd *req = (struct iscsi_cmd *) &task->req;
+
+	if (task_r2t_queued(task) ||
+	    task->r2t_offset >= ntohl(req->data_length) ||
+	    task->r2t_inflight >= ISCSI_TASK_MAX_R2T ||
+	    task->r2t_inflight >=
+	    conn->session_param[ISCSI_PARAM_MAX_R2T].val)
+		return;
+
+	set_task_r2t_queued(task);
+	if (head)
+		list_add(&task->c_list, &conn->tx_clist);
+	else
+		list_add_tail(&task->c_list, &conn->tx_clist);
+}
+
+static struct iscsi_r2t *iscsi_r2t_find(struct iscsi_task *task, uint32_t ttt)
+{
+	int i;
+
+	for (i = 0; i < ISCSI_TASK_MAX_R2T; i++)
+		if (task->r2t[i].length && task->r2t[i].ttt == ttt)
+			return &task->r2t[i];
+
+	return NULL;
+}
+
 static int iscsi_r2t_build(struct iscsi_task *task)
 {
 	struct iscsi_connection *conn = task->conn;
 	struct iscsi_r2t_rsp *rsp = (struct iscsi_r2t_rsp *) &conn->rsp.bhs;
+	struct iscsi_cmd *req = (struct iscsi_cmd *) &task->req;
+	struct iscsi_r2t *r2t;
 	uint32_t length;
 
+	clear_task_r2t_queued(task);
+	for (r2t = task->r2t; r2t->length; r2t++)
+		;
 	memset(rsp, 0, sizeof(*rsp));
 
 	rsp->opcode = ISCSI_OP_R2T;
@@ -1179,17 +1334,26 @@ static int iscsi_r2t_build(struct iscsi_task *task)
 
 	rsp->itt = task->req.itt;
 	rsp->r2tsn = cpu_to_be32(task->exp_r2tsn++);
-	rsp->data_offset = cpu_to_be32(task->offset);
+	rsp->data_offset = cpu_to_be32(task->r2t_offset);
 	/* return next statsn for this conn w/o advancing it */
 	rsp->statsn = cpu_to_be32(conn->stat_sn);
 	rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
 	rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn +
 				     conn->session->max_queue_cmd);
-	rsp->ttt = (unsigned long) task;
-	length = min_t(uint32_t, task->r2t_count,
+	length = min_t(uint32_t, ntohl(req->data_length) - task->r2t_offset,
 		       conn->session_param[ISCSI_PARAM_MAX_BURST].val);
 	rsp->data_length = cpu_to_be32(length);
 
+	/* the R2TSN tells the R2Ts of a task apart */
+	r2t->ttt = be32_to_cpu(rsp->r2tsn);
+	r2t->offset = task->r2t_offset;
+	r2t->length = length;
+	r2t->received = 0;
+	rsp->ttt = cpu_to_be32(r2t->ttt);
+
+	task->r2t_offset += length;
+	task->r2t_inflight++;
+
 	return 0;
 }
 
@@ -1400,7 +1564,7 @@ int iscsi_scsi_cmd_execute(struct iscsi_task *task)
 
 	if ((req->flags & ISCSI_FLAG_CMD_WRITE) && task->r2t_count) {
 		if (!task->unsol_count)
-			list_add_tail(&task->c_list, &task->conn->tx_clist);
+			iscsi_r2t_queue(task, 0);
 		goto no_queuing;
 	}
 
@@ -1553,13 +1717,23 @@ static int iscsi_data_out_rx_done(struct iscsi_task *task)
 	if (hdr->ttt == cpu_to_be32(ISCSI_RESERVED_TAG)) {
 		if (hdr->flags & ISCSI_FLAG_CMD_FINAL) {
 			task->unsol_count = 0;
+			task->r2t_offset = task->offset;
 			if (!task_pending(task))
 				err = iscsi_scsi_cmd_execute(task);
 		}
 	} else {
+		struct iscsi_r2t *r2t;
+
 		if (!(hdr->flags & ISCSI_FLAG_CMD_FINAL))
 			return err;
 
+		r2t = iscsi_r2t_find(task, be32_to_cpu(hdr->ttt));
+		if (r2t->received != r2t->length)
+			eprintf("R2T %x of %" PRIx64 " got %u of %u bytes\n",
+				r2t->ttt, task->tag, r2t->received,
+				r2t->length);
+		r2t->length = 0;
+		task->r2t_inflight--;
 		err = iscsi_scsi_cmd_execute(task);
 	}
 
@@ -1583,6 +1757,29 @@ found:
 		task->r2t_count,
 		ntoh24(req->dlength), be32_to_cpu(req->offset));
 
+	/* data must come on the connection the command came on */
+	if (task->conn != conn)
+		return -EINVAL;
+
+	if (be32_to_cpu(req->offset) + ntoh24(req->dlength) >
+	    ntohl(((struct iscsi_cmd *) (&task->req))->data_length))
+		return -EINVAL;
+
+	/* solicited data must fall within the R2T it answers */
+	if (req->ttt != cpu_to_be32(ISCSI_RESERVED_TAG)) {
+		struct iscsi_r2t *r2t;
+
+		r2t = iscsi_r2t_find(task, be32_to_cpu(req->ttt));
+		if (!r2t || be32_to_cpu(req->offset) < r2t->offset ||
+		    be32_to_cpu(req->offset) + ntoh24(req->dlength) >
+		    r2t->offset + r2t->length) {
+			eprintf("Data-Out outside of R2T %x\n",
+				be32_to_cpu(req->ttt));
+			return -EINVAL;
+		}
+		r2t->received += ntoh24(req->dlength);
+	}
+
 	conn->req.data = task->data + be32_to_cpu(req->offset);
 
 	task->offset += ntoh24(req->dlength);
@@ -1677,6 +1874,7 @@ static int iscsi_scsi_cmd_rx_start(struct iscsi_connection *conn)
 
 	if (req->flags & ISCSI_FLAG_CMD_WRITE) {
 		task->offset = ntoh24(req->dlength);
+		task->r2t_offset = task->offset;
 		task->r2t_count = ntohl(req->data_length) - task->offset;
 		task->unsol_count = !(req->flags & ISCSI_FLAG_CMD_FINAL);
 
@@ -1845,9 +2043,39 @@ static int iscsi_logout_tx_start(struct iscsi_task *task)
 	struct iscsi_logout_rsp *rsp =
 		(struct iscsi_logout_rsp *) &conn->rsp.bhs;
 
+	struct iscsi_logout *req = (struct iscsi_logout *) &task->req;
+	struct iscsi_connection *ent;
+
 	rsp->opcode = ISCSI_OP_LOGOUT_RSP;
 	rsp->flags = ISCSI_FLAG_CMD_FINAL;
 	rsp->itt = task->req.itt;
+
+	switch (req->flags & ISCSI_FLAG_LOGOUT_REASON_MASK) {
+	case ISCSI_LOGOUT_REASON_CLOSE_SESSION:
+		list_for_each_entry(ent, &conn->session->conn_list, clist) {
+			if (ent == conn || ent->closed)
+				continue;
+			ent->logout = 1;
+			ent->tp->ep_force_close(ent);
+		}
+		conn->logout = 1;
+		break;
+	case ISCSI_LOGOUT_REASON_CLOSE_CONNECTION:
+		ent = conn_find(conn->session, be16_to_cpu(req->cid));
+		if (!ent)
+			rsp->response = ISCSI_LOGOUT_CID_NOT_FOUND;
+		else if (ent != conn) {
+			/* logged out from a sibling, which stays up */
+			ent->logout = 1;
+			ent->tp->ep_force_close(ent);
+		} else
+			conn->logout = 1;
+		break;
+	default:
+		rsp->response = ISCSI_LOGOUT_RECOVERY_UNSUPPORTED;
+		break;
+	}
+
 	rsp->statsn = cpu_to_be32(conn->stat_sn++);
 	rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
 	rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn +
@@ -1939,6 +2167,8 @@ static int iscsi_scsi_cmd_tx_done(struct iscsi_connection *conn)
 
 	switch (hdr->opcode & ISCSI_OPCODE_MASK) {
 	case ISCSI_OP_R2T:
+		/* send the task's next R2T right behind this one */
+		iscsi_r2t_queue(task, 1);
 		break;
 	case ISCSI_OP_SCSI_DATA_IN:
 		if (task->offset < scsi_get_in_transfer_len(&task->scmd) ||
@@ -1989,7 +2219,7 @@ static int iscsi_task_tx_done(struct iscsi_connection *conn)
 	case ISCSI_OP_SCSI_TMFUNC:
 		iscsi_free_task(task);
 
-		if (op == ISCSI_OP_LOGOUT)
+		if (op == ISCSI_OP_LOGOUT && conn->logout)
 			conn->state = STATE_CLOSE;
 	}
 
@@ -2075,6 +2305,8 @@ static int do_recv(struct iscsi_connection *conn, int next_state)
 void iscsi_rx_handler(struct iscsi_connection *conn)
 {
 	int ret = 0, hdigest, ddigest;
+	struct iovec iov[2];
+	unsigned char *data;
 	uint32_t crc;
 
 
@@ -2148,11 +2380,11 @@ again:
 		if (ret <= 0 || conn->rx_iostate != IOSTATE_RX_CHECK_HDIGEST)
 			break;
 	case IOSTATE_RX_CHECK_HDIGEST:
-		crc = ~0;
-		crc = crc32c(crc, &conn->req.bhs, BHS_SIZE);
-		if (conn->req.ahssize)
-			crc = crc32c(crc, conn->req.ahs, conn->req.ahssize);
-		crc = ~crc;
+		iov[0].iov_base = &conn->req.bhs;
+		iov[0].iov_len = BHS_SIZE;
+		iov[1].iov_base = conn->req.ahs;
+		iov[1].iov_len = conn->req.ahssize;
+		crc = ~crc32c_iov(~0, iov, conn->req.ahssize ? 2 : 1);
 		if (*((uint32_t *)conn->rx_digest) != crc) {
 			eprintf("rx hdr digest error 0x%x calc 0x%x\n",
 				*((uint32_t *)conn->rx_digest), crc);
@@ -2165,6 +2397,7 @@ again:
 		if (conn->rx_size) {
 			conn->rx_iostate = IOSTATE_RX_DATA;
 			conn->rx_buffer = conn->req.data;
+			conn->rx_crc = ~0;
 
 			if (conn->state != STATE_SCSI) {
 				if (conn->req.ahssize + conn->rx_size >
@@ -2178,8 +2411,12 @@ again:
 			break;
 		}
 	case IOSTATE_RX_DATA:
+		data = conn->rx_buffer;
 		ret = do_recv(conn, ddigest ?
 			      IOSTATE_RX_INIT_DDIGEST : IOSTATE_RX_END);
+		/* digest each chunk while it is still in cache */
+		if (ddigest && ret > 0)
+			conn->rx_crc = crc32c(conn->rx_crc, data, ret);
 		if (ret <= 0 || conn->rx_iostate != IOSTATE_RX_INIT_DDIGEST)
 			break;
 	case IOSTATE_RX_INIT_DDIGEST:
@@ -2191,11 +2428,7 @@ again:
 		if (ret <= 0 || conn->rx_iostate != IOSTATE_RX_CHECK_DDIGEST)
 			break;
 	case IOSTATE_RX_CHECK_DDIGEST:
-		crc = ~0;
-		crc = crc32c(crc, conn->req.data,
-			     roundup(conn->req.datasize,
-				     conn->tp->data_padding));
-		crc = ~crc;
+		crc = ~conn->rx_crc;
 		conn->rx_iostate = IOSTATE_RX_END;
 		if (*((uint32_t *)conn->rx_digest) != crc) {
 			eprintf("rx hdr digest error 0x%x calc 0x%x\n",
@@ -2234,7 +2467,7 @@ again:
 	}
 }
 
-static int do_send(struct iscsi_connection *conn, int next_state)
+static int do_send(struct iscsi_connection *conn, int next_state, int digest)
 {
 	int ret, opcode;
 again:
@@ -2248,6 +2481,9 @@ again:
 		return -EIO;
 	}
 
+	if (digest)
+		conn->tx_crc = crc32c(conn->tx_crc, conn->tx_buffer, ret);
+
 	conn->tx_size -= ret;
 	conn->tx_buffer += ret;
 
@@ -2306,7 +2542,7 @@ int iscsi_tx_handler(struct iscsi_connection *conn)
 again:
 	switch (conn->tx_iostate) {
 	case IOSTATE_TX_BHS:
-		ret = do_send(conn, IOSTATE_TX_INIT_AHS);
+		ret = do_send(conn, IOSTATE_TX_INIT_AHS, 0);
 		if (ret < 0)
 			break;
 	case IOSTATE_TX_INIT_AHS:
@@ -2335,7 +2571,7 @@ again:
 		conn->tx_buffer = conn->tx_digest;
 		conn->tx_size = sizeof(conn->tx_digest);
 	case IOSTATE_TX_HDIGEST:
-		ret = do_send(conn, IOSTATE_TX_INIT_DATA);
+		ret = do_send(conn, IOSTATE_TX_INIT_DATA, 0);
 		if (ret < 0)
 			break;
 	case IOSTATE_TX_INIT_DATA:
@@ -2345,6 +2581,7 @@ again:
 			conn->tx_iostate = IOSTATE_TX_DATA;
 			conn->tx_buffer = conn->rsp.data;
 			conn->tx_size = conn->rsp.datasize;
+			conn->tx_crc = ~0;
 			pad = conn->tx_size & (conn->tp->data_padding - 1);
 			if (pad) {
 				pad = PAD_WORD_LEN - pad;
@@ -2357,22 +2594,19 @@ again:
 			break;
 	case IOSTATE_TX_DATA:
 		ret = do_send(conn, ddigest ?
-			      IOSTATE_TX_INIT_DDIGEST : IOSTATE_TX_END);
+			      IOSTATE_TX_INIT_DDIGEST : IOSTATE_TX_END,
+			      ddigest);
 		if (ret < 0)
 			goto out;
 		if (conn->tx_iostate != IOSTATE_TX_INIT_DDIGEST)
 			break;
 	case IOSTATE_TX_INIT_DDIGEST:
-		crc = ~0;
-		crc = crc32c(crc, conn->rsp.data,
-			     roundup(conn->rsp.datasize,
-				     conn->tp->data_padding));
-		*(uint32_t *)conn->tx_digest = ~crc;
+		*(uint32_t *)conn->tx_digest = ~conn->tx_crc;
 		conn->tx_iostate = IOSTATE_TX_DDIGEST;
 		conn->tx_buffer = conn->tx_digest;
 		conn->tx_size = sizeof(conn->tx_digest);
 	case IOSTATE_TX_DDIGEST:
-		ret = do_send(conn, IOSTATE_TX_END);
+		ret = do_send(conn, IOSTATE_TX_END, 0);
 		break;
 	default:
 		eprintf("error %d %d\n", conn->state, conn->tx_iostate);
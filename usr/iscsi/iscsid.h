@@ -106,6 +106,17 @@ struct iscsi_session {
 	int rdma;
 };
 
+/* R2Ts one write task keeps outstanding at most */
+#define ISCSI_TASK_MAX_R2T	16
+
+/* an outstanding R2T, free while length is zero */
+struct iscsi_r2t {
+	uint32_t ttt;
+	uint32_t offset;
+	uint32_t length;
+	uint32_t received;
+};
+
 struct iscsi_task {
 	struct iscsi_hdr req;
 	struct iscsi_hdr rsp;
@@ -132,6 +143,10 @@ struct iscsi_task {
 	int r2t_count;
 	int unsol_count;
 	int exp_r2tsn;
+	/* next offset to solicit and the R2Ts awaiting their data */
+	int r2t_offset;
+	int r2t_inflight;
+	struct iscsi_r2t r2t[ISCSI_TASK_MAX_R2T];
 
 	void *ahs;
 	void *data;
@@ -147,6 +162,9 @@ struct iscsi_connection {
 	/* should be a new state */
 	int closed;
 
+	/* going away by logout or reinstatement rather than a failure */
+	int logout;
+
 	int rx_iostate;
 	int tx_iostate;
 	int refcount;
@@ -196,6 +214,9 @@ struct iscsi_connection {
 
 	unsigned char rx_digest[4];
 	unsigned char tx_digest[4];
+	/* running data digests */
+	uint32_t rx_crc;
+	uint32_t tx_crc;
 
 	int auth_state;
 	union {
@@ -275,11 +296,14 @@ struct iscsi_target {
 	int rdma;
 	int nop_interval;
 	int nop_count;
+
+	const char *profile;
 };
 
 enum task_flags {
 	TASK_pending,
 	TASK_in_scsi,
+	TASK_r2t_queued,
 };
 
 struct iscsi_portal {
@@ -303,6 +327,10 @@ extern char *portal_arguments;
 #define clear_task_in_scsi(t)	((t)->flags &= ~(1 << TASK_in_scsi))
 #define task_in_scsi(t)		((t)->flags & (1 << TASK_in_scsi))
 
+#define set_task_r2t_queued(t)	((t)->flags |= (1 << TASK_r2t_queued))
+#define clear_task_r2t_queued(t) ((t)->flags &= ~(1 << TASK_r2t_queued))
+#define task_r2t_queued(t)	((t)->flags & (1 << TASK_r2t_queued))
+
 extern int lld_index;
 extern struct list_head iscsi_targets_list;
 
@@ -316,6 +344,7 @@ extern void conn_close(struct iscsi_connection *conn);
 extern void conn_put(struct iscsi_connection *conn);
 extern int conn_get(struct iscsi_connection *conn);
 extern struct iscsi_connection * conn_find(struct iscsi_session *session, uint32_t cid);
+extern int conn_count(struct iscsi_session *session);
 extern int conn_take_fd(struct iscsi_connection *conn);
 extern void conn_add_to_session(struct iscsi_connection *conn, struct iscsi_session *session);
 extern tgtadm_err conn_close_admin(uint32_t tid, uint64_t sid, uint32_t cid);
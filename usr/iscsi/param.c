@@ -16,6 +16,7 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
  * 02110-1301 USA
  */
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
@@ -24,10 +25,54 @@
 
 #include "iscsid.h"
 
+/* session_keys by name, index + 1 in each slot, built on first use */
+#define KEY_HASH_SIZE	128
+
+static unsigned char session_key_hash[KEY_HASH_SIZE];
+
+static unsigned int key_hash(char *name)
+{
+	unsigned int h = 0;
+
+	while (*name)
+		h = h * 31 + tolower(*name++);
+
+	return h % KEY_HASH_SIZE;
+}
+
+static int session_key_index(char *name)
+{
+	static int built;
+	unsigned int h;
+	int i;
+
+	if (!built) {
+		for (i = 0; session_keys[i].name; i++) {
+			h = key_hash(session_keys[i].name);
+			while (session_key_hash[h])
+				h = (h + 1) % KEY_HASH_SIZE;
+			session_key_hash[h] = i + 1;
+		}
+		built = 1;
+	}
+
+	for (h = key_hash(name); session_key_hash[h];
+	     h = (h + 1) % KEY_HASH_SIZE) {
+		i = session_key_hash[h] - 1;
+		if (!strcasecmp(session_keys[i].name, name))
+			return i;
+	}
+
+	return -ENOENT;
+}
+
 int param_index_by_name(char *name, struct iscsi_key *keys)
 {
 	int i, err = -ENOENT;
 
+	if (keys == session_keys)
+		return session_key_index(name);
+
 	for (i = 0; keys[i].name; i++) {
 		if (!strcasecmp(keys[i].name, name)) {
 			err = i;
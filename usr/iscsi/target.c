@@ -436,14 +436,14 @@ int iscsi_target_create(struct target *t)
 	int tid = t->tid;
 	struct iscsi_target *target;
 	struct param default_tgt_session_param[] = {
-		[ISCSI_PARAM_MAX_RECV_DLENGTH] = {0, 8192},
+		[ISCSI_PARAM_MAX_RECV_DLENGTH] = {0, 262144},
 		[ISCSI_PARAM_HDRDGST_EN] = {0, DIGEST_NONE},
 		[ISCSI_PARAM_DATADGST_EN] = {0, DIGEST_NONE},
 		[ISCSI_PARAM_INITIAL_R2T_EN] = {0, 1},
-		[ISCSI_PARAM_MAX_R2T] = {0, 1},
+		[ISCSI_PARAM_MAX_R2T] = {0, 4},
 		[ISCSI_PARAM_IMM_DATA_EN] = {0, 1},
-		[ISCSI_PARAM_FIRST_BURST] = {0, 65536},
-		[ISCSI_PARAM_MAX_BURST] = {0, 262144},
+		[ISCSI_PARAM_FIRST_BURST] = {0, 262144},
+		[ISCSI_PARAM_MAX_BURST] = {0, 1048576},
 		[ISCSI_PARAM_PDU_INORDER_EN] = {0, 1},
 		[ISCSI_PARAM_DATASEQ_INORDER_EN] = {0, 1},
 		[ISCSI_PARAM_ERL] = {0, 0},
@@ -478,6 +478,7 @@ int iscsi_target_create(struct target *t)
 	target->tid = tid;
 	target->nop_interval = default_nop_interval;
 	target->nop_count = default_nop_count;
+	target->profile = "default";
 	list_add_tail(&target->tlist, &iscsi_targets_list);
 
 	isns_target_register(tgt_targetname(tid));
@@ -504,6 +505,67 @@ static int iscsi_session_param_update(struct iscsi_target* target, int idx, char
 	return 0;
 }
 
+/*
+ * Performance profiles set the negotiation offers, the command window
+ * and NOP-Out probing of a target together. "default" restores what a
+ * new target starts with. Keys set after a profile override it. Only
+ * sessions logging in afterwards are affected.
+ */
+static struct iscsi_profile {
+	const char *name;
+	unsigned int max_recv_dlength;
+	unsigned int first_burst;
+	unsigned int max_burst;
+	unsigned int max_r2t;
+	unsigned int initial_r2t;
+	unsigned int max_queue_cmd;
+	unsigned int max_connections;
+	/* -1 for the tgtd defaults */
+	int nop_interval;
+	int nop_count;
+} iscsi_profiles[] = {
+	{"default", 262144, 262144, 1048576, 4, 1, MAX_QUEUE_CMD_DEF, 1, -1, -1},
+	/*
+	 * few large PDUs, deep queues, lazy dead peer detection, and
+	 * connections an MC/S initiator can spread its commands over
+	 */
+	{"lan-bulk", 1048576, 1048576, 8388608, 8, 0, MAX_QUEUE_CMD_MAX,
+	 4, 30, 4},
+	/* no R2T round trip for small writes, fast failover */
+	{"lan-latency", 262144, 262144, 262144, 16, 0, 256, 1, 5, 3},
+};
+
+static int iscsi_target_profile_apply(struct iscsi_target *target,
+				      const char *name)
+{
+	struct iscsi_profile *pf;
+	struct param *p = target->session_param;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(iscsi_profiles); i++) {
+		pf = &iscsi_profiles[i];
+		if (strcmp(pf->name, name))
+			continue;
+
+		p[ISCSI_PARAM_MAX_RECV_DLENGTH].val = pf->max_recv_dlength;
+		p[ISCSI_PARAM_FIRST_BURST].val = pf->first_burst;
+		p[ISCSI_PARAM_MAX_BURST].val = pf->max_burst;
+		p[ISCSI_PARAM_MAX_R2T].val = pf->max_r2t;
+		p[ISCSI_PARAM_INITIAL_R2T_EN].val = pf->initial_r2t;
+		p[ISCSI_PARAM_IMM_DATA_EN].val = 1;
+		p[ISCSI_PARAM_MAX_QUEUE_CMD].val = pf->max_queue_cmd;
+		p[ISCSI_PARAM_MAXCONNECTIONS].val = pf->max_connections;
+		target->nop_interval = pf->nop_interval < 0 ?
+			default_nop_interval : pf->nop_interval;
+		target->nop_count = pf->nop_count < 0 ?
+			default_nop_count : pf->nop_count;
+		target->profile = pf->name;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
 tgtadm_err iscsi_target_update(int mode, int op, int tid, uint64_t sid, uint64_t lun,
 			       uint32_t cid, char *name)
 {
@@ -565,6 +627,11 @@ tgtadm_err iscsi_target_update(int mode, int op, int tid, uint64_t sid, uint64_t
 			adm_err = !err ? TGTADM_SUCCESS :
 				TGTADM_INVALID_REQUEST;
 			break;
+		} else if (!strcmp(name, "profile")) {
+			err = iscsi_target_profile_apply(target, str);
+			adm_err = !err ? TGTADM_SUCCESS :
+				TGTADM_INVALID_REQUEST;
+			break;
 		}
 
 		idx = param_index_by_name(name, session_keys);
@@ -676,6 +743,7 @@ static tgtadm_err iscsi_target_show_portals(struct iscsi_target *target, uint64_
 
 static tgtadm_err show_nop_info(struct iscsi_target *target, struct concat_buf *b)
 {
+	concat_printf(b, "profile=%s\n", target->profile);
 	concat_printf(b, "nop_interval=%d\n", target->nop_interval);
 	concat_printf(b, "nop_count=%d\n", target->nop_count);
 	return TGTADM_SUCCESS;
@@ -20,12 +20,17 @@
  */
 
 #include <fcntl.h>
+#include <limits.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 #include "bs_ssc.h"
 #include "ssc.h"
+#include "libssc.h"
 #include "be_byteshift.h"
 #include "crc32c.h"
 
@@ -182,16 +187,10 @@ int ssc_write_mam_info(int fd, struct MAM_info *i)
 	return  0;
 }
 
-int ssc_read_blkhdr(int fd, struct blk_header_info *i, loff_t offset)
+void ssc_unpack_blkhdr(struct blk_header *m, struct blk_header_info *i)
 {
-	size_t count;
-	struct blk_header h, *m = &h;
 	uint32_t crc = ~0;
 
-	count = pread64(fd, m, SSC_BLK_HDR_SIZE, offset);
-	if (count != SSC_BLK_HDR_SIZE)
-		return 1;
-
 	crc = crc32c(crc, &m->ondisk_sz, SSC_BLK_HDR_SIZE - sizeof(m->h_csum));
 
 	if (*(uint32_t *)m->h_csum != ~crc)
@@ -204,14 +203,24 @@ int ssc_read_blkhdr(int fd, struct blk_header_info *i, loff_t offset)
 	SSC_GET_MAM_INFO_VAL(prev, 64);
 	SSC_GET_MAM_INFO_VAL(curr, 64);
 	SSC_GET_MAM_INFO_VAL(next, 64);
-
-	return 0;
 }
 
-int ssc_write_blkhdr(int fd, struct blk_header_info *i, loff_t offset)
+int ssc_read_blkhdr(int fd, struct blk_header_info *i, loff_t offset)
 {
 	size_t count;
 	struct blk_header h, *m = &h;
+
+	count = pread64(fd, m, SSC_BLK_HDR_SIZE, offset);
+	if (count != SSC_BLK_HDR_SIZE)
+		return 1;
+
+	ssc_unpack_blkhdr(m, i);
+
+	return 0;
+}
+
+void ssc_pack_blkhdr(struct blk_header_info *i, struct blk_header *m)
+{
 	uint32_t crc = ~0;
 
 	SSC_PUT_MAM_INFO_VAL(ondisk_sz, 32);
@@ -224,6 +233,14 @@ int ssc_write_blkhdr(int fd, struct blk_header_info *i, loff_t offset)
 
 	crc = crc32c(crc, &m->ondisk_sz, SSC_BLK_HDR_SIZE - sizeof(m->h_csum));
 	*(uint32_t *)m->h_csum = ~crc;
+}
+
+int ssc_write_blkhdr(int fd, struct blk_header_info *i, loff_t offset)
+{
+	size_t count;
+	struct blk_header h, *m = &h;
+
+	ssc_pack_blkhdr(i, m);
 
 	count = pwrite64(fd, m, SSC_BLK_HDR_SIZE, offset);
 	if (count != SSC_BLK_HDR_SIZE)
@@ -231,3 +248,174 @@ int ssc_write_blkhdr(int fd, struct blk_header_info *i, loff_t offset)
 
 	return 0;
 }
+
+/* entries the index grows by */
+#define SSC_INDEX_GROW	(1ULL << 16)
+
+static size_t ssc_index_len(uint64_t alloc)
+{
+	return sizeof(struct blk_index_header) + alloc * sizeof(struct blk_index);
+}
+
+static int ssc_index_map(struct ssc_index *ix, uint64_t alloc)
+{
+	size_t len = ssc_index_len(alloc);
+	void *p;
+
+	if (ix->fd >= 0 && ftruncate(ix->fd, len))
+		return 1;
+
+	if (ix->hdr)
+		p = mremap(ix->hdr, ssc_index_len(ix->alloc), len,
+			   MREMAP_MAYMOVE);
+	else if (ix->fd >= 0)
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 ix->fd, 0);
+	else
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return 1;
+
+	ix->hdr = p;
+	ix->e = (struct blk_index *)(ix->hdr + 1);
+	ix->alloc = alloc;
+
+	return 0;
+}
+
+/* Whether the index belongs to the image on fd and is complete */
+static int ssc_index_check(struct ssc_index *ix, int fd, uint8_t *serial)
+{
+	struct blk_index_header *hdr = ix->hdr;
+	struct blk_header_info h;
+	uint64_t nr = hdr->nr;
+
+	if (memcmp(hdr->magic, SSC_INDEX_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != SSC_INDEX_VERSION || hdr->dirty ||
+	    memcmp(hdr->serial, serial, sizeof(hdr->serial)) ||
+	    nr < 2 || nr > ix->alloc)
+		return 1;
+
+	/* the image may have been written without the index */
+	if (ssc_read_blkhdr(fd, &h, ix->e[nr - 1].offset) ||
+	    h.blk_type != BLK_EOD || h.blk_num != nr - 1 ||
+	    h.prev != ix->e[nr - 2].offset)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Maps the index of the tape image at path, open on fd. If the index
+ * file can't be had, the index is kept in memory only. Returns 0 if it
+ * is usable, 1 if it has to be built first and -1 on failure.
+ */
+int ssc_index_open(struct ssc_index *ix, const char *path, int fd,
+		   uint8_t *serial)
+{
+	char name[PATH_MAX];
+	uint64_t alloc = SSC_INDEX_GROW;
+	struct stat st;
+
+	memset(ix, 0, sizeof(*ix));
+
+	snprintf(name, sizeof(name), "%s.idx", path);
+	ix->fd = open(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP);
+	if (ix->fd >= 0 && !fstat(ix->fd, &st) &&
+	    st.st_size > ssc_index_len(alloc))
+		alloc = (st.st_size - ssc_index_len(0)) /
+			sizeof(struct blk_index);
+
+	if (ix->fd >= 0 && ssc_index_map(ix, alloc)) {
+		close(ix->fd);
+		ix->fd = -1;
+	}
+	if (ix->fd < 0 && ssc_index_map(ix, alloc))
+		return -1;
+
+	return ssc_index_check(ix, fd, serial);
+}
+
+/* Writes the index out, and marks it clean once it is */
+static void ssc_index_sync(struct ssc_index *ix)
+{
+	if (ix->fd < 0)
+		return;
+
+	msync(ix->hdr, ssc_index_len(ix->hdr->nr), MS_SYNC);
+	ix->hdr->dirty = 0;
+	msync(ix->hdr, sizeof(*ix->hdr), MS_SYNC);
+}
+
+/*
+ * Builds the index by walking the block list of the image on fd, one
+ * header after the other from BOT to EOD.
+ */
+int ssc_index_build(struct ssc_index *ix, int fd, uint8_t *serial)
+{
+	struct blk_header_info h;
+	loff_t offset = 0;
+
+	memset(ix->hdr, 0, sizeof(*ix->hdr));
+
+	for (;;) {
+		if (ssc_read_blkhdr(fd, &h, offset) || h.curr != offset ||
+		    h.blk_num != ix->hdr->nr || ssc_index_put(ix, &h))
+			return 1;
+		if (h.blk_type == BLK_EOD)
+			break;
+		if (h.next <= offset)
+			return 1;
+		offset = h.next;
+	}
+
+	memcpy(ix->hdr->magic, SSC_INDEX_MAGIC, sizeof(ix->hdr->magic));
+	ix->hdr->version = SSC_INDEX_VERSION;
+	memcpy(ix->hdr->serial, serial, sizeof(ix->hdr->serial));
+	ssc_index_sync(ix);
+
+	return 0;
+}
+
+/*
+ * Records block h, which makes it the last one in the index. The index
+ * is marked dirty, on disk, before its first change.
+ */
+int ssc_index_put(struct ssc_index *ix, struct blk_header_info *h)
+{
+	uint64_t n = h->blk_num;
+
+	if (n > ix->hdr->nr)
+		return 1;
+	if (n >= ix->alloc &&
+	    ssc_index_map(ix, (n / SSC_INDEX_GROW + 1) * SSC_INDEX_GROW))
+		return 1;
+
+	if (!ix->hdr->dirty) {
+		ix->hdr->dirty = 1;
+		if (ix->fd >= 0)
+			msync(ix->hdr, sizeof(*ix->hdr), MS_SYNC);
+	}
+
+	ix->e[n].offset = h->curr;
+	ix->e[n].marks = (n ? ix->e[n - 1].marks : 0) +
+		(h->blk_type == BLK_FILEMARK);
+	ix->hdr->nr = n + 1;
+
+	return 0;
+}
+
+void ssc_index_close(struct ssc_index *ix)
+{
+	if (!ix->hdr)
+		return;
+
+	if (ix->hdr->dirty)
+		ssc_index_sync(ix);
+	munmap(ix->hdr, ssc_index_len(ix->alloc));
+	if (ix->fd >= 0)
+		close(ix->fd);
+	ix->hdr = NULL;
+	ix->e = NULL;
+}
@@ -5,5 +5,13 @@ extern int ssc_read_mam_info(int fd, struct MAM_info *i);
 extern int ssc_write_mam_info(int fd, struct MAM_info *i);
 extern int ssc_read_blkhdr(int fd, struct blk_header_info *h, loff_t offset);
 extern int ssc_write_blkhdr(int fd, struct blk_header_info *h, loff_t offset);
+extern void ssc_pack_blkhdr(struct blk_header_info *h, struct blk_header *m);
+extern void ssc_unpack_blkhdr(struct blk_header *m, struct blk_header_info *h);
+
+extern int ssc_index_open(struct ssc_index *ix, const char *path, int fd,
+			  uint8_t *serial);
+extern int ssc_index_build(struct ssc_index *ix, int fd, uint8_t *serial);
+extern int ssc_index_put(struct ssc_index *ix, struct blk_header_info *h);
+extern void ssc_index_close(struct ssc_index *ix);
 
 #endif
@@ -19,14 +19,19 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <syslog.h>
 #include <signal.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <sys/shm.h>
 #include <sys/ipc.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/prctl.h>
@@ -41,101 +46,401 @@
 #define logdbg(file, fmt, args...) do {} while (0)
 #endif
 
+#define LOG_PAD		-1
+#define LOG_POLL_USEC	100000
+
+#define ALIGN8(x)	(((x) + 7) & ~7UL)
+
 static struct logarea *la;
 static char *log_name;
 int is_debug = 0;
 static pid_t pid;
 
-static int logarea_init (int size)
+static __thread struct logring *my_ring;
+static pthread_key_t ring_key;
+
+/* the bounds of tgtd's own image, from the linker */
+extern char __executable_start[], _end[];
+
+/* length modifiers of a conversion specification */
+enum {
+	LM_NONE,
+	LM_HH,
+	LM_H,
+	LM_L,
+	LM_LL,
+	LM_J,
+	LM_Z,
+	LM_T,
+	LM_LD,
+};
+
+/* how the argument of a conversion is stored in a record */
+enum {
+	ARG_NONE,
+	ARG_INT,
+	ARG_UINT,
+	ARG_DOUBLE,
+	ARG_PTR,
+	ARG_STR,
+	ARG_BAD,
+};
+
+struct fmt_spec {
+	int len;	/* from '%' through the conversion character */
+	int nstar;	/* '*' width/precision, one int argument each */
+	int lmod;
+	int type;
+};
+
+static int fmt_parse(const char *p, struct fmt_spec *s)
 {
-	int shmid;
-	extern char mgmt_path[];
-	key_t semkey;
+	const char *q = p + 1;
+
+	s->nstar = 0;
+	s->lmod = LM_NONE;
+
+	while (*q && strchr("-+ #0'I", *q))
+		q++;
+
+	if (*q == '*') {
+		s->nstar++;
+		q++;
+	} else
+		while (isdigit(*q))
+			q++;
+
+	if (*q == '.') {
+		q++;
+		if (*q == '*') {
+			s->nstar++;
+			q++;
+		} else
+			while (isdigit(*q))
+				q++;
+	}
 
-	logdbg(stderr,"enter logarea_init\n");
+	switch (*q) {
+	case 'h':
+		s->lmod = (*++q == 'h') ? (q++, LM_HH) : LM_H;
+		break;
+	case 'l':
+		s->lmod = (*++q == 'l') ? (q++, LM_LL) : LM_L;
+		break;
+	case 'q':
+		s->lmod = LM_LL;
+		q++;
+		break;
+	case 'j':
+		s->lmod = LM_J;
+		q++;
+		break;
+	case 'z':
+		s->lmod = LM_Z;
+		q++;
+		break;
+	case 't':
+		s->lmod = LM_T;
+		q++;
+		break;
+	case 'L':
+		s->lmod = LM_LD;
+		q++;
+		break;
+	}
 
-	if ((shmid = shmget(IPC_PRIVATE, sizeof(struct logarea),
-			    0644 | IPC_CREAT | IPC_EXCL)) == -1) {
-		syslog(LOG_ERR, "shmget logarea failed %d", errno);
-		return 1;
+	switch (*q) {
+	case 'd':
+	case 'i':
+		s->type = ARG_INT;
+		break;
+	case 'o':
+	case 'u':
+	case 'x':
+	case 'X':
+		s->type = ARG_UINT;
+		break;
+	case 'c':
+		s->type = (s->lmod == LM_NONE) ? ARG_INT : ARG_BAD;
+		break;
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		s->type = (s->lmod == LM_NONE || s->lmod == LM_L) ?
+			ARG_DOUBLE : ARG_BAD;
+		break;
+	case 's':
+		s->type = (s->lmod == LM_NONE) ? ARG_STR : ARG_BAD;
+		break;
+	case 'p':
+		s->type = ARG_PTR;
+		break;
+	case 'm':
+	case '%':
+		s->type = ARG_NONE;
+		break;
+	default:
+		s->type = ARG_BAD;
+		break;
 	}
 
-	la = shmat(shmid, NULL, 0);
-	if (!la) {
-		syslog(LOG_ERR, "shmat logarea failed %d", errno);
-		return 1;
+	if (!*q)
+		return -1;
+
+	s->len = q - p + 1;
+	return 0;
+}
+
+static uint64_t va_int(va_list *ap, int lmod, int is_signed)
+{
+	switch (lmod) {
+	case LM_L:
+		return is_signed ? va_arg(*ap, long) :
+			va_arg(*ap, unsigned long);
+	case LM_LL:
+		return is_signed ? va_arg(*ap, long long) :
+			va_arg(*ap, unsigned long long);
+	case LM_J:
+		return is_signed ? va_arg(*ap, intmax_t) :
+			va_arg(*ap, uintmax_t);
+	case LM_Z:
+		return is_signed ? va_arg(*ap, ssize_t) :
+			va_arg(*ap, size_t);
+	case LM_T:
+		return va_arg(*ap, ptrdiff_t);
+	default:
+		return is_signed ? va_arg(*ap, int) :
+			va_arg(*ap, unsigned int);
 	}
+}
 
-	shmctl(shmid, IPC_RMID, NULL);
+/*
+ * Store the arguments of fmt into args in binary form. Returns the
+ * number of bytes used, or -1 when the record has to be formatted
+ * eagerly (unsupported conversion or not enough room).
+ */
+static int log_serialize(char *args, int len, const char *fmt, va_list *ap)
+{
+	struct fmt_spec s;
+	uint64_t v;
+	double d;
+	void *ptr;
+	char *str;
+	uint32_t slen;
+	int off = 0, i;
+
+	for (; *fmt; fmt++) {
+		if (*fmt != '%')
+			continue;
+
+		if (fmt_parse(fmt, &s) || s.type == ARG_BAD)
+			return -1;
+		fmt += s.len - 1;
+
+		for (i = 0; i < s.nstar; i++) {
+			if (off + sizeof(v) > len)
+				return -1;
+			v = va_arg(*ap, int);
+			memcpy(args + off, &v, sizeof(v));
+			off += sizeof(v);
+		}
 
-	if (size < MAX_MSG_SIZE)
-		size = LOG_SPACE_SIZE;
+		switch (s.type) {
+		case ARG_INT:
+		case ARG_UINT:
+			if (off + sizeof(v) > len)
+				return -1;
+			v = va_int(ap, s.lmod, s.type == ARG_INT);
+			memcpy(args + off, &v, sizeof(v));
+			off += sizeof(v);
+			break;
+		case ARG_DOUBLE:
+			if (off + sizeof(d) > len)
+				return -1;
+			d = va_arg(*ap, double);
+			memcpy(args + off, &d, sizeof(d));
+			off += sizeof(d);
+			break;
+		case ARG_PTR:
+			if (off + sizeof(ptr) > len)
+				return -1;
+			ptr = va_arg(*ap, void *);
+			memcpy(args + off, &ptr, sizeof(ptr));
+			off += sizeof(ptr);
+			break;
+		case ARG_STR:
+			str = va_arg(*ap, char *);
+			if (!str)
+				str = "(null)";
+			slen = strnlen(str, MAX_MSG_SIZE);
+			if (off + sizeof(slen) + slen > len)
+				return -1;
+			memcpy(args + off, &slen, sizeof(slen));
+			memcpy(args + off + sizeof(slen), str, slen);
+			off = ALIGN8(off + sizeof(slen) + slen);
+			break;
+		}
+	}
 
-	if ((shmid = shmget(IPC_PRIVATE, size,
-			    0644 | IPC_CREAT | IPC_EXCL)) == -1) {
-		syslog(LOG_ERR, "shmget msg failed %d", errno);
-		shmdt(la);
-		return 1;
+	return off;
+}
+
+/*
+ * Rebuild the message of a record, called by the logger only.
+ */
+static void log_format(struct logrec *rec, char *buff, int size)
+{
+	const char *fmt = rec->fmt;
+	const char *args = rec->args;
+	struct fmt_spec s;
+	char spec[64], *sp, str[MAX_MSG_SIZE + 1];
+	int out = 0, i, n, star;
+	char conv;
+	uint64_t v;
+	double d;
+	void *ptr;
+	uint32_t slen;
+
+	if (!fmt) {
+		snprintf(buff, size, "%s", args);
+		return;
 	}
 
-	la->start = shmat(shmid, NULL, 0);
-	if (!la->start) {
-		syslog(LOG_ERR, "shmat msg failed %d", errno);
-		shmdt(la);
-		return 1;
+	buff[0] = '\0';
+	for (; *fmt && out < size - 1; fmt++) {
+		if (*fmt != '%') {
+			buff[out++] = *fmt;
+			continue;
+		}
+
+		fmt_parse(fmt, &s);
+
+		/* resolve '*' so that only the value is left to pass */
+		sp = spec;
+		for (i = 0; i < s.len && sp < spec + sizeof(spec) - 12; i++) {
+			if (fmt[i] != '*') {
+				*sp++ = fmt[i];
+				continue;
+			}
+			memcpy(&v, args, sizeof(v));
+			args += sizeof(v);
+			star = (int)v;
+			sp += sprintf(sp, "%d", star);
+		}
+		*sp = '\0';
+		conv = fmt[s.len - 1];
+		fmt += s.len - 1;
+
+		switch (s.type) {
+		case ARG_NONE:
+			if (conv == 'm')
+				n = snprintf(buff + out, size - out, "%s",
+					     strerror(rec->err));
+			else
+				n = snprintf(buff + out, size - out, "%%");
+			break;
+		case ARG_INT:
+		case ARG_UINT:
+			memcpy(&v, args, sizeof(v));
+			args += sizeof(v);
+			switch (s.lmod) {
+			case LM_L:
+				n = snprintf(buff + out, size - out, spec,
+					     (long)v);
+				break;
+			case LM_LL:
+				n = snprintf(buff + out, size - out, spec,
+					     (long long)v);
+				break;
+			case LM_J:
+				n = snprintf(buff + out, size - out, spec,
+					     (intmax_t)v);
+				break;
+			case LM_Z:
+				n = snprintf(buff + out, size - out, spec,
+					     (size_t)v);
+				break;
+			case LM_T:
+				n = snprintf(buff + out, size - out, spec,
+					     (ptrdiff_t)v);
+				break;
+			default:
+				n = snprintf(buff + out, size - out, spec,
+					     (int)v);
+				break;
+			}
+			break;
+		case ARG_DOUBLE:
+			memcpy(&d, args, sizeof(d));
+			args += sizeof(d);
+			n = snprintf(buff + out, size - out, spec, d);
+			break;
+		case ARG_PTR:
+			memcpy(&ptr, args, sizeof(ptr));
+			args += sizeof(ptr);
+			n = snprintf(buff + out, size - out, spec, ptr);
+			break;
+		case ARG_STR:
+			memcpy(&slen, args, sizeof(slen));
+			memcpy(str, args + sizeof(slen), slen);
+			str[slen] = '\0';
+			args += ALIGN8(sizeof(slen) + slen);
+			n = snprintf(buff + out, size - out, spec, str);
+			break;
+		default:
+			n = 0;
+			break;
+		}
+
+		if (n > 0)
+			out += n;
 	}
-	memset(la->start, 0, size);
 
-	shmctl(shmid, IPC_RMID, NULL);
+	if (out > size - 1)
+		out = size - 1;
+	buff[out] = '\0';
+}
+
+static int logarea_init (int size)
+{
+	int shmid, i;
+	size_t len;
+
+	logdbg(stderr,"enter logarea_init\n");
+
+	if (size < MAX_MSG_SIZE)
+		size = LOG_SPACE_SIZE;
 
-	la->empty = 1;
-	la->end = la->start + size;
-	la->head = la->start;
-	la->tail = la->start;
+	/* a power of two so that ring positions are a simple mask */
+	len = LOG_REC_MAX * 2;
+	while (len < size)
+		len <<= 1;
 
-	if ((shmid = shmget(IPC_PRIVATE, MAX_MSG_SIZE + sizeof(struct logmsg),
+	if ((shmid = shmget(IPC_PRIVATE,
+			    sizeof(struct logarea) + len * LOG_MAX_RINGS,
 			    0644 | IPC_CREAT | IPC_EXCL)) == -1) {
-		syslog(LOG_ERR, "shmget logmsg failed %d", errno);
-		shmdt(la->start);
-		shmdt(la);
+		syslog(LOG_ERR, "shmget logarea failed %d", errno);
 		return 1;
 	}
-	la->buff = shmat(shmid, NULL, 0);
-	if (!la->buff) {
-		syslog(LOG_ERR, "shmat logmsgfailed %d", errno);
-		shmdt(la->start);
-		shmdt(la);
+
+	la = shmat(shmid, NULL, 0);
+	if (la == (void *)-1) {
+		syslog(LOG_ERR, "shmat logarea failed %d", errno);
+		la = NULL;
 		return 1;
 	}
 
 	shmctl(shmid, IPC_RMID, NULL);
 
-	if ((semkey = ftok(mgmt_path, 'a')) < 0) {
-		syslog(LOG_ERR, "semkey failed %d", errno);
-		return 1;
-	}
-
-        if ((semget(semkey, 0, IPC_EXCL)) > 0) {
-		/* Semkey may exists after SIGKILL tgtd */
-		syslog(LOG_WARNING, "semkey 0x%x already exists", semkey);
-	}
-	if ((la->semid = semget(semkey, 1, 0666 | IPC_CREAT)) < 0) {
-		syslog(LOG_ERR, "semget failed %d", errno);
-		shmdt(la->buff);
-		shmdt(la->start);
-		shmdt(la);
-		return 1;
-	}
-	syslog(LOG_INFO, "semkey 0x%x", semkey);
-
-	la->semarg.val=1;
-	if (semctl(la->semid, 0, SETVAL, la->semarg) < 0) {
-		syslog(LOG_ERR, "semctl failed %d", errno);
-		shmdt(la->buff);
-		shmdt(la->start);
-		shmdt(la);
-		return 1;
-	}
+	memset(la, 0, sizeof(struct logarea));
+	la->ring_size = len;
+	for (i = 0; i < LOG_MAX_RINGS; i++)
+		la->rings[i].buf = (char *)(la + 1) + len * i;
 
 	return 0;
 }
@@ -144,150 +449,224 @@ static void free_logarea (void)
 {
 	if (!la)
 		return;
-	semctl(la->semid, 0, IPC_RMID, la->semarg);
-	shmdt(la->buff);
-	shmdt(la->start);
 	shmdt(la);
 	la = NULL;
 }
 
-#if LOGDBG
-static void dump_logarea (void)
+/*
+ * Start time of a thread, in clock ticks since boot, 0 if it is gone.
+ * With its tid it tells a thread from a later one that reuses the tid.
+ */
+static uint64_t log_tid_start(pid_t tid)
 {
-	struct logmsg * msg;
-
-	logdbg(stderr, "\n==== area: start addr = %p, end addr = %p ====\n",
-		la->start, la->end);
-	logdbg(stderr, "|addr     |next     |prio|msg\n");
+	char path[64], buf[512], *p;
+	unsigned long long start;
+	FILE *f;
+	int i;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", tid);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	p = fgets(buf, sizeof(buf), f);
+	fclose(f);
+	if (!p)
+		return 0;
+
+	/* starttime is field 22, the 20th after the command name */
+	p = strrchr(buf, ')');
+	for (i = 0; p && i < 20; i++)
+		p = strchr(p + 1, ' ');
+	if (!p || sscanf(p, "%llu", &start) != 1)
+		return 0;
+
+	return start;
+}
 
-	for (msg = (struct logmsg *)la->head; (void *)msg != la->tail;
-	     msg = msg->next)
-		logdbg(stderr, "|%p |%p |%i   |%s\n", (void *)msg, msg->next,
-				msg->prio, (char *)&msg->str);
+static void log_ring_put(void *data)
+{
+	struct logring *ring = data;
 
-	logdbg(stderr, "|%p |%p |%i   |%s\n", (void *)msg, msg->next,
-			msg->prio, (char *)&msg->str);
+	__atomic_store_n(&ring->start, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring->owner, 0, __ATOMIC_RELEASE);
+}
 
-	logdbg(stderr, "\n\n");
+static void log_ring_forget(void)
+{
+	/* the child of a fork must not share the parent's ring */
+	my_ring = NULL;
 }
-#endif
 
-static int log_enqueue(int prio, const char *fmt, va_list ap)
+static int log_ring_claim(struct logring *ring, pid_t old, pid_t tid)
 {
-	int len, fwd;
-	char buff[MAX_MSG_SIZE];
-	struct logmsg * msg;
-	struct logmsg * lastmsg;
+	if (!__atomic_compare_exchange_n(&ring->owner, &old, tid, 0,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 0;
+
+	__atomic_store_n(&ring->start, log_tid_start(tid), __ATOMIC_RELEASE);
+	my_ring = ring;
+	pthread_setspecific(ring_key, ring);
+	return 1;
+}
 
-	lastmsg = (struct logmsg *)la->tail;
+/* Whether the owner of a ring is gone, its tid may have been reused */
+static int log_ring_orphaned(struct logring *ring, pid_t owner)
+{
+	uint64_t start;
 
-	if (!la->empty) {
-		fwd = sizeof(struct logmsg) +
-		      strlen((char *)&lastmsg->str) * sizeof(char) + 1;
-		la->tail += fwd;
-	}
-	vsnprintf(buff, MAX_MSG_SIZE, fmt, ap);
-	len = strlen(buff) * sizeof(char) + 1;
-
-	/* not enough space on tail : rewind */
-	if (la->head <= la->tail &&
-	    (len + sizeof(struct logmsg)) > (la->end - la->tail)) {
-		logdbg(stderr, "enqueue: rewind tail to %p\n", la->tail);
-			la->tail = la->start;
-	}
+	if (kill(owner, 0) < 0 && errno == ESRCH)
+		return 1;
 
-	/* not enough space on head : drop msg */
-	if (la->head > la->tail &&
-	    (len + sizeof(struct logmsg)) > (la->head - la->tail)) {
-		logdbg(stderr, "enqueue: log area overrun, drop msg\n");
+	/* still being claimed, or its start time couldn't be read */
+	start = __atomic_load_n(&ring->start, __ATOMIC_ACQUIRE);
+	if (!start)
+		return 0;
 
-		if (!la->empty)
-			la->tail = lastmsg;
+	return log_tid_start(owner) != start;
+}
 
-		return 1;
+static struct logring *log_ring_get(void)
+{
+	pid_t tid, owner;
+	int i;
+
+	if (likely(my_ring != NULL))
+		return my_ring;
+
+	tid = syscall(SYS_gettid);
+	for (i = 0; i < LOG_MAX_RINGS; i++)
+		if (log_ring_claim(&la->rings[i], 0, tid))
+			return my_ring;
+
+	/* reuse the ring of a thread or process that is gone */
+	for (i = 0; i < LOG_MAX_RINGS; i++) {
+		owner = __atomic_load_n(&la->rings[i].owner, __ATOMIC_RELAXED);
+		if (owner && log_ring_orphaned(&la->rings[i], owner) &&
+		    log_ring_claim(&la->rings[i], owner, tid))
+			return my_ring;
 	}
 
-	/* ok, we can stage the msg in the area */
-	la->empty = 0;
-	msg = (struct logmsg *)la->tail;
-	msg->prio = prio;
-	memcpy((void *)&msg->str, buff, len);
-	lastmsg->next = la->tail;
-	msg->next = la->head;
-
-	logdbg(stderr, "enqueue: %p, %p, %i, %s\n", (void *)msg, msg->next,
-		msg->prio, (char *)&msg->str);
-
-#if LOGDBG
-	dump_logarea();
-#endif
-	return 0;
+	return NULL;
 }
 
-static int log_dequeue(void *buff)
+static int log_enqueue(int prio, const char *fmt, va_list ap)
 {
-	struct logmsg * src = (struct logmsg *)la->head;
-	struct logmsg * dst = (struct logmsg *)buff;
-	struct logmsg * lst = (struct logmsg *)la->tail;
+	char buff[LOG_REC_MAX];
+	struct logrec *rec = (struct logrec *)buff;
+	struct logrec *pad;
+	struct logring *ring;
+	uint64_t head, tail;
+	uint32_t pos, room, len;
+	int err = errno;
+	int ret;
+	va_list aq;
+
+	ring = log_ring_get();
+	if (!ring) {
+		__atomic_add_fetch(&la->dropped, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
 
-	if (la->empty)
+	/*
+	 * The logger is forked before the backing store modules are
+	 * loaded, so it can only read format strings of tgtd itself.
+	 */
+	if (fmt >= __executable_start && fmt < _end) {
+		va_copy(aq, ap);
+		ret = log_serialize(rec->args, sizeof(buff) - sizeof(*rec),
+				    fmt, &aq);
+		va_end(aq);
+	} else
+		ret = -1;
+
+	if (ret < 0) {
+		rec->fmt = NULL;
+		vsnprintf(rec->args, MAX_MSG_SIZE, fmt, ap);
+		ret = strlen(rec->args) + 1;
+	} else
+		rec->fmt = fmt;
+
+	rec->prio = prio;
+	rec->err = err;
+	rec->size = len = ALIGN8(sizeof(*rec) + ret);
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	pos = head & (la->ring_size - 1);
+	room = la->ring_size - pos;
+
+	/* records never wrap, pad the rest of the ring instead */
+	if (len > room)
+		len += room;
+
+	if (la->ring_size - (head - tail) < len) {
+		logdbg(stderr, "enqueue: log ring overrun, drop msg\n");
+		ring->dropped++;
 		return 1;
+	}
 
-	int len = strlen((char *)&src->str) * sizeof(char) +
-		  sizeof(struct logmsg) + 1;
+	if (len > rec->size) {
+		pad = (struct logrec *)(ring->buf + pos);
+		pad->size = room;
+		pad->prio = LOG_PAD;
+		head += room;
+		pos = 0;
+	}
 
-	dst->prio = src->prio;
-	memcpy(dst, src,  len);
+	memcpy(ring->buf + pos, rec, rec->size);
 
-	if (la->tail == la->head)
-		la->empty = 1; /* we purge the last logmsg */
-	else {
-		la->head = src->next;
-		lst->next = la->head;
-	}
-	logdbg(stderr, "dequeue: %p, %p, %i, %s\n",
-		(void *)src, src->next, src->prio, (char *)&src->str);
+	logdbg(stderr, "enqueue: %p, %i, %s\n", (void *)ring, prio, fmt);
 
-	memset((void *)src, 0,  len);
+	__atomic_store_n(&ring->head, head + rec->size, __ATOMIC_RELEASE);
 
-	return la->empty;
+	return 0;
 }
 
 /*
- * this one can block under memory pressure
+ * Drain one ring into syslog, returns the number of messages.
  */
-static void log_syslog (void * buff)
+static int log_dequeue(struct logring *ring)
 {
-	struct logmsg * msg = (struct logmsg *)buff;
+	char buff[MAX_MSG_SIZE];
+	struct logrec *rec;
+	uint64_t head, tail, dropped;
+	int prio, count = 0;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	tail = ring->tail;
+
+	while (tail != head) {
+		rec = (struct logrec *)(ring->buf + (tail & (la->ring_size - 1)));
+		prio = rec->prio;
+		if (prio != LOG_PAD)
+			log_format(rec, buff, sizeof(buff));
+		tail += rec->size;
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		if (prio == LOG_PAD)
+			continue;
+
+		logdbg(stderr, "dequeue: %p, %i, %s\n",
+		       (void *)ring, prio, buff);
+		syslog(prio, "%s", buff);
+		count++;
+	}
+
+	dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	if (dropped != ring->reported) {
+		syslog(LOG_WARNING, "%" PRIu64 " log messages dropped",
+		       dropped - ring->reported);
+		ring->reported = dropped;
+	}
 
-	syslog(msg->prio, "%s", (char *)&msg->str);
+	return count;
 }
 
 static void dolog(int prio, const char *fmt, va_list ap)
 {
-	struct timespec ts;
-	struct sembuf ops;
-
-	if (la) {
-		ts.tv_sec = 0;
-		ts.tv_nsec = 10000000;
-
-		ops.sem_num = 0;
-		ops.sem_flg = 0;
-		ops.sem_op = -1;
-		if (semtimedop(la->semid, &ops, 1, &ts) < 0) {
-			syslog(LOG_ERR, "semop up failed");
-			return;
-		}
-
+	if (la)
 		log_enqueue(prio, fmt, ap);
-
-		ops.sem_op = 1;
-		if (semop(la->semid, &ops, 1) < 0) {
-			syslog(LOG_ERR, "semop down failed");
-			return;
-		}
-	} else {
+	else {
 		fprintf(stderr, "%s: ", log_name);
 		vfprintf(stderr, fmt, ap);
 		fflush(stderr);
@@ -318,31 +697,25 @@ void log_debug(const char *fmt, ...)
 	va_end(ap);
 }
 
-static void log_flush(void)
+static int log_flush(void)
 {
-	struct sembuf ops;
+	uint64_t dropped;
+	int i, count = 0;
 
 	if (!la)
-		return;
-
-	while (!la->empty) {
-		ops.sem_num = 0;
-		ops.sem_flg = 0;
-		ops.sem_op = -1;
-		if (semop(la->semid, &ops, 1) < 0) {
-			syslog(LOG_ERR, "semop up failed");
-			exit(1);
-		}
+		return 0;
 
-		log_dequeue(la->buff);
+	for (i = 0; i < LOG_MAX_RINGS; i++)
+		count += log_dequeue(&la->rings[i]);
 
-		ops.sem_op = 1;
-		if (semop(la->semid, &ops, 1) < 0) {
-			syslog(LOG_ERR, "semop down failed");
-			exit(1);
-		}
-		log_syslog(la->buff);
+	dropped = __atomic_load_n(&la->dropped, __ATOMIC_RELAXED);
+	if (dropped != la->reported) {
+		syslog(LOG_WARNING, "%" PRIu64 " log messages dropped,"
+		       " no free log ring", dropped - la->reported);
+		la->reported = dropped;
 	}
+
+	return count;
 }
 
 static void log_sigsegv(void)
@@ -373,6 +746,9 @@ int log_init(char *program_name, int size, int daemon, int debug)
 			return 1;
 		}
 
+		pthread_key_create(&ring_key, log_ring_put);
+		pthread_atfork(NULL, NULL, log_ring_forget);
+
 		la->active = 1;
 		pid = fork();
 		if (pid < 0) {
@@ -394,9 +770,9 @@ int log_init(char *program_name, int size, int daemon, int debug)
 
 		prctl(PR_SET_PDEATHSIG, SIGSEGV);
 
-		while (la->active) {
-			log_flush();
-			sleep(1);
+		while (__atomic_load_n(&la->active, __ATOMIC_ACQUIRE)) {
+			if (!log_flush())
+				usleep(LOG_POLL_USEC);
 		}
 
 		exit(0);
@@ -408,7 +784,7 @@ int log_init(char *program_name, int size, int daemon, int debug)
 void log_close(void)
 {
 	if (la) {
-		la->active = 0;
+		__atomic_store_n(&la->active, 0, __ATOMIC_RELEASE);
 		waitpid(pid, NULL, 0);
 
 		log_warning("tgtd logger stopped, pid:%d\n", pid);
@@ -26,45 +26,60 @@
 #ifndef LOG_H
 #define LOG_H
 
-#include <sys/sem.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 #define likely(x)       __builtin_expect(!!(x), 1)
 #define unlikely(x)     __builtin_expect(!!(x), 0)
 
-union semun {
-	int val;
-	struct semid_ds *buf;
-	unsigned short int *array;
-	struct seminfo *__buf;
-};
-
 #define LOG_SPACE_SIZE 16384
 #define MAX_MSG_SIZE 256
+#define LOG_MAX_RINGS 128
+#define LOG_REC_MAX (MAX_MSG_SIZE * 2)
 
 extern int log_daemon;
 extern int log_level;
 
-struct logmsg {
-	short int prio;
-	void *next;
-	char *str;
+/*
+ * A log record as stored in a ring. The format string pointer doubles
+ * as the format id: the logger is forked from tgtd, so it stays valid
+ * there and the arguments are only formatted by the logger process.
+ * That holds for tgtd's own image only, messages of modules loaded
+ * later are formatted right away. A record with a NULL fmt carries an
+ * already formatted message.
+ */
+struct logrec {
+	uint32_t size;		/* whole record, 8-byte aligned */
+	int16_t prio;		/* LOG_PAD for ring padding */
+	int16_t err;		/* errno at enqueue time, for %m */
+	const char *fmt;
+	char args[0];
+};
+
+/*
+ * Single producer, single consumer ring. Each thread that logs owns
+ * one; head is only written by the owner and tail by the logger.
+ */
+struct logring {
+	pid_t owner;		/* tid of the producer, 0 if free */
+	uint64_t start;		/* start time of the producer */
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t dropped;
+	uint64_t tail __attribute__((aligned(64)));
+	uint64_t reported;
+	char *buf;
 };
 
 struct logarea {
-	int empty;
 	int active;
-	void *head;
-	void *tail;
-	void *start;
-	void *end;
-	char *buff;
-	int semid;
-	union semun semarg;
+	uint32_t ring_size;
+	uint64_t dropped;	/* no free ring for the calling thread */
+	uint64_t reported;
+	struct logring rings[LOG_MAX_RINGS];
 };
 
 extern int log_init(char *progname, int size, int daemon, int debug);
 extern void log_close(void);
-extern void dump_logmsg(void *);
 extern void log_warning(const char *fmt, ...)
 	__attribute__ ((format (printf, 1, 2)));
 extern void log_error(const char *fmt, ...)
@@ -0,0 +1,300 @@
+/*
+ * Versions of the master image
+ *
+ * The master image may be replaced while clients run from it: a new
+ * version is registered by updating the path of its logical unit. A
+ * client keeps reading the version its CoW image was cloned from, and
+ * moves to the newest one when it resets and map_new_fd() clones a new
+ * image. A version is released once it is no longer the newest and its
+ * last client has moved on.
+ *
+ * The table lives in shared memory, as the reset handler forked off
+ * tgtd has to see versions registered after it started. The descriptors
+ * of the versions are per process: each opens a version by its path the
+ * first time it needs it, and closes it once the version is released
+ * and none of its clients' images read from it anymore.
+ *
+ * A client's image can also be committed as a new version: its image
+ * is a reflink copy of its version with its writes on top, so the new
+ * master is a reflink copy of the whole image. The dirty map is not
+ * trusted for this, it starts over when tgtd restarts. No data is
+ * copied, so this takes seconds for any size.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/fs.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+
+#define MASTER_VERSIONS	16
+
+struct master_image {
+	char path[PATH_MAX];
+	unsigned int version;
+	/* clients cloned from it, plus one while it is the newest */
+	int refs;
+};
+
+struct master_table {
+	pthread_mutex_t lock;
+	int newest;			/* slot of the newest version */
+	unsigned int versions;		/* registered so far */
+	struct master_image img[MASTER_VERSIONS];
+	int8_t client[FD_LIMIT];	/* slot of each client, -1 if none */
+};
+
+static struct master_table *masters;
+/* this process's descriptors of the versions, 0 if not open here */
+static int master_fds[MASTER_VERSIONS];
+
+static int master_table_init(void)
+{
+	pthread_mutexattr_t attr;
+
+	masters = mmap(NULL, sizeof(*masters), PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (masters == MAP_FAILED) {
+		masters = NULL;
+		return -ENOMEM;
+	}
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&masters->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	masters->newest = -1;
+	memset(masters->client, -1, sizeof(masters->client));
+
+	return 0;
+}
+
+/* Whether the image of a client in this process still reads from fd */
+static bool master_fd_busy(int fd)
+{
+	int i;
+
+	for (i = 0; i < FD_LIMIT; i++)
+		if (fd_master_map[i] == fd)
+			return true;
+
+	return false;
+}
+
+/*
+ * Closes this process's descriptors of released versions, unless an
+ * image here still reads from one: a client reset by the forked handler
+ * releases its version while tgtd's fd_master_map points at it.
+ */
+static void master_close_released(void)
+{
+	int i;
+
+	for (i = 0; i < MASTER_VERSIONS; i++) {
+		if (masters->img[i].refs || !master_fds[i] ||
+		    master_fd_busy(master_fds[i]))
+			continue;
+		close(master_fds[i]);
+		master_fds[i] = 0;
+	}
+}
+
+/* Drops a reference, releasing the version with the last one. */
+static void master_put(int slot)
+{
+	struct master_image *img = &masters->img[slot];
+
+	if (--img->refs)
+		return;
+
+	printf("Released master image version %u: %s\n", img->version,
+	       img->path);
+	master_close_released();
+}
+
+/*
+ * Makes path the newest version of the master image. fd is duplicated,
+ * the caller keeps its own. Returns the version or a negative errno.
+ */
+int master_register(const char *path, int fd)
+{
+	struct master_image *img;
+	int i, slot = -1, old;
+
+	if (!masters && master_table_init())
+		return -ENOMEM;
+
+	if (strlen(path) >= PATH_MAX)
+		return -ENAMETOOLONG;
+
+	pthread_mutex_lock(&masters->lock);
+
+	/* some may have been released by another process */
+	master_close_released();
+	for (i = 0; i < MASTER_VERSIONS; i++) {
+		/* one still open here is in use, keep its slot */
+		if (!masters->img[i].refs && !master_fds[i]) {
+			slot = i;
+			break;
+		}
+	}
+
+	if (slot < 0) {
+		pthread_mutex_unlock(&masters->lock);
+		return -ENOSPC;
+	}
+
+	fd = dup(fd);
+	if (fd < 0) {
+		pthread_mutex_unlock(&masters->lock);
+		return -errno;
+	}
+
+	img = &masters->img[slot];
+	strcpy(img->path, path);
+	img->version = ++masters->versions;
+	img->refs = 1;
+	master_fds[slot] = fd;
+
+	old = masters->newest;
+	masters->newest = slot;
+	master_fd = fd;
+	if (old >= 0)
+		master_put(old);
+
+	pthread_mutex_unlock(&masters->lock);
+
+	printf("Registered master image version %u: %s\n", img->version, path);
+
+	return img->version;
+}
+
+/*
+ * Binds a client to the version its next image is cloned from, the
+ * newest one unless keep is set and the client already has one. Returns
+ * this process's descriptor of that version, or a negative errno.
+ */
+int master_bind(int addr, bool keep)
+{
+	int slot, old, fd;
+
+	pthread_mutex_lock(&masters->lock);
+
+	old = masters->client[addr];
+	slot = keep && old >= 0 ? old : masters->newest;
+	if (slot < 0) {
+		pthread_mutex_unlock(&masters->lock);
+		return -ENOENT;
+	}
+
+	fd = master_fds[slot];
+	if (!fd) {
+		fd = open(masters->img[slot].path, O_RDONLY);
+		if (fd < 0) {
+			fd = -errno;
+			pthread_mutex_unlock(&masters->lock);
+			return fd;
+		}
+		master_fds[slot] = fd;
+	}
+
+	if (slot != old) {
+		masters->img[slot].refs++;
+		masters->client[addr] = slot;
+		if (old >= 0)
+			master_put(old);
+		printf("Client %d uses master image version %u\n", addr,
+		       masters->img[slot].version);
+	}
+
+	pthread_mutex_unlock(&masters->lock);
+
+	return fd;
+}
+
+/* The newest version, with a descriptor of it to close, or -1 if none */
+int master_newest(unsigned int *version)
+{
+	int fd = -1;
+
+	if (!masters)
+		return -1;
+
+	pthread_mutex_lock(&masters->lock);
+	if (masters->newest >= 0 && master_fds[masters->newest]) {
+		fd = dup(master_fds[masters->newest]);
+		*version = masters->img[masters->newest].version;
+	}
+	pthread_mutex_unlock(&masters->lock);
+
+	return fd;
+}
+
+/* The version client addr is bound to, 0 if none */
+unsigned int master_version(int addr)
+{
+	unsigned int version = 0;
+
+	pthread_mutex_lock(&masters->lock);
+	if (masters->client[addr] >= 0)
+		version = masters->img[masters->client[addr]].version;
+	pthread_mutex_unlock(&masters->lock);
+
+	return version;
+}
+
+/*
+ * Writes the image of client addr, as the client sees it, to a new file
+ * at path, sharing all extents. Returns 0 or a negative errno.
+ */
+int master_commit(int addr, const char *path, uint64_t size)
+{
+	int dst, ret = 0;
+
+	if (addr < 0 || addr >= FD_LIMIT || !fd_map[addr])
+		return -ENOENT;
+
+	/* those keep the client's blocks outside of its image */
+	if (ram_overlay_enabled() || dedup_enabled())
+		return -EOPNOTSUPP;
+
+	if (wb_flush(addr, 0, 0))
+		return -EIO;
+
+	dst = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (dst < 0)
+		return -errno;
+
+	if (ioctl(dst, FICLONE, fd_map[addr]) || ftruncate(dst, size) ||
+	    fsync(dst))
+		ret = -errno;
+
+	close(dst);
+	if (ret)
+		unlink(path);
+	else
+		printf("Committed client %d to %s\n", addr, path);
+
+	return ret;
+}
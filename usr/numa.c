@@ -0,0 +1,147 @@
+/*
+ * NUMA placement of tgtd
+ *
+ * tgtd runs its protocol work on one event loop, so rather than being
+ * spread over the nodes of a multi-socket server it keeps to the node
+ * that receives the initiators' packets. Threads are pinned to that
+ * node's CPUs and memory is preferably taken from it, before anything
+ * big is allocated: the flag_map hugepage, the iSCSI data buffers and
+ * the page cache of the master image that the I/O threads fill then
+ * all stay local. Threads created later inherit both settings.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+
+#define NUMA_MAX_NODES	64
+
+static int numa_read_line(const char *path, char *buf, int len)
+{
+	FILE *fp;
+	char *p;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	p = fgets(buf, len, fp);
+	fclose(fp);
+	if (!p)
+		return -EINVAL;
+
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+/*
+ * Takes a node number or the name of a network interface, whose node
+ * is then used. Returns the node or -1.
+ */
+int numa_parse_node(const char *arg)
+{
+	char path[PATH_MAX], buf[16];
+	const char *p;
+	int node;
+
+	for (p = arg; isdigit(*p); p++)
+		;
+	if (*arg && !*p) {
+		node = atoi(arg);
+		return node < NUMA_MAX_NODES ? node : -1;
+	}
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node",
+		 arg);
+	if (numa_read_line(path, buf, sizeof(buf))) {
+		fprintf(stderr, "can't find the NUMA node of %s\n", arg);
+		return -1;
+	}
+
+	/* -1 on machines with a single node */
+	node = atoi(buf);
+	return node < 0 ? 0 : node;
+}
+
+/* Parses a cpulist like "0-7,16-23" into set */
+static int numa_parse_cpulist(char *list, cpu_set_t *set)
+{
+	char *tok, *save = NULL;
+	int from, to;
+
+	CPU_ZERO(set);
+	for (tok = strtok_r(list, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		switch (sscanf(tok, "%d-%d", &from, &to)) {
+		case 1:
+			to = from;
+			break;
+		case 2:
+			break;
+		default:
+			return -EINVAL;
+		}
+		for (; from <= to && from < CPU_SETSIZE; from++)
+			CPU_SET(from, set);
+	}
+
+	return CPU_COUNT(set) ? 0 : -EINVAL;
+}
+
+int numa_bind(int node)
+{
+	unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))];
+	char path[PATH_MAX], buf[4096];
+	cpu_set_t set;
+	int ret;
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/node/node%d/cpulist", node);
+	ret = numa_read_line(path, buf, sizeof(buf));
+	if (!ret)
+		ret = numa_parse_cpulist(buf, &set);
+	if (ret) {
+		fprintf(stderr, "can't read the CPUs of NUMA node %d\n", node);
+		return ret;
+	}
+
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+		fprintf(stderr, "can't pin to NUMA node %d, %m\n", node);
+		return -errno;
+	}
+
+	/* preferred rather than bound, running short falls back */
+	memset(mask, 0, sizeof(mask));
+	mask[node / (8 * sizeof(unsigned long))] |=
+		1UL << (node % (8 * sizeof(unsigned long)));
+	if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+		    NUMA_MAX_NODES + 1)) {
+		fprintf(stderr, "can't prefer memory of NUMA node %d, %m\n",
+			node);
+		return -errno;
+	}
+
+	printf("Bound to NUMA node %d, %d CPUs\n", node, CPU_COUNT(&set));
+	return 0;
+}
@@ -0,0 +1,377 @@
+/*
+ * Persistent reservation state of a logical unit, kept across restarts
+ *
+ * With a PR store set, by the pr_file LU parameter, tgtd reports that it
+ * can persist through power loss (PTPL_C), and initiators may register
+ * with APTPL. After every PERSISTENT RESERVE OUT that succeeded, the
+ * whole PR state of the LU is appended to the store as one line, and
+ * synced before the command completes. If that fails, the command fails
+ * and APTPL is cleared, as the state no longer persists. A line carries
+ * its own crc32c, so a line torn by a crash is simply not used, the one
+ * before it is.
+ *
+ * On opening the store, the last good line is restored, if it was saved
+ * with APTPL set, and the file is rewritten to hold just that line. It
+ * is rewritten the same way once it grows past PR_STORE_MAX. Restored
+ * registrations are known by the TransportID of their initiator port
+ * and bound to the first I_T nexus that shows up with it.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+#include "crc32c.h"
+#include "spc.h"
+#include "tgtadm_error.h"
+
+/* the store is compacted once it grows past this */
+#define PR_STORE_MAX	(1 * MB)
+
+struct pr_store {
+	int fd;
+	char *path;
+	off_t size;
+	uint32_t last_crc;	/* of the line last written */
+};
+
+/*
+ * The PR state of lu as one line:
+ * "pr <generation> <aptpl> <holder> <type> <scope> <nr>
+ *  [<key> <transportid>]... <crc>\n", the holder being the index of the
+ * registration holding the reservation or -1. Registrations without a
+ * TransportID can't be restored and are left out. Without APTPL only
+ * the generation is kept. Returns the length, the line is malloc()ed.
+ */
+static int pr_store_line(struct scsi_lu *lu, char **line, uint32_t *crc)
+{
+	struct registration *reg;
+	int i, nr = 0, holder = -1, len = 0, size;
+	char *buf;
+
+	size = 128;
+	list_for_each_entry(reg, &lu->registration_list,
+			    registration_siblings)
+		size += 24 + reg->tpid_len * 2;
+
+	buf = malloc(size);
+	if (!buf)
+		return -ENOMEM;
+
+	if (lu->pr_aptpl) {
+		list_for_each_entry(reg, &lu->registration_list,
+				    registration_siblings) {
+			if (!reg->tpid_len)
+				continue;
+			if (reg == lu->pr_holder)
+				holder = nr;
+			nr++;
+		}
+	}
+
+	len += sprintf(buf + len, "pr %u %d %d %u %u %d", lu->prgeneration,
+		       lu->pr_aptpl, holder,
+		       holder < 0 ? 0 : lu->pr_holder->pr_type,
+		       holder < 0 ? 0 : lu->pr_holder->pr_scope, nr);
+
+	if (nr) {
+		list_for_each_entry(reg, &lu->registration_list,
+				    registration_siblings) {
+			if (!reg->tpid_len)
+				continue;
+			len += sprintf(buf + len, " %" PRIx64 " ", reg->key);
+			for (i = 0; i < reg->tpid_len; i++)
+				len += sprintf(buf + len, "%02x",
+					       (uint8_t)reg->tpid[i]);
+		}
+	}
+
+	*crc = crc32c(0, buf, len);
+	len += sprintf(buf + len, " %08x\n", *crc);
+
+	*line = buf;
+	return len;
+}
+
+/* Parses a line, checked by its crc, into registrations on list */
+static int pr_store_parse(char *line, struct list_head *list,
+			  uint32_t *generation, int *aptpl, int *holder,
+			  uint8_t *type, uint8_t *scope)
+{
+	struct registration *reg;
+	char *p, *save = NULL, *tok;
+	long v[6];
+	uint32_t crc;
+	int i, len;
+
+	p = strrchr(line, ' ');
+	if (!p || sscanf(p + 1, "%x", &crc) != 1 ||
+	    crc32c(0, line, p - line) != crc)
+		return -EINVAL;
+	*p = '\0';
+
+	tok = strtok_r(line, " ", &save);
+	if (!tok || strcmp(tok, "pr"))
+		return -EINVAL;
+
+	for (i = 0; i < ARRAY_SIZE(v); i++) {
+		tok = strtok_r(NULL, " ", &save);
+		if (!tok)
+			return -EINVAL;
+		v[i] = strtol(tok, NULL, 10);
+	}
+	*generation = v[0];
+	*aptpl = v[1];
+	*holder = v[2];
+	*type = v[3];
+	*scope = v[4];
+
+	for (i = 0; i < v[5]; i++) {
+		reg = zalloc(sizeof(*reg));
+		if (!reg)
+			return -ENOMEM;
+		list_add_tail(&reg->registration_siblings, list);
+
+		tok = strtok_r(NULL, " ", &save);
+		if (!tok || sscanf(tok, "%" SCNx64, &reg->key) != 1)
+			return -EINVAL;
+
+		tok = strtok_r(NULL, " ", &save);
+		len = tok ? strlen(tok) : 0;
+		if (!len || len % 2 || len / 2 > PR_TPID_LEN)
+			return -EINVAL;
+		for (reg->tpid_len = 0; reg->tpid_len < len / 2;
+		     reg->tpid_len++)
+			if (sscanf(tok + reg->tpid_len * 2, "%2hhx",
+				   (uint8_t *)&reg->tpid[reg->tpid_len]) != 1)
+				return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Restores the last good line of the store, if saved with APTPL */
+static void pr_store_load(struct scsi_lu *lu, int fd)
+{
+	struct registration *reg, *next;
+	struct list_head list;
+	uint32_t generation;
+	uint8_t type, scope;
+	int aptpl, holder, i;
+	char *buf, *line, *end;
+	struct stat st;
+	ssize_t ret;
+
+	if (fstat(fd, &st) || !st.st_size)
+		return;
+
+	buf = malloc(st.st_size);
+	if (!buf)
+		return;
+	ret = pread(fd, buf, st.st_size, 0);
+	end = buf + (ret < 0 ? 0 : ret);
+
+	/* complete lines only, from the last one back */
+	while (end > buf && end[-1] != '\n')
+		end--;
+
+	INIT_LIST_HEAD(&list);
+	while (end > buf) {
+		end[-1] = '\0';
+		line = memrchr(buf, '\n', end - 1 - buf);
+		line = line ? line + 1 : buf;
+
+		if (!pr_store_parse(line, &list, &generation, &aptpl, &holder,
+				    &type, &scope))
+			goto found;
+
+		list_for_each_entry_safe(reg, next, &list,
+					 registration_siblings) {
+			list_del(&reg->registration_siblings);
+			free(reg);
+		}
+		end = line;
+	}
+
+	eprintf("no usable PR state in %s\n", lu->pr_store->path);
+	free(buf);
+	return;
+found:
+	free(buf);
+
+	lu->prgeneration = generation;
+	lu->pr_aptpl = aptpl;
+
+	i = 0;
+	list_for_each_entry_safe(reg, next, &list, registration_siblings) {
+		list_del(&reg->registration_siblings);
+		if (!aptpl) {
+			free(reg);
+			continue;
+		}
+		if (i++ == holder) {
+			reg->pr_type = type;
+			reg->pr_scope = scope;
+			lu->pr_holder = reg;
+		}
+		pr_link(lu, reg);
+	}
+
+	eprintf("restored %d PR registrations from %s\n", i,
+		lu->pr_store->path);
+}
+
+/* Replaces the store with just the current state */
+static int pr_store_compact(struct scsi_lu *lu)
+{
+	struct pr_store *ps = lu->pr_store;
+	char tmp[PATH_MAX], *line;
+	int fd, len, ret = 0;
+	uint32_t crc;
+
+	len = pr_store_line(lu, &line, &crc);
+	if (len < 0)
+		return len;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", ps->path);
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+	if (fd < 0) {
+		free(line);
+		return -errno;
+	}
+
+	errno = 0;
+	if (write(fd, line, len) != len || fdatasync(fd) ||
+	    rename(tmp, ps->path))
+		ret = errno ? -errno : -EIO;
+	free(line);
+
+	if (ret) {
+		close(fd);
+		unlink(tmp);
+		return ret;
+	}
+
+	if (ps->fd >= 0)
+		close(ps->fd);
+	ps->fd = fd;
+	ps->size = len;
+	ps->last_crc = crc;
+
+	return 0;
+}
+
+tgtadm_err pr_store_open(struct scsi_lu *lu, const char *path)
+{
+	struct pr_store *ps;
+	int fd, ret;
+
+	if (lu->pr_store && !strcmp(lu->pr_store->path, path))
+		return TGTADM_SUCCESS;
+	pr_store_close(lu);
+
+	fd = open(path, O_RDONLY | O_CREAT, 0600);
+	if (fd < 0) {
+		eprintf("can't open PR store %s, %m\n", path);
+		return TGTADM_INVALID_REQUEST;
+	}
+
+	ps = zalloc(sizeof(*ps));
+	if (!ps || !(ps->path = strdup(path))) {
+		free(ps);
+		close(fd);
+		return TGTADM_NOMEM;
+	}
+	ps->fd = -1;
+	lu->pr_store = ps;
+
+	/* the state of a LU already in use stays as it is */
+	if (list_empty(&lu->registration_list))
+		pr_store_load(lu, fd);
+	close(fd);
+
+	ret = pr_store_compact(lu);
+	if (ret) {
+		eprintf("can't write PR store %s, %s\n", path, strerror(-ret));
+		pr_store_close(lu);
+		return TGTADM_UNKNOWN_ERR;
+	}
+
+	return TGTADM_SUCCESS;
+}
+
+/*
+ * Appends the PR state of lu, if it changed. Returns 0 or a negative
+ * errno.
+ */
+int pr_store_save(struct scsi_lu *lu)
+{
+	struct pr_store *ps = lu->pr_store;
+	uint32_t crc;
+	char *line;
+	int len, ret;
+
+	if (!ps)
+		return 0;
+
+	len = pr_store_line(lu, &line, &crc);
+	if (len < 0) {
+		eprintf("failed to save PR state to %s\n", ps->path);
+		return len;
+	}
+	if (crc == ps->last_crc) {
+		free(line);
+		return 0;
+	}
+
+	if (ps->size + len > PR_STORE_MAX) {
+		free(line);
+		ret = pr_store_compact(lu);
+	} else {
+		ret = write(ps->fd, line, len) == len && !fdatasync(ps->fd) ?
+			0 : -EIO;
+		free(line);
+		if (!ret) {
+			ps->size += len;
+			ps->last_crc = crc;
+		}
+	}
+
+	if (ret)
+		eprintf("failed to save PR state to %s\n", ps->path);
+
+	return ret;
+}
+
+void pr_store_close(struct scsi_lu *lu)
+{
+	struct pr_store *ps = lu->pr_store;
+
+	if (!ps)
+		return;
+
+	if (ps->fd >= 0)
+		close(ps->fd);
+	free(ps->path);
+	free(ps);
+	lu->pr_store = NULL;
+}
@@ -0,0 +1,319 @@
+/*
+ * Per-client fair queueing in front of the bs_thread workers
+ *
+ * Without it all clients of a logical unit share one FIFO, and a client
+ * running a benchmark or a big update starves everyone else's boot I/O.
+ * Here each client (subnet address) gets its own queue, and workers pick
+ * from the queues by deficit round robin. A command costs its transfer
+ * length plus QOS_CMD_COST, so small and large I/O are weighed alike.
+ *
+ * Optionally each client is held to an IOPS and a bandwidth cap, kept as
+ * token buckets. Also optional: for a while after a client's first
+ * command following a reset, its reads go before everything else, which
+ * is what a booting client waits on.
+ *
+ * Everything here runs under the pending_lock of the bs_thread_info.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+#include "bs_thread.h"
+
+#define NSEC_PER_SEC		1000000000ULL
+
+/* bytes a client may send per round */
+#define QOS_QUANTUM		(256 * KB)
+/* what a command costs on top of its data */
+#define QOS_CMD_COST		(4 * KB)
+/* how far a capped client may run ahead, in ns of its rate */
+#define QOS_BURST		((int64_t)NSEC_PER_SEC / 10)
+
+struct qos_client {
+	/* queued commands, linked by bs_list */
+	struct list_head queue;
+	unsigned int nr_reads;
+
+	/* on sched->active while the queue isn't empty */
+	struct list_head active;
+	int64_t deficit;
+
+	/* reset_gen[] of the boot this client is in */
+	unsigned int gen;
+	int seen;
+	uint64_t boot_end;
+
+	/* token buckets, in ns of the cap's rate */
+	int64_t iops_credit;
+	int64_t bw_credit;
+	uint64_t refilled;
+};
+
+struct qos_sched {
+	struct qos_conf conf;
+	struct list_head active;
+	int nr_active;
+	struct qos_client *clients[FD_LIMIT];
+};
+
+static uint64_t qos_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static int qos_is_read(struct scsi_cmd *cmd)
+{
+	return scsi_get_data_dir(cmd) == DATA_READ;
+}
+
+static uint64_t qos_cmd_bytes(struct scsi_cmd *cmd)
+{
+	return (uint64_t)scsi_get_in_length(cmd) + scsi_get_out_length(cmd);
+}
+
+static struct qos_client *qos_client(struct qos_sched *q, int addr)
+{
+	struct qos_client *c;
+
+	c = q->clients[addr];
+	if (c)
+		return c;
+
+	c = zalloc(sizeof(*c));
+	if (!c)
+		return NULL;
+
+	INIT_LIST_HEAD(&c->queue);
+	INIT_LIST_HEAD(&c->active);
+	c->iops_credit = QOS_BURST;
+	c->bw_credit = QOS_BURST;
+	c->refilled = qos_now();
+	q->clients[addr] = c;
+
+	return c;
+}
+
+struct qos_sched *qos_init(struct qos_conf *conf)
+{
+	struct qos_sched *q;
+
+	q = zalloc(sizeof(*q));
+	if (!q)
+		return NULL;
+
+	q->conf = *conf;
+	INIT_LIST_HEAD(&q->active);
+
+	return q;
+}
+
+void qos_exit(struct qos_sched *q)
+{
+	int i;
+
+	if (!q)
+		return;
+
+	for (i = 0; i < FD_LIMIT; i++)
+		free(q->clients[i]);
+	free(q);
+}
+
+/* Returns -ENOMEM if the command has to go around the scheduler. */
+int qos_enqueue(struct qos_sched *q, struct scsi_cmd *cmd)
+{
+	int addr = cmd->subnet_addr;
+	struct qos_client *c;
+	unsigned int gen;
+
+	if (addr < 0 || addr >= FD_LIMIT)
+		addr = 0;
+
+	c = qos_client(q, addr);
+	if (!c)
+		return -ENOMEM;
+
+	if (q->conf.boot_secs && reset_gen) {
+		gen = __atomic_load_n(&reset_gen[addr],
+				      __ATOMIC_ACQUIRE);
+		if (!c->seen || c->gen != gen) {
+			c->seen = 1;
+			c->gen = gen;
+			c->boot_end = qos_now() +
+				q->conf.boot_secs * NSEC_PER_SEC;
+		}
+	}
+
+	if (list_empty(&c->queue)) {
+		list_add_tail(&c->active, &q->active);
+		q->nr_active++;
+	}
+	list_add_tail(&cmd->bs_list, &c->queue);
+	if (qos_is_read(cmd))
+		c->nr_reads++;
+
+	return 0;
+}
+
+/*
+ * Refills the buckets of c and returns how long it has to wait before
+ * it may send again, 0 if it may send now.
+ */
+static uint64_t qos_throttled(struct qos_sched *q, struct qos_client *c,
+			      uint64_t now)
+{
+	int64_t elapsed = now - c->refilled, debt = 0;
+
+	c->refilled = now;
+
+	if (q->conf.iops) {
+		c->iops_credit += elapsed;
+		if (c->iops_credit > QOS_BURST)
+			c->iops_credit = QOS_BURST;
+		if (c->iops_credit <= 0)
+			debt = 1 - c->iops_credit;
+	}
+
+	if (q->conf.bw_mb) {
+		c->bw_credit += elapsed;
+		if (c->bw_credit > QOS_BURST)
+			c->bw_credit = QOS_BURST;
+		if (c->bw_credit <= 0 && 1 - c->bw_credit > debt)
+			debt = 1 - c->bw_credit;
+	}
+
+	return debt;
+}
+
+static void qos_charge(struct qos_sched *q, struct qos_client *c,
+		       struct scsi_cmd *cmd)
+{
+	if (q->conf.iops)
+		c->iops_credit -= NSEC_PER_SEC / q->conf.iops;
+	if (q->conf.bw_mb)
+		c->bw_credit -= qos_cmd_bytes(cmd) * NSEC_PER_SEC /
+			((uint64_t)q->conf.bw_mb * MB);
+}
+
+static struct scsi_cmd *qos_first_read(struct qos_client *c)
+{
+	struct scsi_cmd *cmd;
+
+	list_for_each_entry(cmd, &c->queue, bs_list) {
+		if (qos_is_read(cmd))
+			return cmd;
+	}
+
+	return NULL;
+}
+
+/*
+ * One deficit round robin pick over the active clients, of reads of
+ * booting clients only if boot is set. Returns NULL if no client may
+ * send, with *wait lowered to when the first capped one may again.
+ */
+static struct scsi_cmd *qos_pick(struct qos_sched *q, uint64_t now, int boot,
+				 uint64_t *wait)
+{
+	struct qos_client *c;
+	struct scsi_cmd *cmd;
+	int64_t cost;
+	uint64_t debt;
+	int i, eligible;
+
+	do {
+		eligible = 0;
+
+		for (i = 0; i < q->nr_active; i++) {
+			c = list_first_entry(&q->active, struct qos_client,
+					     active);
+
+			if (boot) {
+				cmd = NULL;
+				if (c->nr_reads && now < c->boot_end)
+					cmd = qos_first_read(c);
+			} else
+				cmd = list_first_entry(&c->queue,
+						       struct scsi_cmd,
+						       bs_list);
+			if (!cmd)
+				goto next;
+
+			debt = qos_throttled(q, c, now);
+			if (debt) {
+				if (!*wait || debt < *wait)
+					*wait = debt;
+				goto next;
+			}
+
+			eligible = 1;
+			cost = qos_cmd_bytes(cmd) + QOS_CMD_COST;
+			if (c->deficit < cost) {
+				c->deficit += QOS_QUANTUM;
+				goto next;
+			}
+
+			c->deficit -= cost;
+			qos_charge(q, c, cmd);
+
+			list_del(&cmd->bs_list);
+			if (qos_is_read(cmd))
+				c->nr_reads--;
+			if (list_empty(&c->queue)) {
+				c->deficit = 0;
+				list_del_init(&c->active);
+				q->nr_active--;
+			}
+			return cmd;
+next:
+			list_del(&c->active);
+			list_add_tail(&c->active, &q->active);
+		}
+	} while (eligible);
+
+	return NULL;
+}
+
+/*
+ * Next command for a worker, NULL if none may go now. Then *wait is
+ * how many ns until a capped client may send again, or 0 if nothing
+ * is queued.
+ */
+struct scsi_cmd *qos_dequeue(struct qos_sched *q, uint64_t *wait)
+{
+	struct scsi_cmd *cmd = NULL;
+	uint64_t now;
+
+	*wait = 0;
+	if (!q->nr_active)
+		return NULL;
+
+	now = qos_now();
+	if (q->conf.boot_secs)
+		cmd = qos_pick(q, now, 1, wait);
+	if (!cmd)
+		cmd = qos_pick(q, now, 0, wait);
+	if (cmd)
+		*wait = 0;
+
+	return cmd;
+}
@@ -0,0 +1,512 @@
+/*
+ * RAM-backed CoW overlays for stateless clients
+ *
+ * Blocks a client writes are kept in memory instead of its on-disk
+ * "<master>_NNN" image, up to a per-client cap. Once the cap is hit,
+ * further new blocks spill to the on-disk image as usual. Blocks that
+ * are not in memory are read through the regular flag_map routing.
+ *
+ * Memory comes from hugepages carved into chunks of RAM_CHUNK_BLOCKS
+ * blocks. A client reset returns all of its chunks at once.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hugetlbfs.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+
+#define RAM_CHUNK_BLOCKS	512
+#define RAM_CHUNK_SIZE		(RAM_CHUNK_BLOCKS * BLK_SIZE)
+
+#define RAM_SLOT_EMPTY		0
+#define RAM_SLOT_DELETED	UINT32_MAX
+
+struct ram_chunk {
+	struct list_head list;
+	char *data;
+};
+
+struct ram_slot {
+	uint32_t key;		/* block number + 1 */
+	uint32_t idx;		/* chunk << 9 | block in chunk */
+};
+
+struct ram_client {
+	pthread_rwlock_t lock;
+	unsigned int gen;	/* reset_gen[] this store belongs to */
+
+	struct ram_slot *table;
+	uint32_t table_mask;
+	uint32_t table_used;	/* slots not empty, deleted ones included */
+	uint32_t nr_blocks;	/* blocks handed out from chunks */
+
+	struct ram_chunk **chunks;
+	uint32_t nr_chunks;
+
+	uint32_t *free_idx;	/* blocks given back by UNMAP */
+	uint32_t nr_free;
+};
+
+/* per-client cap in blocks, 0 if RAM overlays are disabled */
+static uint32_t ram_cap;
+static struct ram_client *ram_clients[FD_LIMIT];
+static pthread_mutex_t ram_clients_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* chunks not owned by any client */
+static LIST_HEAD(ram_free_chunks);
+static pthread_mutex_t ram_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ram_chunk *ram_chunk_get(void)
+{
+	struct ram_chunk *chunks, *c;
+	long hugepage;
+	char *mem;
+	int i, nr;
+
+	pthread_mutex_lock(&ram_pool_lock);
+
+	if (list_empty(&ram_free_chunks)) {
+		hugepage = gethugepagesize();
+		if (hugepage < RAM_CHUNK_SIZE)
+			hugepage = RAM_CHUNK_SIZE;
+
+		nr = hugepage / RAM_CHUNK_SIZE;
+		chunks = calloc(nr, sizeof(*chunks));
+		mem = get_huge_pages(hugepage, GHP_DEFAULT);
+		if (!chunks || !mem) {
+			eprintf("failed to grow RAM overlay pool\n");
+			free(chunks);
+			pthread_mutex_unlock(&ram_pool_lock);
+			return NULL;
+		}
+
+		for (i = 0; i < nr; i++) {
+			chunks[i].data = mem + (size_t)i * RAM_CHUNK_SIZE;
+			list_add_tail(&chunks[i].list, &ram_free_chunks);
+		}
+	}
+
+	c = list_first_entry(&ram_free_chunks, struct ram_chunk, list);
+	list_del(&c->list);
+
+	pthread_mutex_unlock(&ram_pool_lock);
+
+	return c;
+}
+
+static inline char *ram_block(struct ram_client *rc, uint32_t idx)
+{
+	return rc->chunks[idx / RAM_CHUNK_BLOCKS]->data +
+		(size_t)(idx % RAM_CHUNK_BLOCKS) * BLK_SIZE;
+}
+
+static struct ram_slot *ram_lookup(struct ram_client *rc, uint32_t blk)
+{
+	uint32_t key = blk + 1, i, n;
+	struct ram_slot *slot;
+
+	if (!rc->table)
+		return NULL;
+
+	for (i = (key * 2654435761U) & rc->table_mask, n = 0;
+	     n <= rc->table_mask; i = (i + 1) & rc->table_mask, n++) {
+		slot = &rc->table[i];
+		if (slot->key == key)
+			return slot;
+		if (slot->key == RAM_SLOT_EMPTY)
+			return NULL;
+	}
+
+	return NULL;
+}
+
+/*
+ * Rebuilds the table without deleted slots. It has room for twice the
+ * cap, so that always leaves at least half of it empty.
+ */
+static int ram_rehash(struct ram_client *rc)
+{
+	struct ram_slot *old = rc->table, *table;
+	uint32_t i, j, live = 0;
+
+	table = calloc(rc->table_mask + 1, sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+
+	for (i = 0; i <= rc->table_mask; i++) {
+		if (old[i].key == RAM_SLOT_EMPTY ||
+		    old[i].key == RAM_SLOT_DELETED)
+			continue;
+		for (j = (old[i].key * 2654435761U) & rc->table_mask;
+		     table[j].key != RAM_SLOT_EMPTY;
+		     j = (j + 1) & rc->table_mask)
+			;
+		table[j] = old[i];
+		live++;
+	}
+
+	free(old);
+	rc->table = table;
+	rc->table_used = live;
+
+	return 0;
+}
+
+/* called with rc->lock held for writing */
+static char *ram_alloc(struct ram_client *rc, uint32_t blk)
+{
+	uint32_t key = blk + 1, i, n, idx;
+	struct ram_slot *slot = NULL, *s;
+	struct ram_chunk *c;
+
+	if (!rc->table) {
+		/* twice the cap keeps probe sequences short */
+		for (i = 1; i < ram_cap * 2; i <<= 1)
+			;
+		rc->table = calloc(i, sizeof(*rc->table));
+		rc->chunks = calloc(DIV_ROUND_UP(ram_cap, RAM_CHUNK_BLOCKS),
+				    sizeof(*rc->chunks));
+		rc->free_idx = malloc(ram_cap * sizeof(*rc->free_idx));
+		if (!rc->table || !rc->chunks || !rc->free_idx) {
+			free(rc->table);
+			free(rc->chunks);
+			free(rc->free_idx);
+			rc->table = NULL;
+			rc->chunks = NULL;
+			rc->free_idx = NULL;
+			return NULL;
+		}
+		rc->table_mask = i - 1;
+		rc->table_used = 0;
+	}
+
+	/* purge deleted slots so probe sequences still end in an empty one */
+	if (rc->table_used + 1 > (rc->table_mask + 1) / 2 &&
+	    rc->table_used > rc->nr_blocks - rc->nr_free && ram_rehash(rc))
+		return NULL;
+
+	if (rc->nr_free)
+		idx = rc->free_idx[--rc->nr_free];
+	else {
+		if (rc->nr_blocks == ram_cap)
+			return NULL;
+
+		if (rc->nr_blocks == rc->nr_chunks * RAM_CHUNK_BLOCKS) {
+			c = ram_chunk_get();
+			if (!c)
+				return NULL;
+			rc->chunks[rc->nr_chunks++] = c;
+		}
+		idx = rc->nr_blocks++;
+	}
+
+	for (i = (key * 2654435761U) & rc->table_mask, n = 0;
+	     n <= rc->table_mask; i = (i + 1) & rc->table_mask, n++) {
+		s = &rc->table[i];
+		if (s->key == RAM_SLOT_DELETED && !slot)
+			slot = s;
+		if (s->key == RAM_SLOT_EMPTY) {
+			if (!slot) {
+				slot = s;
+				rc->table_used++;
+			}
+			break;
+		}
+	}
+
+	if (!slot) {
+		rc->free_idx[rc->nr_free++] = idx;
+		return NULL;
+	}
+
+	slot->key = key;
+	slot->idx = idx;
+
+	return ram_block(rc, idx);
+}
+
+/* called with rc->lock held for writing */
+static void ram_alloc_undo(struct ram_client *rc, uint32_t blk)
+{
+	struct ram_slot *slot = ram_lookup(rc, blk);
+
+	if (!slot)
+		return;
+
+	rc->free_idx[rc->nr_free++] = slot->idx;
+	slot->key = RAM_SLOT_DELETED;
+}
+
+/* called with rc->lock held for writing */
+static void ram_drop(struct ram_client *rc)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&ram_pool_lock);
+	for (i = 0; i < rc->nr_chunks; i++)
+		list_add(&rc->chunks[i]->list, &ram_free_chunks);
+	pthread_mutex_unlock(&ram_pool_lock);
+
+	free(rc->table);
+	free(rc->chunks);
+	free(rc->free_idx);
+	rc->table = NULL;
+	rc->chunks = NULL;
+	rc->free_idx = NULL;
+	rc->nr_chunks = 0;
+	rc->nr_blocks = 0;
+	rc->nr_free = 0;
+	rc->table_used = 0;
+}
+
+static struct ram_client *ram_client_get(int addr, int create)
+{
+	struct ram_client *rc;
+
+	if (addr < 0 || addr >= FD_LIMIT)
+		return NULL;
+
+	rc = __atomic_load_n(&ram_clients[addr], __ATOMIC_ACQUIRE);
+	if (rc || !create)
+		return rc;
+
+	pthread_mutex_lock(&ram_clients_lock);
+	rc = ram_clients[addr];
+	if (!rc) {
+		rc = zalloc(sizeof(*rc));
+		if (rc) {
+			pthread_rwlock_init(&rc->lock, NULL);
+			rc->gen = reset_gen[addr];
+			__atomic_store_n(&ram_clients[addr], rc,
+					 __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&ram_clients_lock);
+
+	return rc;
+}
+
+/*
+ * Take the client's lock, throwing its blocks away first if the
+ * client was reset since they were written.
+ */
+static void ram_lock(struct ram_client *rc, int addr, int write)
+{
+	unsigned int gen = __atomic_load_n(&reset_gen[addr], __ATOMIC_ACQUIRE);
+
+	if (rc->gen != gen) {
+		pthread_rwlock_wrlock(&rc->lock);
+		if (rc->gen != gen) {
+			ram_drop(rc);
+			rc->gen = gen;
+		}
+		pthread_rwlock_unlock(&rc->lock);
+	}
+
+	if (write)
+		pthread_rwlock_wrlock(&rc->lock);
+	else
+		pthread_rwlock_rdlock(&rc->lock);
+}
+
+int ram_overlay_enabled(void)
+{
+	return ram_cap != 0;
+}
+
+/*
+ * Read from a client's image, taking blocks held in memory from there
+ * and the rest from disk. Returns the number of bytes read or -1.
+ */
+ssize_t ram_read(int addr, int fd, char *buf, size_t length, uint64_t offset)
+{
+	struct ram_client *rc = ram_client_get(addr, 0);
+	struct ram_slot *slot;
+	uint64_t pos = offset, end = offset + length, run = offset;
+	uint32_t in, n;
+	ssize_t ret;
+
+	if (!rc || !rc->table)
+		return bs_rdwr_pread(fd, buf, length, offset);
+
+	ram_lock(rc, addr, 0);
+
+	while (pos < end) {
+		in = pos % BLK_SIZE;
+		n = min_t(uint64_t, BLK_SIZE - in, end - pos);
+
+		slot = ram_lookup(rc, pos / BLK_SIZE);
+		if (slot) {
+			/* read the disk run in front of this block first */
+			if (run < pos) {
+				ret = bs_rdwr_pread(fd, buf + (run - offset),
+						    pos - run, run);
+				if (ret != pos - run)
+					goto err;
+			}
+			memcpy(buf + (pos - offset),
+			       ram_block(rc, slot->idx) + in, n);
+			run = pos + n;
+		}
+		pos += n;
+	}
+
+	if (run < end) {
+		ret = bs_rdwr_pread(fd, buf + (run - offset), end - run, run);
+		if (ret != end - run)
+			goto err;
+	}
+
+	pthread_rwlock_unlock(&rc->lock);
+	return length;
+err:
+	pthread_rwlock_unlock(&rc->lock);
+	return -1;
+}
+
+/*
+ * Write to a client's image. Blocks already in memory or that still
+ * fit under the cap are kept in memory, the rest goes to disk.
+ * Returns the number of bytes written or -1.
+ */
+ssize_t ram_write(int addr, int fd, const char *buf, size_t length,
+		  uint64_t offset)
+{
+	struct ram_client *rc = ram_client_get(addr, 1);
+	struct ram_slot *slot;
+	uint64_t pos = offset, end = offset + length, run = offset;
+	uint32_t in, n;
+	char *blk;
+	ssize_t ret;
+
+	if (!rc)
+		return bs_rdwr_pwrite(fd, buf, length, offset);
+
+	ram_lock(rc, addr, 1);
+
+	while (pos < end) {
+		in = pos % BLK_SIZE;
+		n = min_t(uint64_t, BLK_SIZE - in, end - pos);
+
+		slot = ram_lookup(rc, pos / BLK_SIZE);
+		if (slot)
+			blk = ram_block(rc, slot->idx);
+		else {
+			blk = ram_alloc(rc, pos / BLK_SIZE);
+			/* a partial block starts out with the old data */
+			if (blk && n != BLK_SIZE &&
+			    bs_rdwr_pread(fd, blk, BLK_SIZE,
+					  pos - in) != BLK_SIZE) {
+				ram_alloc_undo(rc, pos / BLK_SIZE);
+				goto err;
+			}
+		}
+
+		if (blk) {
+			if (run < pos) {
+				ret = bs_rdwr_pwrite(fd, buf + (run - offset),
+						     pos - run, run);
+				if (ret != pos - run)
+					goto err;
+			}
+			memcpy(blk + in, buf + (pos - offset), n);
+			run = pos + n;
+		}
+		pos += n;
+	}
+
+	if (run < end) {
+		ret = bs_rdwr_pwrite(fd, buf + (run - offset), end - run, run);
+		if (ret != end - run)
+			goto err;
+	}
+
+	pthread_rwlock_unlock(&rc->lock);
+	return length;
+err:
+	pthread_rwlock_unlock(&rc->lock);
+	return -1;
+}
+
+/*
+ * Forget blocks fully inside an unmapped range so that they read from
+ * the image again, and zero the unmapped part of the others like a
+ * punched hole would be.
+ */
+void ram_unmap(int addr, uint64_t offset, uint64_t length)
+{
+	struct ram_client *rc = ram_client_get(addr, 0);
+	struct ram_slot *slot;
+	uint64_t pos = offset, end = offset + length;
+	uint32_t in, n;
+
+	if (!rc || !rc->table)
+		return;
+
+	ram_lock(rc, addr, 1);
+
+	while (pos < end && rc->table) {
+		in = pos % BLK_SIZE;
+		n = min_t(uint64_t, BLK_SIZE - in, end - pos);
+
+		if (n == BLK_SIZE)
+			ram_alloc_undo(rc, pos / BLK_SIZE);
+		else {
+			slot = ram_lookup(rc, pos / BLK_SIZE);
+			if (slot)
+				memset(ram_block(rc, slot->idx) + in, 0, n);
+		}
+		pos += n;
+	}
+
+	pthread_rwlock_unlock(&rc->lock);
+}
+
+int ram_overlay_init(uint32_t cap_mb)
+{
+	if (!cap_mb)
+		return 0;
+
+	ram_cap = (uint64_t)cap_mb * MB / BLK_SIZE;
+	eprintf("RAM overlays enabled, %u MiB per client\n", cap_mb);
+
+	return 0;
+}
+
+/* The last LU is gone, give the blocks of all clients back to the pool */
+void ram_overlay_exit(void)
+{
+	struct ram_client *rc;
+	int i;
+
+	if (!ram_cap)
+		return;
+
+	for (i = 0; i < FD_LIMIT; i++) {
+		rc = ram_clients[i];
+		if (!rc)
+			continue;
+		ram_drop(rc);
+		pthread_rwlock_destroy(&rc->lock);
+		free(rc);
+		ram_clients[i] = NULL;
+	}
+	ram_cap = 0;
+}
@@ -0,0 +1,346 @@
+/*
+ * Read-ahead on the master image for booting clients
+ *
+ * All clients read the master image through one descriptor, so the
+ * kernel's per-file read-ahead state sees hundreds of interleaved
+ * streams and gives up. Instead each client gets a few stream slots
+ * here. A read that continues one of them grows its window, and the
+ * blocks ahead of the stream are handed to a prefetch thread which
+ * issues POSIX_FADV_WILLNEED on the master image. The kernel's own
+ * read-ahead on the master image is turned off, as it only misfires.
+ *
+ * Optionally, when a client starts booting, that is on its first read
+ * after a reset, the prefetch thread also walks the hotmap recorded by
+ * earlier runs and loads every block read at least a given number of
+ * times. The page cache is shared, so this mostly pays off for the
+ * first clients of a boot storm.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+
+#define RA_STREAMS	4
+/* how far a read may land from where its stream ended */
+#define RA_SLACK	(256 * KB)
+#define RA_MIN_WINDOW	(128 * KB)
+/* prefetch requests waiting for the thread, more are dropped */
+#define RA_QUEUE	256
+/* hotmap blocks closer than this are loaded in one go */
+#define RA_HOT_GAP	16
+/* a hotmap walk is done at most this often */
+#define RA_SEED_SECS	60
+
+struct ra_stream {
+	uint64_t next;		/* where the stream's last read ended */
+	uint64_t ahead;		/* prefetched up to here */
+	uint32_t window;
+	uint32_t hits;
+	uint64_t used;		/* for replacing the oldest stream */
+};
+
+struct ra_client {
+	pthread_mutex_t lock;
+	unsigned int gen;	/* reset_gen[] of the boot last seen */
+	int seen;
+	uint64_t tick;
+	struct ra_stream s[RA_STREAMS];
+};
+
+struct ra_req {
+	int fd;			/* the master image version to load from */
+	uint64_t offset;
+	uint64_t length;	/* 0 for a hotmap walk */
+};
+
+static uint32_t ra_max_window;
+static int8_t ra_hot_min;
+static struct ra_client *ra_clients[FD_LIMIT];
+static pthread_mutex_t ra_clients_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t ra_thread;
+static pthread_mutex_t ra_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_thread_cond = PTHREAD_COND_INITIALIZER;
+static int ra_running;
+static struct ra_req ra_queue[RA_QUEUE];
+static unsigned int ra_head, ra_tail;
+static time_t ra_seeded;
+static int ra_seeded_fd;
+
+static struct ra_client *ra_client(int addr)
+{
+	struct ra_client *rc;
+
+	rc = __atomic_load_n(&ra_clients[addr], __ATOMIC_ACQUIRE);
+	if (rc)
+		return rc;
+
+	pthread_mutex_lock(&ra_clients_lock);
+	rc = ra_clients[addr];
+	if (!rc) {
+		rc = zalloc(sizeof(*rc));
+		if (rc) {
+			pthread_mutex_init(&rc->lock, NULL);
+			__atomic_store_n(&ra_clients[addr], rc,
+					 __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&ra_clients_lock);
+
+	return rc;
+}
+
+static void ra_queue_req(int fd, uint64_t offset, uint64_t length)
+{
+	pthread_mutex_lock(&ra_thread_lock);
+	if (ra_tail - ra_head < RA_QUEUE) {
+		ra_queue[ra_tail % RA_QUEUE].fd = fd;
+		ra_queue[ra_tail % RA_QUEUE].offset = offset;
+		ra_queue[ra_tail % RA_QUEUE].length = length;
+		ra_tail++;
+		pthread_cond_signal(&ra_thread_cond);
+	}
+	pthread_mutex_unlock(&ra_thread_lock);
+}
+
+/*
+ * Load the blocks earlier runs read at least ra_hot_min times from the
+ * master image version open as master.
+ */
+static void ra_seed(int master)
+{
+	uint64_t i, len, start = 0, end = 0;
+	struct stat st;
+	int8_t *hot;
+	int fd;
+
+	fd = open("/tmp/tgt_hotmap", O_RDONLY);
+	if (fd < 0)
+		return;
+
+	/* the map may be short, e.g. while tgtd creates it */
+	if (fstat(fd, &st) || !st.st_size) {
+		close(fd);
+		return;
+	}
+	len = min_t(uint64_t, st.st_size, MAP_LEN);
+
+	hot = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hot == MAP_FAILED)
+		return;
+
+	for (i = 0; i < len; i++) {
+		if (hot[i] == -1 || hot[i] < ra_hot_min)
+			continue;
+		if (end && i - end > RA_HOT_GAP) {
+			posix_fadvise(master, start * BLK_SIZE,
+				      (end - start) * BLK_SIZE,
+				      POSIX_FADV_WILLNEED);
+			end = 0;
+		}
+		if (!end)
+			start = i;
+		end = i + 1;
+	}
+	if (end)
+		posix_fadvise(master, start * BLK_SIZE,
+			      (end - start) * BLK_SIZE, POSIX_FADV_WILLNEED);
+
+	munmap(hot, len);
+}
+
+static void *ra_thread_fn(void *arg)
+{
+	struct ra_req req;
+
+	pthread_mutex_lock(&ra_thread_lock);
+	while (ra_running) {
+		if (ra_head == ra_tail) {
+			pthread_cond_wait(&ra_thread_cond, &ra_thread_lock);
+			continue;
+		}
+		req = ra_queue[ra_head++ % RA_QUEUE];
+		pthread_mutex_unlock(&ra_thread_lock);
+
+		if (req.length)
+			posix_fadvise(req.fd, req.offset, req.length,
+				      POSIX_FADV_WILLNEED);
+		else
+			ra_seed(req.fd);
+
+		pthread_mutex_lock(&ra_thread_lock);
+	}
+	pthread_mutex_unlock(&ra_thread_lock);
+
+	return NULL;
+}
+
+/*
+ * A client's boot begins from the master image version open as fd,
+ * walk the hotmap on it unless that was just done.
+ */
+static void ra_boot(int fd)
+{
+	time_t now = time(NULL);
+
+	if (!fd)
+		return;
+
+	pthread_mutex_lock(&ra_thread_lock);
+	if (fd == ra_seeded_fd && now - ra_seeded < RA_SEED_SECS) {
+		pthread_mutex_unlock(&ra_thread_lock);
+		return;
+	}
+	ra_seeded = now;
+	ra_seeded_fd = fd;
+	pthread_mutex_unlock(&ra_thread_lock);
+
+	ra_queue_req(fd, 0, 0);
+}
+
+/* Called for every read a client does, before it is served. */
+void ra_read(int addr, uint64_t offset, uint32_t length)
+{
+	struct ra_client *rc;
+	struct ra_stream *s, *old;
+	uint64_t end = offset + length, from = 0, to = 0;
+	unsigned int gen;
+	int i;
+
+	if (!ra_running || addr < 0 || addr >= FD_LIMIT)
+		return;
+
+	rc = ra_client(addr);
+	if (!rc)
+		return;
+
+	pthread_mutex_lock(&rc->lock);
+
+	if (ra_hot_min && reset_gen) {
+		gen = __atomic_load_n(&reset_gen[addr], __ATOMIC_ACQUIRE);
+		if (!rc->seen || rc->gen != gen) {
+			rc->seen = 1;
+			rc->gen = gen;
+			memset(rc->s, 0, sizeof(rc->s));
+			ra_boot(client_master_fd(fd_map[addr]));
+		}
+	}
+
+	if (!ra_max_window) {
+		pthread_mutex_unlock(&rc->lock);
+		return;
+	}
+
+	rc->tick++;
+	old = &rc->s[0];
+	for (i = 0; i < RA_STREAMS; i++) {
+		s = &rc->s[i];
+		if (s->hits && offset + RA_SLACK >= s->next &&
+		    offset <= s->next + RA_SLACK)
+			goto found;
+		if (s->used < old->used)
+			old = s;
+	}
+
+	/* a new stream, prefetched once it is seen continuing */
+	s = old;
+	s->next = end;
+	s->ahead = end;
+	s->window = RA_MIN_WINDOW;
+	s->hits = 1;
+	s->used = rc->tick;
+	pthread_mutex_unlock(&rc->lock);
+	return;
+
+found:
+	s->hits++;
+	s->used = rc->tick;
+	if (end > s->next)
+		s->next = end;
+
+	/* keep a window ahead, topped up once half of it is used */
+	if (s->ahead < s->next + s->window / 2) {
+		if (s->window < ra_max_window)
+			s->window = min_t(uint32_t, s->window * 2,
+					  ra_max_window);
+		from = max_t(uint64_t, s->ahead, s->next);
+		to = s->next + s->window;
+		s->ahead = to;
+	}
+	pthread_mutex_unlock(&rc->lock);
+
+	if (to > from)
+		ra_queue_req(client_master_fd(fd_map[addr]), from, to - from);
+}
+
+int ra_init(uint32_t window_kb, int hot_min)
+{
+	int ret;
+
+	if (ra_running || (!window_kb && !hot_min))
+		return 0;
+
+	if (window_kb)
+		ra_max_window = max_t(uint32_t, window_kb * KB,
+				      RA_MIN_WINDOW);
+	ra_hot_min = hot_min;
+	ra_running = 1;
+
+	ret = pthread_create(&ra_thread, NULL, ra_thread_fn, NULL);
+	if (ret) {
+		eprintf("failed to create read-ahead thread, %s\n",
+			strerror(ret));
+		ra_running = 0;
+		return -ret;
+	}
+
+	eprintf("read-ahead enabled, up to %u KiB per stream, hotmap %d\n",
+		ra_max_window / KB, hot_min);
+
+	return 0;
+}
+
+/* The master image is open, its own read-ahead only gets in the way */
+void ra_master_open(int fd)
+{
+	if (ra_max_window)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+}
+
+void ra_exit(void)
+{
+	if (!ra_running)
+		return;
+
+	pthread_mutex_lock(&ra_thread_lock);
+	ra_running = 0;
+	pthread_cond_signal(&ra_thread_cond);
+	pthread_mutex_unlock(&ra_thread_lock);
+
+	pthread_join(ra_thread, NULL);
+	ra_max_window = 0;
+	ra_hot_min = 0;
+}
@@ -44,6 +44,7 @@
 #include "scsi.h"
 #include "spc.h"
 #include "tgtadm_error.h"
+#include "xcopy.h"
 
 #define DEFAULT_BLK_SHIFT 9
 
@@ -224,6 +225,9 @@ static int sbc_unmap(int host_no, struct scsi_cmd *cmd)
 		goto sense;
 	}
 
+	/* the ranges are not parsed here, so drop all tokens of the I_T nexus */
+	xcopy_cancel_tokens(lu, cmd->subnet_addr, 0, UINT64_MAX);
+
 	ret = cmd->dev->bst->bs_cmd_submit(cmd);
 	if (ret) {
 		key = HARDWARE_ERROR;
@@ -396,6 +400,23 @@ static int sbc_rw(int host_no, struct scsi_cmd *cmd)
 		break;
 	}
 
+	/* ROD tokens are invalidated by writes to the data they represent */
+	switch (cmd->scb[0]) {
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case ORWRITE_16:
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_12:
+	case WRITE_VERIFY_16:
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+	case COMPARE_AND_WRITE:
+		xcopy_cancel_tokens(lu, cmd->subnet_addr, lba, tl);
+		break;
+	}
+
 	ret = cmd->dev->bst->bs_cmd_submit(cmd);
 	if (ret) {
 		key = HARDWARE_ERROR;
@@ -583,13 +604,39 @@ sense:
 	return SAM_STAT_CHECK_CONDITION;
 }
 
+/*
+ * Provisioning status at offset, 1 if deallocated, with *next set to
+ * where it may change. A client's CoW image is answered from memory.
+ */
+static int sbc_lba_status(struct scsi_cmd *cmd, uint64_t offset,
+			  uint64_t *next)
+{
+	struct scsi_lu *dev = cmd->dev;
+	off_t data, hole;
+	int state;
+
+	state = extmap_status(cmd->subnet_addr, offset, dev->size, next);
+	if (state >= 0)
+		return state;
+
+	data = find_next_data(dev, offset);
+	if (data < 0 || data > offset) {
+		*next = data < 0 ? dev->size : min_t(uint64_t, data, dev->size);
+		return 1;
+	}
+
+	hole = find_next_hole(dev, offset);
+	*next = hole < 0 ? dev->size : min_t(uint64_t, hole, dev->size);
+	return 0;
+}
+
 static int sbc_getlbastatus(int host_no, struct scsi_cmd *cmd)
 {
-	uint64_t offset;
+	uint64_t offset, next, run_next, max_run;
 	uint32_t alloc_len, avail_len, actual_len, remain_len;
 	unsigned char *buf;
 	uint8_t data[16];
-	int mapped;
+	int state;
 	uint16_t asc;
 	unsigned char key;
 
@@ -621,34 +668,30 @@ static int sbc_getlbastatus(int host_no, struct scsi_cmd *cmd)
 	actual_len = spc_memcpy(&buf[0], &remain_len, data, 8);
 	avail_len += 8;
 
-	mapped = 1;
-	do {
-		off_t next_offset;
-		uint64_t start_lba;
-		uint32_t num_blocks;
-
-		next_offset = (!mapped) ? find_next_data(cmd->dev, offset) :
-					  find_next_hole(cmd->dev, offset);
-		if (next_offset == offset) {
-			mapped = 1 - mapped;
-			continue;
-		}
-		if (next_offset > cmd->dev->size)
-			next_offset = cmd->dev->size;
+	/* a descriptor covers at most 2^32 - 1 blocks */
+	max_run = (uint64_t)UINT32_MAX << cmd->dev->blk_shift;
+
+	/* only as many descriptors as the initiator has room for */
+	while (offset < cmd->dev->size && remain_len >= 16) {
+		state = sbc_lba_status(cmd, offset, &next);
 
-		start_lba = offset >> cmd->dev->blk_shift;
-		num_blocks = (next_offset - offset) >> cmd->dev->blk_shift;
-		put_unaligned_be64(start_lba, &data[0]);
-		put_unaligned_be32(num_blocks, &data[8]);
-		data[12] = (!mapped) ? 1 : 0; /* 0:mapped 1:deallocated */
+		/* runs of the same status make one descriptor */
+		while (next < cmd->dev->size && next - offset < max_run &&
+		       sbc_lba_status(cmd, next, &run_next) == state)
+			next = run_next;
+		next = min_t(uint64_t, next, offset + max_run);
+
+		put_unaligned_be64(offset >> cmd->dev->blk_shift, &data[0]);
+		put_unaligned_be32((next - offset) >> cmd->dev->blk_shift,
+				   &data[8]);
+		data[12] = state; /* 0:mapped 1:deallocated */
 
 		actual_len += spc_memcpy(&buf[avail_len], &remain_len,
 					 data, 16);
 		avail_len += 16;
 
-		mapped = 1 - mapped;
-		offset = next_offset;
-	} while (offset < cmd->dev->size);
+		offset = next;
+	}
 
 	put_unaligned_be32(avail_len - 4, &buf[0]); /* Parameter Data Len */
 
@@ -781,6 +824,11 @@ static tgtadm_err sbc_lu_init(struct scsi_lu *lu)
 	/* Informational Exceptions Control page */
 	add_mode_page(lu, "0x1c:0:10:8:0:0:0:0:0:0:0:0:0");
 
+	/* Third-party copy, for backing stores that can copy */
+	if (test_bit(EXTENDED_COPY, lu->bst->bs_supported_ops) &&
+	    xcopy_lu_init(lu))
+		return TGTADM_NOMEM;
+
 	return TGTADM_SUCCESS;
 }
 
@@ -903,7 +951,7 @@ static struct device_type_template sbc_template = {
 		{spc_illegal_op,},
 		{spc_illegal_op,},
 		{spc_service_action, persistent_reserve_in_actions,},
-		{spc_service_action, persistent_reserve_out_actions,},
+		{spc_pr_out, persistent_reserve_out_actions,},
 
 		[0x60 ... 0x7f] = {spc_illegal_op,},
 
@@ -911,8 +959,9 @@ static struct device_type_template sbc_template = {
 		{spc_illegal_op,},
 		{spc_illegal_op,},
 		{spc_illegal_op,},
-		{spc_illegal_op,},
-		{spc_illegal_op,},
+		{spc_service_action, xcopy_out_actions,
+		 PR_WE_FA|PR_EA_FA|PR_WE_FN|PR_EA_FN},
+		{spc_service_action, xcopy_in_actions,},
 		{spc_illegal_op,},
 		{spc_illegal_op,},
 		{spc_illegal_op,},
@@ -38,6 +38,7 @@
 #define READ_10               0x28
 #define WRITE_10              0x2a
 #define SEEK_10               0x2b
+#define LOCATE_10             0x2b
 #define POSITION_TO_ELEMENT   0x2b
 #define WRITE_VERIFY          0x2e
 #define VERIFY_10             0x2f
@@ -77,6 +78,8 @@
 #define PERSISTENT_RESERVE_IN 0x5e
 #define PERSISTENT_RESERVE_OUT 0x5f
 #define VARLEN_CDB            0x7f
+#define EXTENDED_COPY         0x83
+#define RECEIVE_COPY_RESULTS  0x84
 #define READ_16               0x88
 #define COMPARE_AND_WRITE     0x89
 #define WRITE_16              0x8a
@@ -218,10 +221,19 @@
 #define ASC_PARAMETER_LIST_LENGTH_ERR		0x1a00
 #define ASC_INVALID_OP_CODE			0x2000
 #define ASC_LBA_OUT_OF_RANGE			0x2100
+#define ASC_INVALID_TOKEN_OPERATION		0x2300
+#define ASC_UNSUPPORTED_TOKEN_TYPE		0x2301
+#define ASC_TOKEN_UNKNOWN			0x2304
+#define ASC_TOKEN_EXPIRED			0x2307
+#define ASC_TOKEN_CANCELLED			0x2308
 #define ASC_INVALID_FIELD_IN_CDB		0x2400
 #define ASC_LUN_NOT_SUPPORTED			0x2500
 #define ASC_INVALID_FIELD_IN_PARMS		0x2600
 #define ASC_INVALID_RELEASE_OF_PERSISTENT_RESERVATION	0x2604
+#define ASC_TOO_MANY_TARGET_DESCRIPTORS		0x2606
+#define ASC_UNSUPPORTED_TARGET_DESCRIPTOR_TYPE	0x2607
+#define ASC_TOO_MANY_SEGMENT_DESCRIPTORS	0x2608
+#define ASC_UNSUPPORTED_SEGMENT_DESCRIPTOR_TYPE	0x2609
 #define ASC_INCOMPATIBLE_FORMAT			0x3005
 #define ASC_SAVING_PARMS_UNSUP			0x3900
 #define ASC_MEDIUM_DEST_FULL			0x3b0d
@@ -249,6 +261,10 @@
 #define ASC_WRITE_PROTECT			0x2700
 #define ASC_MEDIUM_OVERWRITE_ATTEMPTED		0x300c
 
+/* Copy aborted */
+#define ASC_THIRD_PARTY_DEVICE_FAILURE		0x0d01
+#define ASC_COPY_TARGET_NOT_REACHABLE		0x0d02
+
 /* Miscompare */
 #define ASC_MISCOMPARE_DURING_VERIFY_OPERATION  0x1d00
 
@@ -0,0 +1,221 @@
+/*
+ * Pool of ready-made client images
+ *
+ * A client whose image is reset needs a fresh clone of the master,
+ * which map_new_fd() would make while the client's iPXE waits. Instead a
+ * thread of tgtd keeps a few clones of the newest version ready, and
+ * map_new_fd() renames one of them into place.
+ *
+ * Spares are named after the master image, the pid of tgtd and the
+ * version, and only appear, by rename, once complete. So taking one
+ * needs no lock, whichever process renames it first has it. Spares of
+ * older versions and of earlier runs are removed.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+
+/* seconds between checks of the pool */
+#define SPARE_INTERVAL	1
+
+static int spare_nr;
+static pid_t spare_pid;
+
+static pthread_t spare_thread;
+static pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spare_cond = PTHREAD_COND_INITIALIZER;
+static int spare_running;
+
+static void spare_name(char *buf, unsigned int version, int i)
+{
+	snprintf(buf, PATH_MAX, "%s.spare.%d.%u.%d", master_path, spare_pid,
+		 version, i);
+}
+
+/* Removes spares of other runs, and of this one older than version */
+static void spare_prune(unsigned int version)
+{
+	char pattern[PATH_MAX];
+	unsigned int v;
+	size_t i, len;
+	glob_t g;
+	int pid;
+
+	len = snprintf(pattern, sizeof(pattern), "%s.spare.", master_path);
+	if (len + 1 >= sizeof(pattern))
+		return;
+	strcat(pattern, "*");
+
+	if (glob(pattern, GLOB_NOSORT, NULL, &g))
+		return;
+
+	for (i = 0; i < g.gl_pathc; i++) {
+		if (sscanf(g.gl_pathv[i] + len, "%d.%u", &pid, &v) != 2)
+			continue;
+		if (pid != spare_pid || v < version)
+			unlink(g.gl_pathv[i]);
+	}
+
+	globfree(&g);
+}
+
+static int spare_fill(int src, unsigned int version)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 4];
+	int i, fd, ret;
+
+	for (i = 0; i < spare_nr && spare_running; i++) {
+		spare_name(path, version, i);
+		if (!access(path, F_OK))
+			continue;
+
+		snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+		fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			return -errno;
+
+		ret = ioctl(fd, FICLONE, src);
+		if (ret)
+			ret = -errno;
+		close(fd);
+		if (!ret && rename(tmp, path))
+			ret = -errno;
+		if (ret) {
+			unlink(tmp);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static void *spare_thread_fn(void *arg)
+{
+	unsigned int version, pruned = 0, failed = 0;
+	struct timespec ts;
+	int src, ret;
+
+	pthread_mutex_lock(&spare_lock);
+	while (spare_running) {
+		pthread_mutex_unlock(&spare_lock);
+
+		src = master_path ? master_newest(&version) : -1;
+		if (src >= 0) {
+			if (version != pruned) {
+				spare_prune(version);
+				pruned = version;
+			}
+			if (version != failed) {
+				ret = spare_fill(src, version);
+				if (ret) {
+					eprintf("failed to make spare images, %s\n",
+						strerror(-ret));
+					failed = version;
+				}
+			}
+			close(src);
+		}
+
+		pthread_mutex_lock(&spare_lock);
+		if (!spare_running)
+			break;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += SPARE_INTERVAL;
+		pthread_cond_timedwait(&spare_cond, &spare_lock, &ts);
+	}
+	pthread_mutex_unlock(&spare_lock);
+
+	return NULL;
+}
+
+int spare_init(int nr)
+{
+	int ret;
+
+	if (spare_running || !nr)
+		return 0;
+
+	spare_nr = nr;
+	spare_pid = getpid();
+	spare_running = 1;
+
+	ret = pthread_create(&spare_thread, NULL, spare_thread_fn, NULL);
+	if (ret) {
+		eprintf("failed to create spare image thread, %s\n",
+			strerror(ret));
+		spare_running = 0;
+		spare_nr = 0;
+		return -ret;
+	}
+
+	eprintf("keeping %d spare client images\n", nr);
+
+	return 0;
+}
+
+/*
+ * Moves a spare of the given version to path, for map_new_fd(). Returns
+ * its fd, or -1 if there is none.
+ */
+int spare_take(const char *path, unsigned int version)
+{
+	char spare[PATH_MAX];
+	int i, fd;
+
+	if (!spare_nr || !version)
+		return -1;
+
+	for (i = 0; i < spare_nr; i++) {
+		spare_name(spare, version, i);
+		if (rename(spare, path))
+			continue;
+
+		fd = open(path, O_RDWR);
+		if (fd >= 0)
+			printf("Took spare image %d for %s\n", i, path);
+		return fd;
+	}
+
+	return -1;
+}
+
+void spare_exit(void)
+{
+	if (!spare_running)
+		return;
+
+	pthread_mutex_lock(&spare_lock);
+	spare_running = 0;
+	pthread_cond_signal(&spare_cond);
+	pthread_mutex_unlock(&spare_lock);
+
+	pthread_join(spare_thread, NULL);
+
+	if (master_path)
+		spare_prune(UINT_MAX);
+	spare_nr = 0;
+}
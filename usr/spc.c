@@ -306,6 +306,9 @@ int spc_inquiry(int host_no, struct scsi_cmd *cmd)
 		data[1] = (attrs->removable) ? 0x80 : 0;
 		data[2] = 5;	/* SPC-3 */
 		data[3] = 0x12;
+		/* 3PC */
+		if (attrs->lu_vpd[PCODE_OFFSET(0x8f)])
+			data[5] |= 0x08;
 		data[7] = 0x02;
 
 		memset(data + 8, 0x20, 28);
@@ -1029,6 +1032,27 @@ int spc_service_action(int host_no, struct scsi_cmd *cmd)
 	return service_action->cmd_perform(host_no, cmd);
 }
 
+/*
+ * PERSISTENT RESERVE OUT, the new state goes to the PR store if any.
+ * State that could not be saved no longer persists through power loss,
+ * so APTPL is cleared and the command fails.
+ */
+int spc_pr_out(int host_no, struct scsi_cmd *cmd)
+{
+	int ret;
+
+	ret = spc_service_action(host_no, cmd);
+	if (ret == SAM_STAT_GOOD && cmd->dev->pr_store &&
+	    pr_store_save(cmd->dev)) {
+		cmd->dev->pr_aptpl = 0;
+		sense_data_build(cmd, HARDWARE_ERROR,
+				 ASC_INTERNAL_TGT_FAILURE);
+		ret = SAM_STAT_CHECK_CONDITION;
+	}
+
+	return ret;
+}
+
 static int is_pr_holder(struct scsi_lu *lu, struct registration *reg)
 {
 	if (lu->pr_holder->pr_type == PR_TYPE_WRITE_EXCLUSIVE_ALLREG ||
@@ -1153,7 +1177,11 @@ static int spc_pr_report_capabilities(int host_no, struct scsi_cmd *cmd)
 
 	put_unaligned_be16(avail_len, &buf[0]); /* length */
 
-	/* we don't set any capability for now */
+	if (cmd->dev->pr_store) {
+		buf[2] |= 0x01; /* PTPL_C */
+		if (cmd->dev->pr_aptpl)
+			buf[3] |= 0x01; /* PTPL_A */
+	}
 
 	/* Persistent Reservation Type Mask format */
 	buf[3] |= 0x80; /* Type Mask Valid (TMV) */
@@ -1183,12 +1211,47 @@ struct service_action persistent_reserve_in_actions[] = {
 	{0, NULL},
 };
 
+static unsigned int pr_hash(uint64_t v)
+{
+	return (v * 0x9e3779b97f4a7c15ULL) >> 60;
+}
+
+void pr_link(struct scsi_lu *lu, struct registration *reg)
+{
+	list_add_tail(&reg->registration_siblings, &lu->registration_list);
+	list_add(&reg->nexus_siblings,
+		 &lu->reg_nexus_hash[pr_hash(reg->nexus_id)]);
+	list_add(&reg->key_siblings, &lu->reg_key_hash[pr_hash(reg->key)]);
+	if (!reg->nexus_id)
+		lu->pr_unbound++;
+	lu->pr_gen++;
+}
+
+static void pr_unlink(struct scsi_lu *lu, struct registration *reg)
+{
+	list_del(&reg->registration_siblings);
+	list_del(&reg->nexus_siblings);
+	list_del(&reg->key_siblings);
+	if (!reg->nexus_id)
+		lu->pr_unbound--;
+	lu->pr_gen++;
+}
+
+static void pr_set_key(struct scsi_lu *lu, struct registration *reg,
+		       uint64_t key)
+{
+	list_del(&reg->key_siblings);
+	reg->key = key;
+	list_add(&reg->key_siblings, &lu->reg_key_hash[pr_hash(key)]);
+}
+
 static struct registration *lookup_registration_by_nexus(struct scsi_lu *lu,
 							 struct it_nexus *itn)
 {
 	struct registration *reg;
 
-	list_for_each_entry(reg, &lu->registration_list, registration_siblings) {
+	list_for_each_entry(reg, &lu->reg_nexus_hash[pr_hash(itn->itn_id)],
+			    nexus_siblings) {
 		if (reg->nexus_id == itn->itn_id &&
 		    reg->ctime == itn->ctime)
 			return reg;
@@ -1197,22 +1260,100 @@ static struct registration *lookup_registration_by_nexus(struct scsi_lu *lu,
 	return NULL;
 }
 
+static struct registration *lookup_registration_by_key(struct scsi_lu *lu,
+							uint64_t key)
+{
+	struct registration *reg;
+
+	list_for_each_entry(reg, &lu->reg_key_hash[pr_hash(key)],
+			    key_siblings) {
+		if (reg->key == key)
+			return reg;
+	}
+
+	return NULL;
+}
+
 static int check_registration_key_exists(struct scsi_lu *lu, uint64_t key)
 {
+	return lookup_registration_by_key(lu, key) ? 0 : 1;
+}
+
+/* TransportID of the command's initiator port, 0 if there is none */
+static int pr_tpid(struct scsi_cmd *cmd, char *buf)
+{
+	int (*id)(int, uint64_t, char *, int);
+	int len;
+
+	id = tgt_drivers[cmd->c_target->lid]->transportid;
+	if (!id)
+		return 0;
+
+	memset(buf, 0, PR_TPID_LEN);
+	len = id(cmd->dev->tgt->tid, cmd->cmd_itn_id, buf, PR_TPID_LEN);
+	return len > PR_TPID_LEN ? 0 : len;
+}
+
+/*
+ * A registration restored from the PR store belongs to whichever nexus
+ * first shows up with its TransportID.
+ */
+static struct registration *pr_bind(struct scsi_cmd *cmd)
+{
+	struct scsi_lu *lu = cmd->dev;
 	struct registration *reg;
+	char tpid[PR_TPID_LEN];
+	int len;
+
+	len = pr_tpid(cmd, tpid);
+	if (!len)
+		return NULL;
 
 	list_for_each_entry(reg, &lu->registration_list,
-				registration_siblings) {
-		if (reg->key == key)
-			return 0;
+			    registration_siblings) {
+		if (reg->nexus_id || reg->tpid_len != len ||
+		    memcmp(reg->tpid, tpid, len))
+			continue;
+
+		pr_unlink(lu, reg);
+		reg->nexus_id = cmd->cmd_itn_id;
+		reg->ctime = cmd->it_nexus->ctime;
+		pr_link(lu, reg);
+		return reg;
 	}
 
-	return 1;
+	return NULL;
+}
+
+/*
+ * The registration of the command's I_T nexus. The answer is kept with
+ * the I_T_L nexus until a registration comes, goes or moves, so that
+ * with a reservation held a command only compares generations.
+ */
+static struct registration *pr_lookup(struct scsi_cmd *cmd)
+{
+	struct it_nexus_lu_info *itn_lu = cmd->itn_lu_info;
+	struct scsi_lu *lu = cmd->dev;
+	struct registration *reg;
+
+	if (itn_lu && itn_lu->pr_gen == lu->pr_gen)
+		return itn_lu->pr_reg;
+
+	reg = lookup_registration_by_nexus(lu, cmd->it_nexus);
+	if (!reg && lu->pr_unbound)
+		reg = pr_bind(cmd);
+
+	if (itn_lu) {
+		itn_lu->pr_reg = reg;
+		itn_lu->pr_gen = lu->pr_gen;
+	}
+
+	return reg;
 }
 
 static void __unregister(struct scsi_lu *lu, struct registration *reg)
 {
-	list_del(&reg->registration_siblings);
+	pr_unlink(lu, reg);
 	free(reg);
 }
 
@@ -1223,7 +1364,7 @@ static void __unregister_and_clean(struct scsi_cmd *cmd,
 
 
 	/* if reservation owner goes away then so does reservation */
-	list_del(&reg->registration_siblings);
+	pr_unlink(cmd->dev, reg);
 
 	holder = cmd->dev->pr_holder;
 	if (!holder) {
@@ -1297,7 +1438,7 @@ static int check_pr_out_basic_parameter(struct scsi_cmd *cmd)
 	all_tg_pt = buf[20] & (1U << 2);
 	aptpl = buf[20] & (1U << 0);
 
-	if (spec_i_pt | all_tg_pt | aptpl) {
+	if (spec_i_pt | all_tg_pt) {
 		/*
 		 * for now, we say that we don't support these bits
 		 * via REPORT CAPABILITIES.
@@ -1305,6 +1446,10 @@ static int check_pr_out_basic_parameter(struct scsi_cmd *cmd)
 		return 1;
 	}
 
+	/* APTPL only with a PR store, see REPORT CAPABILITIES */
+	if (aptpl && !cmd->dev->pr_store)
+		return 1;
+
 	return 0;
 }
 
@@ -1328,11 +1473,11 @@ static int spc_pr_register(int host_no, struct scsi_cmd *cmd)
 	res_key = get_unaligned_be64(buf);
 	sa_res_key = get_unaligned_be64(buf + 8);
 
-	reg = lookup_registration_by_nexus(cmd->dev, cmd->it_nexus);
+	reg = pr_lookup(cmd);
 	if (reg) {
 		if (force || reg->key == res_key) {
 			if (sa_res_key)
-				reg->key = sa_res_key;
+				pr_set_key(cmd->dev, reg, sa_res_key);
 			else
 				__unregister_and_clean(cmd, reg);
 		} else
@@ -1350,8 +1495,8 @@ static int spc_pr_register(int host_no, struct scsi_cmd *cmd)
 				reg->key = sa_res_key;
 				reg->nexus_id = cmd->cmd_itn_id;
 				reg->ctime = cmd->it_nexus->ctime;
-				list_add_tail(&reg->registration_siblings,
-					      &cmd->dev->registration_list);
+				reg->tpid_len = pr_tpid(cmd, reg->tpid);
+				pr_link(cmd->dev, reg);
 			} else
 				; /* do nothing */
 		} else
@@ -1359,6 +1504,7 @@ static int spc_pr_register(int host_no, struct scsi_cmd *cmd)
 	}
 
 	cmd->dev->prgeneration++;
+	cmd->dev->pr_aptpl = buf[20] & 0x01;
 
 	return SAM_STAT_GOOD;
 sense:
@@ -1397,7 +1543,7 @@ static int spc_pr_reserve(int host_no, struct scsi_cmd *cmd)
 	if (pr_scope != PR_LU_SCOPE)
 		goto sense;
 
-	reg = lookup_registration_by_nexus(cmd->dev, cmd->it_nexus);
+	reg = pr_lookup(cmd);
 	if (!reg)
 		return SAM_STAT_RESERVATION_CONFLICT;
 
@@ -1445,7 +1591,7 @@ static int spc_pr_release(int host_no, struct scsi_cmd *cmd)
 
 	res_key = get_unaligned_be64(buf);
 
-	reg = lookup_registration_by_nexus(cmd->dev, cmd->it_nexus);
+	reg = pr_lookup(cmd);
 	if (!reg)
 		return SAM_STAT_RESERVATION_CONFLICT;
 
@@ -1512,7 +1658,7 @@ static int spc_pr_clear(int host_no, struct scsi_cmd *cmd)
 
 	res_key = get_unaligned_be64(buf);
 
-	reg = lookup_registration_by_nexus(cmd->dev, cmd->it_nexus);
+	reg = pr_lookup(cmd);
 	if (!reg)
 		return SAM_STAT_RESERVATION_CONFLICT;
 
@@ -1532,8 +1678,7 @@ static int spc_pr_clear(int host_no, struct scsi_cmd *cmd)
 		if (sibling != reg)
 			ua_sense_add_it_nexus(sibling->nexus_id,
 				cmd->dev, ASC_RESERVATIONS_PREEMPTED);
-		list_del(&sibling->registration_siblings);
-		free(sibling);
+		__unregister(cmd->dev, sibling);
 	}
 
 	cmd->dev->prgeneration++;
@@ -1567,7 +1712,7 @@ static int spc_pr_preempt(int host_no, struct scsi_cmd *cmd)
 	res_key = get_unaligned_be64(buf);
 	sa_res_key = get_unaligned_be64(buf + 8);
 
-	reg = lookup_registration_by_nexus(cmd->dev, cmd->it_nexus);
+	reg = pr_lookup(cmd);
 	if (!reg)
 		return SAM_STAT_RESERVATION_CONFLICT;
 
@@ -1657,7 +1802,7 @@ static int spc_pr_register_and_move(int host_no, struct scsi_cmd *cmd)
 	buf = scsi_get_out_buffer(cmd);
 
 	aptpl = buf[17] & 0x01;
-	if (aptpl) /* not reported in capabilities */
+	if (aptpl && !cmd->dev->pr_store) /* not reported in capabilities */
 		goto sense;
 
 	unreg = buf[17] & 0x02;
@@ -1671,7 +1816,7 @@ static int spc_pr_register_and_move(int host_no, struct scsi_cmd *cmd)
 	if (param_list_len - 24 < tpid_data_len)
 		goto sense;
 
-	reg = lookup_registration_by_nexus(cmd->dev, cmd->it_nexus);
+	reg = pr_lookup(cmd);
 	if (!reg) {
 		if (cmd->dev->pr_holder)
 			return SAM_STAT_RESERVATION_CONFLICT;
@@ -1688,14 +1833,10 @@ static int spc_pr_register_and_move(int host_no, struct scsi_cmd *cmd)
 	if (!sa_res_key)
 		return SAM_STAT_RESERVATION_CONFLICT;
 
-	list_for_each_entry(dst, &cmd->dev->registration_list,
-			    registration_siblings)
-		if (dst->key == sa_res_key)
-			goto found;
+	dst = lookup_registration_by_key(cmd->dev, sa_res_key);
+	if (!dst) /* we can't find the destination */
+		goto sense;
 
-	/* we can't find the destination */
-	goto sense;
-found:
 	id = tgt_drivers[cmd->c_target->lid]->transportid;
 	if (id) {
 		memset(tpid, 0, sizeof(tpid));
@@ -1710,6 +1851,7 @@ found:
 		__unregister(cmd->dev, reg);
 
 	cmd->dev->prgeneration++;
+	cmd->dev->pr_aptpl = aptpl;
 	return SAM_STAT_GOOD;
 sense:
 	scsi_set_in_resid_by_actual(cmd, 0);
@@ -1740,7 +1882,7 @@ int spc_access_check(struct scsi_cmd *cmd)
 	if (!cmd->dev->pr_holder)
 		return 0;
 
-	reg = lookup_registration_by_nexus(cmd->dev, cmd->it_nexus);
+	reg = pr_lookup(cmd);
 
 	if (reg && is_pr_holder(cmd->dev, reg))
 		return 0;
@@ -1930,7 +2072,8 @@ enum {
 	Opt_mode_page,
 	Opt_path, Opt_bsopts,
 	Opt_bsoflags, Opt_thinprovisioning,
-	Opt_rotation_rate,
+	Opt_rotation_rate, Opt_commit,
+	Opt_pr_file,
 	Opt_err,
 };
 
@@ -1954,6 +2097,8 @@ static match_table_t tokens = {
 	{Opt_bsoflags, "bsoflags=%s"},
 	{Opt_thinprovisioning, "thin_provisioning=%s"},
 	{Opt_rotation_rate, "rotation_rate=%s"},
+	{Opt_commit, "commit=%s"},
+	{Opt_pr_file, "pr_file=%s"},
 	{Opt_err, NULL},
 };
 
@@ -2073,6 +2218,14 @@ tgtadm_err lu_config(struct scsi_lu *lu, char *params, match_fn_t *fn)
 			match_strncpy(buf, &args[0], sizeof(buf));
 			adm_err = tgt_device_path_update(lu->tgt, lu, buf);
 			break;
+		case Opt_commit:
+			match_strncpy(buf, &args[0], sizeof(buf));
+			adm_err = tgt_master_commit(lu, buf);
+			break;
+		case Opt_pr_file:
+			match_strncpy(buf, &args[0], sizeof(buf));
+			adm_err = pr_store_open(lu, buf);
+			break;
 		default:
 			adm_err = fn ? fn(lu, p) : TGTADM_INVALID_REQUEST;
 		}
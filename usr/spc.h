@@ -5,6 +5,7 @@ extern struct service_action maint_in_service_actions[],
 	persistent_reserve_in_actions[], persistent_reserve_out_actions[];
 
 extern int spc_service_action(int host_no, struct scsi_cmd *cmd);
+extern int spc_pr_out(int host_no, struct scsi_cmd *cmd);
 extern int spc_inquiry(int host_no, struct scsi_cmd *cmd);
 extern int spc_report_luns(int host_no, struct scsi_cmd *cmd);
 extern int spc_start_stop(int host_no, struct scsi_cmd *cmd);
@@ -33,4 +34,5 @@ extern tgtadm_err spc_lu_online(struct scsi_lu *lu);
 extern tgtadm_err spc_lu_offline(struct scsi_lu *lu);
 
 extern int spc_access_check(struct scsi_cmd *cmd);
+extern void pr_link(struct scsi_lu *lu, struct registration *reg);
 #endif
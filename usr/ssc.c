@@ -267,7 +267,7 @@ static struct device_type_template ssc_template = {
 		{spc_illegal_op,},
 		{spc_illegal_op,},
 		{spc_illegal_op,},
-		{spc_illegal_op,},
+		{ssc_rw,},
 		{spc_illegal_op,},
 		{spc_illegal_op,},
 		{spc_illegal_op,},
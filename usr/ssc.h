@@ -15,6 +15,16 @@ struct blk_header_info {
 	uint64_t next;
 };
 
+struct blk_index_header;
+struct blk_index;
+
+struct ssc_index {
+	int fd;			/* -1 if only kept in memory */
+	struct blk_index_header *hdr;
+	struct blk_index *e;
+	uint64_t alloc;		/* entries mapped */
+};
+
 /*
  * MAM structure based from IBM Ultrium SCSI Reference WB1109-02
  */
@@ -70,6 +80,8 @@ struct ssc_info {
 	struct MAM_info mam;
 
 	struct blk_header_info c_blk;	/* Current block header */
+
+	struct ssc_index index;
 };
 
 #endif
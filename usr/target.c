@@ -27,6 +27,9 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <ctype.h>
@@ -398,14 +401,190 @@ static void tgt_cmd_queue_init(struct tgt_cmd_queue *q)
 	INIT_LIST_HEAD(&q->queue);
 }
 
+/*
+ * A new path for the master image while clients run from it. It is
+ * registered as a new version, which clients move to when they reset,
+ * so the logical unit stays online.
+ */
+static tgtadm_err tgt_master_update(struct scsi_lu *lu, char *path)
+{
+	int dev_fd, ret;
+	uint64_t size;
+
+	path = strdup(path);
+	if (!path)
+		return TGTADM_NOMEM;
+
+	if (lu->bst->bs_open(lu, path, &dev_fd, &size)) {
+		free(path);
+		return TGTADM_INVALID_REQUEST;
+	}
+
+	/* client images are clones of it, all versions have one size */
+	if (size != lu->size) {
+		eprintf("%s has %" PRIu64 " bytes, the master image %" PRIu64
+			"\n", path, size, lu->size);
+		goto err;
+	}
+
+	ret = master_register(path, dev_fd);
+	if (ret < 0) {
+		eprintf("failed to register %s, %s\n", path, strerror(-ret));
+		goto err;
+	}
+
+	lu->bst->bs_close(lu);
+	free(lu->path);
+	lu->fd = dev_fd;
+	lu->path = path;
+	return TGTADM_SUCCESS;
+err:
+	close(dev_fd);
+	free(path);
+	return TGTADM_INVALID_REQUEST;
+}
+
+/*
+ * A commit of a client's image. Cloning and syncing a large image can
+ * take seconds, so it runs in its own thread and the main loop is told
+ * through an eventfd when it is done. One runs at a time.
+ */
+struct master_commit_job {
+	int tid;
+	uint64_t lun;
+	int addr;
+	uint64_t size;
+	char *path;
+	int efd;
+	int ret;
+};
+
+static struct master_commit_job *commit_job;
+
+static void *tgt_master_commit_fn(void *arg)
+{
+	struct master_commit_job *job = arg;
+	uint64_t one = 1;
+
+	job->ret = master_commit(job->addr, job->path, job->size);
+	if (write(job->efd, &one, sizeof(one)) != sizeof(one))
+		eprintf("failed to signal the end of a commit, %m\n");
+
+	return NULL;
+}
+
+static void tgt_master_commit_done(int fd, int events, void *data)
+{
+	struct master_commit_job *job = data;
+	struct target *target;
+	struct scsi_lu *lu = NULL;
+	uint64_t n;
+
+	if (read(fd, &n, sizeof(n)) != sizeof(n))
+		return;
+
+	tgt_event_del(job->efd);
+	close(job->efd);
+
+	if (job->ret)
+		eprintf("failed to commit client %d to %s, %s\n", job->addr,
+			job->path, strerror(-job->ret));
+	else {
+		/* the logical unit may have gone meanwhile */
+		target = target_lookup(job->tid);
+		if (target)
+			lu = device_lookup(target, job->lun);
+		if (!lu || !lu->path)
+			eprintf("logical unit of %s is gone, not registered\n",
+				job->path);
+		else if (tgt_master_update(lu, job->path))
+			eprintf("failed to register %s\n", job->path);
+	}
+
+	free(job->path);
+	free(job);
+	commit_job = NULL;
+}
+
+/*
+ * Commits a client's image as the next version of the master image,
+ * arg is "<client>:<path of the new version>". The commit completes
+ * in the background, its outcome is logged.
+ */
+tgtadm_err tgt_master_commit(struct scsi_lu *lu, char *arg)
+{
+	struct master_commit_job *job;
+	pthread_attr_t attr;
+	pthread_t thread;
+	char *path;
+	int ret;
+
+	path = strchr(arg, ':');
+	if (!path || path == arg || !master_fd || !lu->path)
+		return TGTADM_INVALID_REQUEST;
+	*path++ = '\0';
+
+	if (commit_job) {
+		eprintf("a commit to %s is still running\n", commit_job->path);
+		return TGTADM_LUN_ACTIVE;
+	}
+
+	job = zalloc(sizeof(*job));
+	if (!job)
+		return TGTADM_NOMEM;
+	job->path = strdup(path);
+	if (!job->path)
+		goto free_job;
+	job->tid = lu->tgt->tid;
+	job->lun = lu->lun;
+	job->addr = atoi(arg);
+	job->size = lu->size;
+
+	job->efd = eventfd(0, EFD_NONBLOCK);
+	if (job->efd < 0)
+		goto free_path;
+	if (tgt_event_add(job->efd, EPOLLIN, tgt_master_commit_done, job))
+		goto close_efd;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, tgt_master_commit_fn, job);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		eprintf("failed to start the commit thread, %s\n",
+			strerror(ret));
+		tgt_event_del(job->efd);
+		goto close_efd;
+	}
+
+	commit_job = job;
+	return TGTADM_SUCCESS;
+close_efd:
+	close(job->efd);
+free_path:
+	free(job->path);
+free_job:
+	free(job);
+	return TGTADM_UNKNOWN_ERR;
+}
+
 tgtadm_err tgt_device_path_update(struct target *target, struct scsi_lu *lu,
 				  char *path)
 {
 	int dev_fd;
+	char *prefix;
 	size_t len;
 	uint64_t size;
 	int err;
 
+	if (lu->path && master_fd)
+		return tgt_master_update(lu, path);
+
+	if (master_fd) {
+		eprintf("master image already set, update its path instead\n");
+		return TGTADM_INVALID_REQUEST;
+	}
+
 	if (lu->path) {
 		int ret;
 
@@ -434,15 +613,19 @@ tgtadm_err tgt_device_path_update(struct target *target, struct scsi_lu *lu,
 		return TGTADM_INVALID_REQUEST;
 	}
 
-	if (master_fd != 0) {
-		fprintf(stderr, "master file was already set!\n");
-		exit(1);
+	err = master_register(path, dev_fd);
+	if (err < 0) {
+		eprintf("failed to register %s, %s\n", path, strerror(-err));
+		close(dev_fd);
+		free(path);
+		return TGTADM_INVALID_REQUEST;
 	}
 
+	/* client images keep the name of the first version */
 	len = strlen(path);
-	master_fd = dev_fd;
-	master_path = malloc(len + 1);
-	memcpy(master_path, path, len + 1);
+	prefix = malloc(len + 1);
+	memcpy(prefix, path, len + 1);
+	master_path = prefix;
 	printf("%d set as master_fd: %s\n", master_fd, master_path);
 	start_client_handler();
 
@@ -493,7 +676,7 @@ tgtadm_err tgt_device_create(int tid, int dev_type, uint64_t lun, char *params,
 {
 	char *p, *path = NULL, *bstype = NULL, *bsopts = NULL;
 	char *bsoflags = NULL, *blocksize = NULL;
-	int lu_bsoflags = 0;
+	int lu_bsoflags = 0, i;
 	tgtadm_err adm_err = TGTADM_SUCCESS;
 	struct target *target;
 	struct scsi_lu *lu, *pos;
@@ -614,10 +797,16 @@ tgtadm_err tgt_device_create(int tid, int dev_type, uint64_t lun, char *params,
 
 	tgt_cmd_queue_init(&lu->cmd_queue);
 	INIT_LIST_HEAD(&lu->registration_list);
+	for (i = 0; i < PR_HASH_SIZE; i++) {
+		INIT_LIST_HEAD(&lu->reg_nexus_hash[i]);
+		INIT_LIST_HEAD(&lu->reg_key_hash[i]);
+	}
 	INIT_LIST_HEAD(&lu->lu_itl_info_list);
 	INIT_LIST_HEAD(&lu->mode_pages);
 	lu->prgeneration = 0;
 	lu->pr_holder = NULL;
+	/* never 0, which is what a new I_T_L nexus has cached */
+	lu->pr_gen = 1;
 
 	lu->cmd_perform = &target_cmd_perform;
 	lu->cmd_done = &__cmd_done;
@@ -778,6 +967,7 @@ tgtadm_err tgt_device_destroy(int tid, uint64_t lun, int force)
 
 	list_del(&lu->device_siblings);
 
+	pr_store_close(lu);
 	list_for_each_entry_safe(reg, reg_next, &lu->registration_list,
 				 registration_siblings) {
 		free(reg);
@@ -933,10 +1123,9 @@ int device_release(int tid, uint64_t itn_id, uint64_t lun, int force)
 
 int device_reserved(struct scsi_cmd *cmd)
 {
-	struct scsi_lu *lu;
+	struct scsi_lu *lu = cmd->dev;
 
-	lu = device_lookup(cmd->c_target, cmd->dev->lun);
-	if (!lu || !lu->reserve_id || lu->reserve_id == cmd->cmd_itn_id)
+	if (!lu->reserve_id || lu->reserve_id == cmd->cmd_itn_id)
 		return 0;
 	return -EBUSY;
 }
@@ -55,6 +55,7 @@ static struct option const long_options[] = {
 	{"foreground", no_argument, 0, 'f'},
 	{"control-port", required_argument, 0, 'C'},
 	{"nr_iothreads", required_argument, 0, 't'},
+	{"numa-node", required_argument, 0, 'N'},
 	{"pid-file", required_argument, 0, 'p'},
 	{"debug", required_argument, 0, 'd'},
 	{"nodaemonize", no_argument, 0, 'D'},
@@ -63,7 +64,7 @@ static struct option const long_options[] = {
 	{0, 0, 0, 0},
 };
 
-static char *short_options = "fDC:d:t:p:Vh";
+static char *short_options = "fDC:d:t:N:p:Vh";
 static char *spare_args;
 
 static void usage(int status)
@@ -80,6 +81,7 @@ static void usage(int status)
 		"-D, --nodaemonize       make the program run in the foreground with logger\n"
 		"-C, --control-port NNNN use port NNNN for the mgmt channel\n"
 		"-t, --nr_iothreads NNNN specify the number of I/O threads\n"
+		"-N, --numa-node node    run on a NUMA node, or that of a NIC\n"
 		"-p, --pid-file filename specify the pid file\n"
 		"-d, --debug debuglevel  print debugging information\n"
 		"-V, --version           print version and exit\n"
@@ -551,6 +553,7 @@ int main(int argc, char **argv)
 	struct sigaction sa_new;
 	int err, ch, longindex, nr_lld = 0;
 	int is_daemon = 1, is_debug = 0, use_logger = 1;
+	int numa_node = -1;
 	int ret;
 	char *pidfile = NULL;
 
@@ -593,6 +596,11 @@ int main(int argc, char **argv)
 			if (ret)
 				bad_optarg(ret, ch, optarg);
 			break;
+		case 'N':
+			numa_node = numa_parse_node(optarg);
+			if (numa_node < 0)
+				bad_optarg(EINVAL, ch, optarg);
+			break;
 		case 'p':
 			pidfile = strdup(optarg);
 			if (pidfile == NULL) {
@@ -623,6 +631,11 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (numa_node >= 0 && numa_bind(numa_node))
+		exit(1);
+
+	init_flag_map();
+
 	ep_fd = epoll_create(4096);
 	if (ep_fd < 0) {
 		fprintf(stderr, "can't create epoll fd, %m\n");
@@ -129,6 +129,10 @@ struct it_nexus_lu_info {
 	struct list_head lu_itl_info_siblings;
 	struct list_head pending_ua_sense_list;
 	int prevent; /* prevent removal on this itl nexus ? */
+
+	/* registration of this nexus, valid while pr_gen is the lu's */
+	struct registration *pr_reg;
+	uint64_t pr_gen;
 };
 
 struct service_action {
@@ -186,16 +190,27 @@ struct mode_pg {
 	uint8_t mode_data[0];	/* Rest of mode page info */
 };
 
+#define PR_HASH_SIZE	16
+#define PR_TPID_LEN	300
+
 struct registration {
 	uint64_t key;
-	uint64_t nexus_id;
+	uint64_t nexus_id;	/* 0 if restored and not seen since */
 	long ctime;
 	struct list_head registration_siblings;
+	struct list_head nexus_siblings;
+	struct list_head key_siblings;
+
+	/* TransportID of the initiator port, to restore it by */
+	char tpid[PR_TPID_LEN];
+	int tpid_len;
 
 	uint8_t pr_scope;
 	uint8_t pr_type;
 };
 
+struct pr_store;
+
 struct scsi_lu {
 	int fd;
 	uint64_t addr; /* persistent mapped address */
@@ -227,6 +242,14 @@ struct scsi_lu {
 	struct lu_phy_attr attrs;
 
 	struct list_head registration_list;
+	/* the registrations hashed by I_T nexus and by key */
+	struct list_head reg_nexus_hash[PR_HASH_SIZE];
+	struct list_head reg_key_hash[PR_HASH_SIZE];
+	/* bumped whenever a registration comes, goes or moves */
+	uint64_t pr_gen;
+	int pr_unbound;
+	int pr_aptpl;
+	struct pr_store *pr_store;
 	uint32_t prgeneration;
 	struct registration *pr_holder;
 
@@ -274,6 +297,7 @@ extern int device_reserve(struct scsi_cmd *cmd);
 extern int device_release(int tid, uint64_t itn_id, uint64_t lun, int force);
 extern int device_reserved(struct scsi_cmd *cmd);
 extern tgtadm_err tgt_device_path_update(struct target *target, struct scsi_lu *lu, char *path);
+extern tgtadm_err tgt_master_commit(struct scsi_lu *lu, char *arg);
 
 extern tgtadm_err tgt_target_create(int lld, int tid, char *args);
 extern tgtadm_err tgt_target_destroy(int lld, int tid, int force);
@@ -418,11 +442,78 @@ extern char *master_path;
 extern int *fd_map;
 extern int8_t *flag_map;
 extern int *fd_flag_map;
+extern int *fd_master_map;
 extern int clients_count;
 extern void map_new_fd(int addr, bool skip);
 extern void map_del_fd(int addr);
 extern void start_client_handler(void);
 extern int extract_subnet_addr(char *str);
+extern unsigned int *reset_gen;
+extern ssize_t bs_rdwr_pread(int fd, void *buf, size_t length,
+			     off64_t offset);
+extern ssize_t bs_rdwr_pwrite(int fd, const void *buf, size_t length,
+			      off64_t offset);
+
+extern int wb_init(uint32_t size);
+extern void wb_exit(void);
+extern int wb_write(int addr, int fd, const char *buf, uint32_t length,
+		    uint64_t offset);
+extern int wb_read(int addr, char *buf, uint32_t length, uint64_t offset);
+extern int wb_flush(int addr, uint64_t offset, uint64_t length);
+extern int wb_sync(int addr, int fd, uint64_t offset, uint64_t length);
+
+extern int ram_overlay_init(uint32_t cap_mb);
+extern void ram_overlay_exit(void);
+extern int ram_overlay_enabled(void);
+extern ssize_t ram_read(int addr, int fd, char *buf, size_t length,
+			uint64_t offset);
+extern ssize_t ram_write(int addr, int fd, const char *buf, size_t length,
+			 uint64_t offset);
+extern void ram_unmap(int addr, uint64_t offset, uint64_t length);
+
+extern int dedup_init(char *path);
+extern void dedup_exit(void);
+extern int dedup_enabled(void);
+extern ssize_t dedup_read(int addr, int fd, char *buf, size_t length,
+			  uint64_t offset);
+extern ssize_t dedup_write(int addr, int fd, const char *buf, size_t length,
+			   uint64_t offset);
+extern int dedup_unmap(int addr, int fd, uint64_t offset, uint64_t length);
+
+extern void extmap_write(int addr, uint64_t offset, uint64_t length);
+extern void extmap_unmap(int addr, uint64_t offset, uint64_t length);
+extern int extmap_status(int addr, uint64_t offset, uint64_t size,
+			 uint64_t *next);
+
+extern int master_register(const char *path, int fd);
+extern int master_bind(int addr, bool keep);
+extern int master_newest(unsigned int *version);
+extern unsigned int master_version(int addr);
+
+extern int spare_init(int nr);
+extern void spare_exit(void);
+extern int spare_take(const char *path, unsigned int version);
+extern int master_commit(int addr, const char *path, uint64_t size);
+
+extern tgtadm_err pr_store_open(struct scsi_lu *lu, const char *path);
+extern int pr_store_save(struct scsi_lu *lu);
+extern void pr_store_close(struct scsi_lu *lu);
+
+/* The version of the master image a client's image was cloned from */
+#define client_master_fd(fd) \
+	(fd_master_map[fd] ? fd_master_map[fd] : master_fd)
+
+extern void init_flag_map(void);
+extern int numa_parse_node(const char *arg);
+extern int numa_bind(int node);
+
+extern int ra_init(uint32_t window_kb, int hot_min);
+extern void ra_exit(void);
+extern void ra_master_open(int fd);
+extern void ra_read(int addr, uint64_t offset, uint32_t length);
+
+// Allow up-to 4096 clients to connect
+#define FD_LIMIT 4096
 
 #define IMG_SIZE_GB 40
 #define BLK_SIZE 4096
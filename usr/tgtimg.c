@@ -45,6 +45,7 @@
 enum {
 	OP_NEW,
 	OP_SHOW,
+	OP_INDEX,
 };
 
 static char program_name[] = "tgtimg";
@@ -84,6 +85,9 @@ Linux SCSI Target Framework Image File Utility, version %s\n\
   --op show --device-type tape --file=[path]\n\
 			dump the tape image file contents.\n\
 			[path] is the tape image file\n\
+  --op index --device-type tape --file=[path]\n\
+			rebuild the index of the tape image file,\n\
+			kept in [path].idx\n\
   --thin-provisioning   create a sparse file for the media\n\
   --help                display this help and exit\n\
 \n\
@@ -112,6 +116,8 @@ static int str_to_op(char *str)
 		return OP_NEW;
 	else if (!strcmp("show", str))
 		return OP_SHOW;
+	else if (!strcmp("index", str))
+		return OP_INDEX;
 	else {
 		eprintf("unknown operation: %s\n", str);
 		exit(1);
@@ -339,6 +345,48 @@ static int ssc_new(int op, char *path, char *barcode, char *capacity,
 	return 0;
 }
 
+static int ssc_reindex(char *path)
+{
+	struct ssc_index ix;
+	struct MAM_info mam;
+	int fd;
+
+	fd = open(path, O_RDONLY|O_LARGEFILE);
+	if (fd < 0) {
+		eprintf("can't open %s, %m\n", path);
+		exit(1);
+	}
+
+	if (ssc_read_mam_info(fd, &mam)) {
+		perror("Could not read MAM");
+		exit(1);
+	}
+
+	if (mam.tape_fmt_version != TGT_TAPE_VERSION) {
+		printf("Unknown media format version %x\n",
+		       mam.tape_fmt_version);
+		exit(1);
+	}
+
+	if (ssc_index_open(&ix, path, fd, mam.medium_serial_number) < 0 ||
+	    ix.fd < 0) {
+		eprintf("can't open %s.idx, %m\n", path);
+		exit(1);
+	}
+
+	if (ssc_index_build(&ix, fd, mam.medium_serial_number)) {
+		eprintf("can't index %s, medium format corrupt\n", path);
+		exit(1);
+	}
+
+	printf("Indexed %" PRIu64 " blocks of %s\n", ix.hdr->nr, path);
+
+	ssc_index_close(&ix);
+	close(fd);
+
+	return 0;
+}
+
 static int ssc_ops(int op, char *path, char *barcode, char *capacity,
 		   char *media_type)
 {
@@ -365,6 +413,8 @@ static int ssc_ops(int op, char *path, char *barcode, char *capacity,
 		return ssc_new(op, path, barcode, capacity, media_type);
 	} else if (op == OP_SHOW)
 		return ssc_show(path);
+	else if (op == OP_INDEX)
+		return ssc_reindex(path);
 	else {
 		eprintf("unknown the operation type\n");
 		usage(1);
@@ -24,6 +24,7 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -214,3 +215,46 @@ int spc_memcpy(uint8_t *dst, uint32_t *dst_remain_len,
 	}
 	return copy_len;
 }
+
+/*
+ * Helpers for parsing backing store options, "name=value;name=value".
+ * Returns a malloc()ed copy of everything up to the next ';' and
+ * moves *p past it.
+ */
+char *slurp_to_semi(char **p)
+{
+	char *end = strchr(*p, ';');
+	char *ret;
+	int len;
+
+	if (end == NULL)
+		end = *p + strlen(*p);
+	len = end - *p;
+	ret = malloc(len + 1);
+	if (!ret)
+		return NULL;
+	strncpy(ret, *p, len);
+	ret[len] = '\0';
+	*p = end;
+	/* Jump past the semicolon, if we stopped at one */
+	if (**p == ';')
+		*p = end + 1;
+	return ret;
+}
+
+/* The value of the option at *p, NULL if it has none */
+char *slurp_value(char **p)
+{
+	char *equal = strchr(*p, '=');
+
+	if (!equal)
+		return NULL;
+	*p = equal + 1;
+	return slurp_to_semi(p);
+}
+
+/* Whether the option at p is opt, with a value */
+int is_opt(const char *opt, char *p)
+{
+	return !strncmp(p, opt, strlen(opt)) && p[strlen(opt)] == '=';
+}
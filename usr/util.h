@@ -70,6 +70,9 @@ extern int str_to_open_flags(char *buf);
 extern char *open_flags_to_str(char *dest, int flags);
 extern int spc_memcpy(uint8_t *dst, uint32_t *dst_remain_len,
 		      uint8_t *src, uint32_t src_len);
+extern char *slurp_to_semi(char **p);
+extern char *slurp_value(char **p);
+extern int is_opt(const char *opt, char *p);
 
 #define zalloc(size)			\
 ({					\
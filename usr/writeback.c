@@ -0,0 +1,504 @@
+/*
+ * Write-back buffering for CoW client images
+ *
+ * Small writes from a client are absorbed into a handful of in-memory
+ * extents and merged while they stay adjacent, so the overlay file sees
+ * a few large writes instead of many 4 KiB ones. Each of those would
+ * otherwise split a reflinked extent of the host filesystem.
+ *
+ * Syncs of a client's image are group committed whether or not
+ * write-back is on: concurrent SYNCHRONIZE CACHE and FUA writes share
+ * one fdatasync().
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+
+#define WB_EXTENTS	8
+#define WB_FLUSH_MS	50
+
+struct wb_extent {
+	uint64_t offset;
+	uint32_t len;		/* 0 if unused */
+	uint64_t stamp;		/* when it was first dirtied */
+	char *buf;
+};
+
+struct wb_client {
+	pthread_mutex_t lock;
+	int fd;
+	int nr_dirty;
+	int err;		/* deferred error of a background flush */
+	struct wb_extent ext[WB_EXTENTS];
+};
+
+/*
+ * Group commit: every sync request takes a ticket and is done once an
+ * fdatasync() started after it has completed. It fails if any
+ * fdatasync() failed in the meantime, as the kernel reports a
+ * writeback error only once.
+ */
+struct wb_syncer {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t req;
+	uint64_t done;
+	int syncing;
+	uint64_t fails;		/* failed fdatasync() calls so far */
+	int err;		/* errno of the last one */
+};
+
+/* capacity of a single extent, 0 if write-back is disabled */
+static uint32_t wb_extent_size;
+static struct wb_client *wb_clients[FD_LIMIT];
+static pthread_mutex_t wb_clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct wb_syncer *wb_syncers[FD_LIMIT];
+
+static pthread_t wb_thread;
+static pthread_mutex_t wb_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_thread_cond = PTHREAD_COND_INITIALIZER;
+static int wb_running;
+static int wb_kicked;		/* a full extent is waiting, flush now */
+
+static uint64_t wb_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static struct wb_client *wb_client_get(int addr)
+{
+	struct wb_client *wc = wb_clients[addr];
+
+	if (wc)
+		return wc;
+
+	pthread_mutex_lock(&wb_clients_lock);
+	wc = wb_clients[addr];
+	if (!wc) {
+		wc = zalloc(sizeof(*wc));
+		if (wc) {
+			pthread_mutex_init(&wc->lock, NULL);
+			wc->fd = -1;
+			__atomic_store_n(&wb_clients[addr], wc,
+					 __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&wb_clients_lock);
+
+	return wc;
+}
+
+static struct wb_syncer *wb_syncer_get(int addr)
+{
+	struct wb_syncer *ws;
+
+	ws = __atomic_load_n(&wb_syncers[addr], __ATOMIC_ACQUIRE);
+	if (ws)
+		return ws;
+
+	pthread_mutex_lock(&wb_clients_lock);
+	ws = wb_syncers[addr];
+	if (!ws) {
+		ws = zalloc(sizeof(*ws));
+		if (ws) {
+			pthread_mutex_init(&ws->lock, NULL);
+			pthread_cond_init(&ws->cond, NULL);
+			__atomic_store_n(&wb_syncers[addr], ws,
+					 __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&wb_clients_lock);
+
+	return ws;
+}
+
+static int wb_overlaps(struct wb_extent *e, uint64_t offset, uint64_t length)
+{
+	if (!e->len)
+		return 0;
+	if (!length)
+		return 1;
+	return offset < e->offset + e->len && e->offset < offset + length;
+}
+
+/* called with wc->lock held */
+static int wb_extent_flush(struct wb_client *wc, struct wb_extent *e)
+{
+	ssize_t ret;
+	int err = 0;
+
+	ret = bs_rdwr_pwrite(wc->fd, e->buf, e->len, e->offset);
+	if (ret != e->len) {
+		eprintf("write-back of %u bytes at %" PRIu64 " failed, %m\n",
+			e->len, e->offset);
+		wc->err = ret < 0 ? errno : EIO;
+		err = -1;
+	}
+
+	e->len = 0;
+	wc->nr_dirty--;
+
+	return err;
+}
+
+/* called with wc->lock held */
+static int __wb_flush(struct wb_client *wc, uint64_t offset, uint64_t length,
+		      struct wb_extent *skip)
+{
+	int i, err = 0;
+
+	for (i = 0; i < WB_EXTENTS && wc->nr_dirty; i++) {
+		struct wb_extent *e = &wc->ext[i];
+
+		if (e != skip && wb_overlaps(e, offset, length))
+			err |= wb_extent_flush(wc, e);
+	}
+
+	return err;
+}
+
+/*
+ * Write out buffered data of a client overlapping [offset, offset +
+ * length), or all of it if length is 0. Returns a negative errno if
+ * this or an earlier background flush failed.
+ */
+int wb_flush(int addr, uint64_t offset, uint64_t length)
+{
+	struct wb_client *wc;
+	int err;
+
+	if (addr < 0 || addr >= FD_LIMIT)
+		return 0;
+
+	wc = __atomic_load_n(&wb_clients[addr], __ATOMIC_ACQUIRE);
+	if (!wc)
+		return 0;
+
+	pthread_mutex_lock(&wc->lock);
+	__wb_flush(wc, offset, length, NULL);
+	err = wc->err;
+	wc->err = 0;
+	pthread_mutex_unlock(&wc->lock);
+
+	return -err;
+}
+
+/*
+ * Absorb a write into the client's buffer. Returns 0 if the data was
+ * buffered, 1 if the caller has to write it through itself (after any
+ * overlapping buffered data was written out) and a negative errno if
+ * making room failed.
+ */
+int wb_write(int addr, int fd, const char *buf, uint32_t length,
+	     uint64_t offset)
+{
+	struct wb_client *wc;
+	struct wb_extent *e = NULL, *victim = NULL;
+	int i, err = 0;
+
+	if (!wb_extent_size || addr < 0 || addr >= FD_LIMIT)
+		return 1;
+
+	if (length >= wb_extent_size)
+		return wb_flush(addr, offset, length) ? : 1;
+
+	wc = wb_client_get(addr);
+	if (!wc)
+		return 1;
+
+	pthread_mutex_lock(&wc->lock);
+
+	if (wc->fd != fd) {
+		/*
+		 * The client got a new image. map_del_fd() already wrote
+		 * out everything for the old one, so only stale state
+		 * can be left here.
+		 */
+		for (i = 0; i < WB_EXTENTS; i++)
+			wc->ext[i].len = 0;
+		wc->nr_dirty = 0;
+		wc->err = 0;
+		wc->fd = fd;
+	}
+
+	for (i = 0; i < WB_EXTENTS; i++) {
+		struct wb_extent *c = &wc->ext[i];
+
+		if (c->len && offset >= c->offset &&
+		    offset <= c->offset + c->len &&
+		    offset + length <= c->offset + wb_extent_size) {
+			e = c;
+			break;
+		}
+	}
+
+	err = __wb_flush(wc, offset, length, e);
+	if (err)
+		goto out;
+
+	if (!e) {
+		for (i = 0; i < WB_EXTENTS; i++) {
+			struct wb_extent *c = &wc->ext[i];
+
+			if (!c->len) {
+				e = c;
+				break;
+			}
+			if (!victim || c->stamp < victim->stamp)
+				victim = c;
+		}
+
+		if (!e) {
+			err = wb_extent_flush(wc, victim);
+			if (err)
+				goto out;
+			e = victim;
+		}
+
+		if (!e->buf) {
+			e->buf = malloc(wb_extent_size);
+			if (!e->buf) {
+				err = -1;
+				goto out;
+			}
+		}
+
+		e->offset = offset;
+		e->stamp = wb_now();
+		wc->nr_dirty++;
+	}
+
+	memcpy(e->buf + (offset - e->offset), buf, length);
+	e->len = max_t(uint32_t, e->len, offset + length - e->offset);
+
+	if (e->len == wb_extent_size) {
+		pthread_mutex_lock(&wb_thread_lock);
+		wb_kicked = 1;
+		pthread_cond_signal(&wb_thread_cond);
+		pthread_mutex_unlock(&wb_thread_lock);
+	}
+out:
+	if (err) {
+		err = wc->err ? -wc->err : -EIO;
+		wc->err = 0;
+	}
+	pthread_mutex_unlock(&wc->lock);
+
+	return err;
+}
+
+/*
+ * Serve a read from the buffer if a single extent holds all of it.
+ * Returns 0 if buf was filled, 1 if the caller has to read the image
+ * (any overlapping buffered data is written out first) and a negative
+ * errno if that failed.
+ */
+int wb_read(int addr, char *buf, uint32_t length, uint64_t offset)
+{
+	struct wb_client *wc;
+	int i, ret = 1;
+
+	if (addr < 0 || addr >= FD_LIMIT)
+		return 1;
+
+	wc = __atomic_load_n(&wb_clients[addr], __ATOMIC_ACQUIRE);
+	if (!wc || !__atomic_load_n(&wc->nr_dirty, __ATOMIC_RELAXED))
+		return 1;
+
+	pthread_mutex_lock(&wc->lock);
+
+	for (i = 0; i < WB_EXTENTS; i++) {
+		struct wb_extent *e = &wc->ext[i];
+
+		if (e->len && offset >= e->offset &&
+		    offset + length <= e->offset + e->len) {
+			memcpy(buf, e->buf + (offset - e->offset), length);
+			ret = 0;
+			break;
+		}
+	}
+
+	if (ret && __wb_flush(wc, offset, length, NULL)) {
+		ret = -wc->err;
+		wc->err = 0;
+	}
+
+	pthread_mutex_unlock(&wc->lock);
+
+	return ret;
+}
+
+/*
+ * Make [offset, offset + length) of a client's image durable, or the
+ * whole image if length is 0. Buffered data is written out first and
+ * concurrent callers share a single fdatasync().
+ */
+int wb_sync(int addr, int fd, uint64_t offset, uint64_t length)
+{
+	struct wb_syncer *ws;
+	uint64_t ticket, target, fails;
+	int err;
+
+	if (addr < 0 || addr >= FD_LIMIT)
+		return fdatasync(fd) ? -errno : 0;
+
+	err = wb_flush(addr, offset, length);
+	if (err)
+		return err;
+
+	ws = wb_syncer_get(addr);
+	if (!ws)
+		return fdatasync(fd) ? -errno : 0;
+
+	/* start writeback of the range so that it overlaps with others */
+	if (length)
+		sync_file_range(fd, offset, length, SYNC_FILE_RANGE_WRITE);
+
+	pthread_mutex_lock(&ws->lock);
+	ticket = ++ws->req;
+	fails = ws->fails;
+
+	while (ws->done < ticket) {
+		if (ws->syncing) {
+			pthread_cond_wait(&ws->cond, &ws->lock);
+			continue;
+		}
+
+		ws->syncing = 1;
+		target = ws->req;
+		pthread_mutex_unlock(&ws->lock);
+
+		err = fdatasync(fd) ? errno : 0;
+
+		pthread_mutex_lock(&ws->lock);
+		if (err) {
+			eprintf("fdatasync for addr %d failed, %s\n", addr,
+				strerror(err));
+			ws->fails++;
+			ws->err = err;
+		}
+		ws->done = target;
+		ws->syncing = 0;
+		pthread_cond_broadcast(&ws->cond);
+	}
+
+	err = ws->fails != fails ? -ws->err : 0;
+	pthread_mutex_unlock(&ws->lock);
+
+	return err;
+}
+
+static void wb_flush_expired(int all)
+{
+	struct wb_client *wc;
+	uint64_t now = wb_now();
+	int addr, i;
+
+	for (addr = 0; addr < FD_LIMIT; addr++) {
+		wc = __atomic_load_n(&wb_clients[addr], __ATOMIC_ACQUIRE);
+		if (!wc || !__atomic_load_n(&wc->nr_dirty, __ATOMIC_RELAXED))
+			continue;
+
+		pthread_mutex_lock(&wc->lock);
+		for (i = 0; i < WB_EXTENTS; i++) {
+			struct wb_extent *e = &wc->ext[i];
+
+			if (e->len && (all || e->len == wb_extent_size ||
+				       now - e->stamp >= WB_FLUSH_MS))
+				wb_extent_flush(wc, e);
+		}
+		pthread_mutex_unlock(&wc->lock);
+	}
+}
+
+static void *wb_thread_fn(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&wb_thread_lock);
+	while (wb_running) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += WB_FLUSH_MS * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		if (!wb_kicked)
+			pthread_cond_timedwait(&wb_thread_cond, &wb_thread_lock,
+					       &ts);
+		wb_kicked = 0;
+
+		pthread_mutex_unlock(&wb_thread_lock);
+		wb_flush_expired(0);
+		pthread_mutex_lock(&wb_thread_lock);
+	}
+	pthread_mutex_unlock(&wb_thread_lock);
+
+	wb_flush_expired(1);
+
+	return NULL;
+}
+
+int wb_init(uint32_t size)
+{
+	int ret;
+
+	if (wb_running || !size)
+		return 0;
+
+	wb_extent_size = max_t(uint32_t, ALIGN(size / WB_EXTENTS, BLK_SIZE),
+			       BLK_SIZE);
+	wb_running = 1;
+
+	ret = pthread_create(&wb_thread, NULL, wb_thread_fn, NULL);
+	if (ret) {
+		eprintf("failed to create write-back thread, %s\n",
+			strerror(ret));
+		wb_running = 0;
+		wb_extent_size = 0;
+		return -ret;
+	}
+
+	eprintf("write-back enabled, %u KiB per client\n",
+		wb_extent_size * WB_EXTENTS / KB);
+
+	return 0;
+}
+
+void wb_exit(void)
+{
+	if (!wb_running)
+		return;
+
+	pthread_mutex_lock(&wb_thread_lock);
+	wb_running = 0;
+	pthread_cond_signal(&wb_thread_cond);
+	pthread_mutex_unlock(&wb_thread_lock);
+
+	pthread_join(wb_thread, NULL);
+	wb_extent_size = 0;
+}
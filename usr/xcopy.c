@@ -0,0 +1,819 @@
+/*
+ * SCSI third-party copy commands
+ *
+ * EXTENDED COPY (LID1) with block to block segments, and the token
+ * based POPULATE TOKEN / WRITE USING TOKEN pair Windows uses for
+ * offloaded data transfers (ODX). Copies are only supported within
+ * one logical unit as one initiator sees it, which is what in-guest
+ * file copies need.
+ *
+ * Backing stores opt in by listing EXTENDED_COPY and
+ * RECEIVE_COPY_RESULTS in their opcode map and passing the commands to
+ * xcopy_execute() with a function that copies a byte range.
+ *
+ * ROD tokens do not snapshot the data they represent. A token is
+ * cancelled instead as soon as the initiator writes to its ranges,
+ * which SPC allows and makes WRITE USING TOKEN fail with TOKEN
+ * CANCELLED, upon which initiators fall back to a regular copy.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+#include "scsi.h"
+#include "spc.h"
+#include "xcopy.h"
+
+#define XCOPY_HDR_LEN		16
+#define XCOPY_TARGET_DESC_LEN	32
+#define XCOPY_SEGMENT_DESC_LEN	28
+#define XCOPY_MAX_TARGETS	2
+#define XCOPY_MAX_SEGMENTS	16
+
+#define DESC_BLOCK_TO_BLOCK	0x02
+#define DESC_IDENTIFICATION	0xe4
+
+#define ROD_TOKEN_LEN		512
+#define ROD_MAX_RANGES		16
+#define ROD_MAX_TOKENS		64
+#define ROD_DEFAULT_TIMEOUT	30
+#define ROD_MAX_TIMEOUT		300
+#define ROD_MAX_BYTES		(256 * MB)
+
+#define ROD_TYPE_DEFAULT	0x00000000
+#define ROD_TYPE_PIT_VULNERABLE	0x00800001
+#define ROD_TYPE_BLOCK_ZERO	0xffff0001
+
+#define PT_HDR_LEN		16
+#define WUT_HDR_LEN		536
+#define RANGE_DESC_LEN		16
+
+#define COPY_STATUS_OK		0x01
+#define COPY_STATUS_ERROR	0x02
+#define TRANSFER_UNITS_BLOCKS	0xf1
+
+#define XCOPY_RESULTS		32
+
+#define TPC_VPD_LEN		60
+
+struct rod_range {
+	uint64_t lba;
+	uint32_t nr;
+};
+
+enum {
+	ROD_FREE,
+	ROD_VALID,
+	ROD_CANCELLED,
+};
+
+struct rod_token {
+	struct scsi_lu *lu;
+	int addr;
+	int state;
+	uint64_t id;
+	time_t expires;
+	uint32_t timeout;
+	uint64_t nr_blocks;
+	int nr_ranges;
+	struct rod_range ranges[ROD_MAX_RANGES];
+};
+
+/* outcome of a copy, for RECEIVE ROD TOKEN INFORMATION */
+struct copy_result {
+	struct scsi_lu *lu;
+	int addr;
+	uint32_t list_id;
+	uint8_t sa;
+	uint8_t key;
+	uint16_t asc;
+	uint64_t transfer_count;
+	/* POPULATE TOKEN */
+	int slot;
+	uint64_t token_id;
+};
+
+static pthread_mutex_t xcopy_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rod_token tokens[ROD_MAX_TOKENS];
+static int nr_valid_tokens;
+static uint64_t token_seq;
+static struct copy_result results[XCOPY_RESULTS];
+static unsigned int next_result;
+
+/* called with xcopy_lock held */
+static void rod_token_drop(struct rod_token *t, int state)
+{
+	if (t->state == ROD_VALID)
+		__atomic_sub_fetch(&nr_valid_tokens, 1, __ATOMIC_RELAXED);
+	t->state = state;
+}
+
+/*
+ * Cancel the tokens of an initiator that cover blocks it writes to.
+ * nr_blocks of UINT64_MAX covers everything.
+ */
+void xcopy_cancel_tokens(struct scsi_lu *lu, int addr, uint64_t lba,
+			 uint64_t nr_blocks)
+{
+	struct rod_token *t;
+	int i;
+
+	if (!__atomic_load_n(&nr_valid_tokens, __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(&xcopy_lock);
+	for (t = tokens; t < tokens + ROD_MAX_TOKENS; t++) {
+		if (t->state != ROD_VALID || t->lu != lu || t->addr != addr)
+			continue;
+
+		for (i = 0; i < t->nr_ranges; i++) {
+			if (lba < t->ranges[i].lba + t->ranges[i].nr &&
+			    (nr_blocks == UINT64_MAX ||
+			     t->ranges[i].lba < lba + nr_blocks)) {
+				rod_token_drop(t, ROD_CANCELLED);
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&xcopy_lock);
+}
+
+/* called with xcopy_lock held */
+static void xcopy_record(struct scsi_cmd *cmd, uint32_t list_id, uint8_t sa,
+			 uint8_t key, uint16_t asc, uint64_t count,
+			 int slot, uint64_t token_id)
+{
+	struct copy_result *r = NULL;
+	int i;
+
+	for (i = 0; i < XCOPY_RESULTS; i++) {
+		if (results[i].lu == cmd->dev &&
+		    results[i].addr == cmd->subnet_addr &&
+		    results[i].list_id == list_id) {
+			r = &results[i];
+			break;
+		}
+	}
+	if (!r)
+		r = &results[next_result++ % XCOPY_RESULTS];
+
+	r->lu = cmd->dev;
+	r->addr = cmd->subnet_addr;
+	r->list_id = list_id;
+	r->sa = sa;
+	r->key = key;
+	r->asc = asc;
+	r->transfer_count = count;
+	r->slot = slot;
+	r->token_id = token_id;
+}
+
+/*
+ * Does the identification descriptor of a copy target name this
+ * logical unit, by one of the designators in its VPD page 0x83?
+ */
+static int xcopy_target_is_lu(struct scsi_lu *lu, uint8_t *desc)
+{
+	struct vpd *vpd_pg = lu->attrs.lu_vpd[PCODE_OFFSET(0x83)];
+	uint8_t *p = vpd_pg->data, *end = vpd_pg->data + vpd_pg->size;
+
+	if ((desc[1] & 0x1f) != lu->attrs.device_type)
+		return 0;
+
+	while (p + 4 <= end && p + 4 + p[3] <= end) {
+		if ((p[1] & 0x0f) == (desc[5] & 0x0f) && p[3] == desc[7] &&
+		    desc[7] <= 20 && !memcmp(p + 4, desc + 8, desc[7]))
+			return 1;
+		p += 4 + p[3];
+	}
+
+	return 0;
+}
+
+/* the NAA designator of VPD page 0x83, as an identification descriptor */
+static void xcopy_lu_desc(struct scsi_lu *lu, uint8_t *desc)
+{
+	struct vpd *vpd_pg = lu->attrs.lu_vpd[PCODE_OFFSET(0x83)];
+	uint8_t *p = vpd_pg->data, *end = vpd_pg->data + vpd_pg->size;
+
+	desc[0] = DESC_IDENTIFICATION;
+	desc[1] = lu->attrs.device_type;
+
+	while (p + 4 <= end && p + 4 + p[3] <= end) {
+		if ((p[1] & 0x0f) == 0x03 && p[3] <= 20) {
+			memcpy(desc + 4, p, 4 + p[3]);
+			break;
+		}
+		p += 4 + p[3];
+	}
+
+	put_unaligned_be32(1U << lu->blk_shift, desc + 28);
+}
+
+static void rod_token_build(struct scsi_lu *lu, int slot, uint64_t id,
+			    uint64_t nr_blocks, uint8_t *buf)
+{
+	memset(buf, 0, ROD_TOKEN_LEN);
+	put_unaligned_be32(ROD_TYPE_PIT_VULNERABLE, buf);
+	put_unaligned_be16(ROD_TOKEN_LEN - 8, buf + 6);
+	put_unaligned_be64(id, buf + 8);
+	xcopy_lu_desc(lu, buf + 16);
+	put_unaligned_be64(nr_blocks << lu->blk_shift, buf + 56);
+	put_unaligned_be32(slot, buf + 64);
+}
+
+static int xcopy_check_range(struct scsi_lu *lu, uint64_t lba, uint64_t nr)
+{
+	uint64_t blocks = lu->size >> lu->blk_shift;
+
+	return lba > blocks || nr > blocks - lba;
+}
+
+static int xcopy_lid1(struct scsi_cmd *cmd, xcopy_fn_t *copy,
+		      uint8_t *key, uint16_t *asc)
+{
+	struct scsi_lu *lu = cmd->dev;
+	uint8_t *p = scsi_get_out_buffer(cmd);
+	uint32_t len = get_unaligned_be32(cmd->scb + 10);
+	uint32_t tdl, sdl, i, nr_targets;
+	uint8_t *seg;
+
+	if (len < XCOPY_HDR_LEN)
+		goto param_len;
+
+	tdl = get_unaligned_be16(p + 2);
+	sdl = get_unaligned_be32(p + 8);
+	if (XCOPY_HDR_LEN + tdl + sdl > len)
+		goto param_len;
+
+	/* inline data is only for stream devices */
+	if (get_unaligned_be32(p + 12)) {
+		*asc = ASC_INVALID_FIELD_IN_PARMS;
+		goto sense;
+	}
+
+	nr_targets = tdl / XCOPY_TARGET_DESC_LEN;
+	if (tdl % XCOPY_TARGET_DESC_LEN || nr_targets > XCOPY_MAX_TARGETS) {
+		*asc = ASC_TOO_MANY_TARGET_DESCRIPTORS;
+		goto sense;
+	}
+
+	for (i = 0; i < nr_targets; i++) {
+		uint8_t *desc = p + XCOPY_HDR_LEN + i * XCOPY_TARGET_DESC_LEN;
+		uint32_t blksize = get_unaligned_be32(desc + 28) & 0xffffff;
+
+		if (desc[0] != DESC_IDENTIFICATION) {
+			*asc = ASC_UNSUPPORTED_TARGET_DESCRIPTOR_TYPE;
+			goto sense;
+		}
+		if (!xcopy_target_is_lu(lu, desc) ||
+		    (blksize && blksize != 1U << lu->blk_shift)) {
+			*key = COPY_ABORTED;
+			*asc = ASC_COPY_TARGET_NOT_REACHABLE;
+			goto sense;
+		}
+	}
+
+	if (sdl % XCOPY_SEGMENT_DESC_LEN ||
+	    sdl / XCOPY_SEGMENT_DESC_LEN > XCOPY_MAX_SEGMENTS) {
+		*asc = ASC_TOO_MANY_SEGMENT_DESCRIPTORS;
+		goto sense;
+	}
+
+	/* check all segments before copying anything */
+	for (seg = p + XCOPY_HDR_LEN + tdl; seg < p + XCOPY_HDR_LEN + tdl + sdl;
+	     seg += XCOPY_SEGMENT_DESC_LEN) {
+		if (seg[0] != DESC_BLOCK_TO_BLOCK ||
+		    get_unaligned_be16(seg + 2) != XCOPY_SEGMENT_DESC_LEN - 4) {
+			*asc = ASC_UNSUPPORTED_SEGMENT_DESCRIPTOR_TYPE;
+			goto sense;
+		}
+		if (get_unaligned_be16(seg + 4) >= nr_targets ||
+		    get_unaligned_be16(seg + 6) >= nr_targets) {
+			*asc = ASC_INVALID_FIELD_IN_PARMS;
+			goto sense;
+		}
+		if (xcopy_check_range(lu, get_unaligned_be64(seg + 12),
+				      get_unaligned_be16(seg + 10)) ||
+		    xcopy_check_range(lu, get_unaligned_be64(seg + 20),
+				      get_unaligned_be16(seg + 10))) {
+			*asc = ASC_LBA_OUT_OF_RANGE;
+			goto sense;
+		}
+	}
+
+	for (seg = p + XCOPY_HDR_LEN + tdl; seg < p + XCOPY_HDR_LEN + tdl + sdl;
+	     seg += XCOPY_SEGMENT_DESC_LEN) {
+		uint64_t src = get_unaligned_be64(seg + 12);
+		uint64_t dst = get_unaligned_be64(seg + 20);
+		uint32_t nr = get_unaligned_be16(seg + 10);
+
+		if (!nr)
+			continue;
+
+		xcopy_cancel_tokens(lu, cmd->subnet_addr, dst, nr);
+		if (copy(cmd, src << lu->blk_shift, dst << lu->blk_shift,
+			 (uint64_t)nr << lu->blk_shift)) {
+			*key = COPY_ABORTED;
+			*asc = ASC_THIRD_PARTY_DEVICE_FAILURE;
+			goto sense;
+		}
+	}
+
+	return SAM_STAT_GOOD;
+param_len:
+	*asc = ASC_PARAMETER_LIST_LENGTH_ERR;
+sense:
+	return SAM_STAT_CHECK_CONDITION;
+}
+
+static int xcopy_write_using_token(struct scsi_cmd *cmd, xcopy_fn_t *copy,
+				   uint8_t *key, uint16_t *asc)
+{
+	struct scsi_lu *lu = cmd->dev;
+	uint8_t *p = scsi_get_out_buffer(cmd), *token, *d;
+	uint32_t len = get_unaligned_be32(cmd->scb + 10);
+	uint32_t list_id = get_unaligned_be32(cmd->scb + 6);
+	struct rod_range ranges[ROD_MAX_RANGES];
+	uint64_t skip, count = 0, want = 0, id;
+	uint32_t rdl, type, slot, toff = 0;
+	int nr_ranges = 0, ti = 0, zero;
+	struct rod_token *t;
+
+	if (len < WUT_HDR_LEN + RANGE_DESC_LEN) {
+		*asc = ASC_PARAMETER_LIST_LENGTH_ERR;
+		goto out;
+	}
+
+	skip = get_unaligned_be64(p + 8);
+	token = p + 16;
+	rdl = get_unaligned_be16(p + 534);
+	if (!rdl || rdl % RANGE_DESC_LEN || WUT_HDR_LEN + rdl > len) {
+		*asc = ASC_INVALID_FIELD_IN_PARMS;
+		goto out;
+	}
+	if (rdl / RANGE_DESC_LEN > ROD_MAX_RANGES) {
+		*asc = ASC_TOO_MANY_SEGMENT_DESCRIPTORS;
+		goto out;
+	}
+
+	for (d = p + WUT_HDR_LEN; d < p + WUT_HDR_LEN + rdl;
+	     d += RANGE_DESC_LEN) {
+		if (xcopy_check_range(lu, get_unaligned_be64(d),
+				      get_unaligned_be32(d + 8))) {
+			*asc = ASC_LBA_OUT_OF_RANGE;
+			goto out;
+		}
+		want += get_unaligned_be32(d + 8);
+	}
+
+	type = get_unaligned_be32(token);
+	zero = type == ROD_TYPE_BLOCK_ZERO;
+	if (!zero) {
+		if (type != ROD_TYPE_PIT_VULNERABLE ||
+		    get_unaligned_be16(token + 6) != ROD_TOKEN_LEN - 8) {
+			*asc = ASC_INVALID_TOKEN_OPERATION;
+			goto out;
+		}
+
+		id = get_unaligned_be64(token + 8);
+		slot = get_unaligned_be32(token + 64);
+
+		pthread_mutex_lock(&xcopy_lock);
+		t = slot < ROD_MAX_TOKENS ? &tokens[slot] : NULL;
+		if (!t || t->state == ROD_FREE || t->id != id ||
+		    t->lu != lu || t->addr != cmd->subnet_addr)
+			*asc = ASC_TOKEN_UNKNOWN;
+		else if (t->state == ROD_CANCELLED)
+			*asc = ASC_TOKEN_CANCELLED;
+		else if (t->expires < time(NULL)) {
+			rod_token_drop(t, ROD_FREE);
+			*asc = ASC_TOKEN_EXPIRED;
+		} else if (skip >= t->nr_blocks ||
+			   want > t->nr_blocks - skip) {
+			/* never leave the destination partly written */
+			*asc = ASC_INVALID_FIELD_IN_PARMS;
+		} else {
+			nr_ranges = t->nr_ranges;
+			memcpy(ranges, t->ranges, sizeof(ranges));
+			t->expires = time(NULL) + t->timeout;
+			/* DEL_TKN */
+			if (p[2] & 0x02)
+				rod_token_drop(t, ROD_FREE);
+		}
+		pthread_mutex_unlock(&xcopy_lock);
+		if (!nr_ranges)
+			goto out;
+
+		while (skip >= ranges[ti].nr) {
+			skip -= ranges[ti].nr;
+			ti++;
+		}
+		toff = skip;
+	}
+
+	for (d = p + WUT_HDR_LEN; d < p + WUT_HDR_LEN + rdl;
+	     d += RANGE_DESC_LEN) {
+		uint64_t dst = get_unaligned_be64(d);
+		uint32_t nr = get_unaligned_be32(d + 8), n;
+
+		xcopy_cancel_tokens(lu, cmd->subnet_addr, dst, nr);
+
+		while (nr && (zero || ti < nr_ranges)) {
+			n = zero ? nr : min_t(uint32_t, nr, ranges[ti].nr - toff);
+
+			if (copy(cmd, zero ? XCOPY_ZEROES :
+				 (ranges[ti].lba + toff) << lu->blk_shift,
+				 dst << lu->blk_shift,
+				 (uint64_t)n << lu->blk_shift)) {
+				*key = COPY_ABORTED;
+				*asc = ASC_THIRD_PARTY_DEVICE_FAILURE;
+				goto out;
+			}
+
+			count += n;
+			dst += n;
+			nr -= n;
+			if (!zero && (toff += n) == ranges[ti].nr) {
+				ti++;
+				toff = 0;
+			}
+		}
+	}
+
+	*key = NO_SENSE;
+	*asc = 0;
+out:
+	pthread_mutex_lock(&xcopy_lock);
+	xcopy_record(cmd, list_id, XCOPY_SA_WRITE_USING_TOKEN, *key, *asc,
+		     count, -1, 0);
+	pthread_mutex_unlock(&xcopy_lock);
+
+	return *key == NO_SENSE ? SAM_STAT_GOOD : SAM_STAT_CHECK_CONDITION;
+}
+
+/*
+ * Carry out EXTENDED COPY or WRITE USING TOKEN, called by backing
+ * stores from their I/O threads.
+ */
+int xcopy_execute(struct scsi_cmd *cmd, xcopy_fn_t *copy,
+		  uint8_t *key, uint16_t *asc)
+{
+	*key = ILLEGAL_REQUEST;
+
+	switch (cmd->scb[1] & 0x1f) {
+	case XCOPY_SA_LID1:
+		return xcopy_lid1(cmd, copy, key, asc);
+	case XCOPY_SA_WRITE_USING_TOKEN:
+		return xcopy_write_using_token(cmd, copy, key, asc);
+	}
+
+	*asc = ASC_INVALID_FIELD_IN_CDB;
+	return SAM_STAT_CHECK_CONDITION;
+}
+
+/* only logical units that advertise VPD page 0x8f take copy commands */
+static int xcopy_supported(struct scsi_lu *lu)
+{
+	return lu->attrs.lu_vpd[PCODE_OFFSET(0x8f)] != NULL;
+}
+
+/* checks common to the copy commands that write, then hand to the bs */
+static int xcopy_submit(int host_no, struct scsi_cmd *cmd)
+{
+	struct scsi_lu *lu = cmd->dev;
+	uint32_t len = get_unaligned_be32(cmd->scb + 10);
+	unsigned char key = ILLEGAL_REQUEST;
+	uint16_t asc = ASC_PARAMETER_LIST_LENGTH_ERR;
+
+	if (!xcopy_supported(lu))
+		return spc_illegal_op(host_no, cmd);
+
+	if (device_reserved(cmd))
+		return SAM_STAT_RESERVATION_CONFLICT;
+
+	if (lu->attrs.removable && !lu->attrs.online) {
+		key = NOT_READY;
+		asc = ASC_MEDIUM_NOT_PRESENT;
+		goto sense;
+	}
+
+	if (lu->attrs.readonly || lu->attrs.swp) {
+		key = DATA_PROTECT;
+		asc = ASC_WRITE_PROTECT;
+		goto sense;
+	}
+
+	/* a zero length parameter list is not an error */
+	if (!len)
+		return SAM_STAT_GOOD;
+
+	if (scsi_get_out_length(cmd) < len)
+		goto sense;
+
+	if (lu->bst->bs_cmd_submit(cmd)) {
+		key = HARDWARE_ERROR;
+		asc = ASC_INTERNAL_TGT_FAILURE;
+		goto sense;
+	}
+
+	return SAM_STAT_GOOD;
+sense:
+	scsi_set_out_resid_by_actual(cmd, 0);
+	sense_data_build(cmd, key, asc);
+	return SAM_STAT_CHECK_CONDITION;
+}
+
+static int xcopy_populate_token(int host_no, struct scsi_cmd *cmd)
+{
+	struct scsi_lu *lu = cmd->dev;
+	uint8_t *p = scsi_get_out_buffer(cmd), *d;
+	uint32_t len = get_unaligned_be32(cmd->scb + 10);
+	uint32_t list_id = get_unaligned_be32(cmd->scb + 6);
+	uint32_t timeout, rdl, nr;
+	uint64_t lba, total = 0;
+	struct rod_token *t, *victim = NULL;
+	unsigned char key = ILLEGAL_REQUEST;
+	uint16_t asc = ASC_INVALID_FIELD_IN_PARMS;
+	time_t now = time(NULL);
+
+	if (!xcopy_supported(lu))
+		return spc_illegal_op(host_no, cmd);
+
+	if (device_reserved(cmd))
+		return SAM_STAT_RESERVATION_CONFLICT;
+
+	if (lu->attrs.removable && !lu->attrs.online) {
+		key = NOT_READY;
+		asc = ASC_MEDIUM_NOT_PRESENT;
+		goto sense;
+	}
+
+	if (len < PT_HDR_LEN + RANGE_DESC_LEN ||
+	    scsi_get_out_length(cmd) < len) {
+		asc = ASC_PARAMETER_LIST_LENGTH_ERR;
+		goto sense;
+	}
+
+	/* RTV */
+	if ((p[2] & 0x02) && get_unaligned_be32(p + 8) != ROD_TYPE_DEFAULT &&
+	    get_unaligned_be32(p + 8) != ROD_TYPE_PIT_VULNERABLE) {
+		asc = ASC_UNSUPPORTED_TOKEN_TYPE;
+		goto sense;
+	}
+
+	timeout = get_unaligned_be32(p + 4);
+	if (!timeout)
+		timeout = ROD_DEFAULT_TIMEOUT;
+	if (timeout > ROD_MAX_TIMEOUT)
+		goto sense;
+
+	rdl = get_unaligned_be16(p + 14);
+	if (!rdl || rdl % RANGE_DESC_LEN || PT_HDR_LEN + rdl > len)
+		goto sense;
+	if (rdl / RANGE_DESC_LEN > ROD_MAX_RANGES) {
+		asc = ASC_TOO_MANY_SEGMENT_DESCRIPTORS;
+		goto sense;
+	}
+
+	for (d = p + PT_HDR_LEN; d < p + PT_HDR_LEN + rdl;
+	     d += RANGE_DESC_LEN) {
+		lba = get_unaligned_be64(d);
+		nr = get_unaligned_be32(d + 8);
+		if (xcopy_check_range(lu, lba, nr)) {
+			asc = ASC_LBA_OUT_OF_RANGE;
+			goto sense;
+		}
+		total += nr;
+	}
+	if (!total || total > ROD_MAX_BYTES >> lu->blk_shift)
+		goto sense;
+
+	pthread_mutex_lock(&xcopy_lock);
+	for (t = tokens; t < tokens + ROD_MAX_TOKENS; t++) {
+		if (t->state == ROD_VALID && t->expires < now)
+			rod_token_drop(t, ROD_FREE);
+		if (t->state != ROD_VALID) {
+			victim = t;
+			break;
+		}
+		if (!victim || t->expires < victim->expires)
+			victim = t;
+	}
+	t = victim;
+	rod_token_drop(t, ROD_VALID);
+	__atomic_add_fetch(&nr_valid_tokens, 1, __ATOMIC_RELAXED);
+
+	t->lu = lu;
+	t->addr = cmd->subnet_addr;
+	t->id = ((uint64_t)now << 32) ^ (++token_seq * 0x9e3779b97f4a7c15ULL);
+	t->timeout = timeout;
+	t->expires = now + timeout;
+	t->nr_blocks = total;
+	t->nr_ranges = 0;
+	for (d = p + PT_HDR_LEN; d < p + PT_HDR_LEN + rdl;
+	     d += RANGE_DESC_LEN) {
+		if (!get_unaligned_be32(d + 8))
+			continue;
+		t->ranges[t->nr_ranges].lba = get_unaligned_be64(d);
+		t->ranges[t->nr_ranges].nr = get_unaligned_be32(d + 8);
+		t->nr_ranges++;
+	}
+
+	xcopy_record(cmd, list_id, XCOPY_SA_POPULATE_TOKEN, NO_SENSE, 0,
+		     total, t - tokens, t->id);
+	pthread_mutex_unlock(&xcopy_lock);
+
+	return SAM_STAT_GOOD;
+sense:
+	scsi_set_out_resid_by_actual(cmd, 0);
+	sense_data_build(cmd, key, asc);
+	return SAM_STAT_CHECK_CONDITION;
+}
+
+static int xcopy_operating_parameters(int host_no, struct scsi_cmd *cmd)
+{
+	struct scsi_lu *lu = cmd->dev;
+	uint32_t alloc_len = get_unaligned_be32(cmd->scb + 10), actual_len;
+	uint64_t max_seg = (uint64_t)0xffff << lu->blk_shift;
+	uint8_t buf[46];
+
+	if (!xcopy_supported(lu))
+		return spc_illegal_op(host_no, cmd);
+
+	memset(buf, 0, sizeof(buf));
+	put_unaligned_be32(sizeof(buf) - 4, buf);
+	/* SNLID */
+	buf[4] = 0x01;
+	put_unaligned_be16(XCOPY_MAX_TARGETS, buf + 8);
+	put_unaligned_be16(XCOPY_MAX_SEGMENTS, buf + 10);
+	put_unaligned_be32(XCOPY_HDR_LEN +
+			   XCOPY_MAX_TARGETS * XCOPY_TARGET_DESC_LEN +
+			   XCOPY_MAX_SEGMENTS * XCOPY_SEGMENT_DESC_LEN,
+			   buf + 12);
+	put_unaligned_be32(min_t(uint64_t, max_seg, UINT32_MAX), buf + 16);
+	put_unaligned_be16(1, buf + 34);
+	buf[36] = 1;
+	buf[37] = lu->blk_shift;
+	buf[43] = 2;
+	buf[44] = DESC_BLOCK_TO_BLOCK;
+	buf[45] = DESC_IDENTIFICATION;
+
+	actual_len = spc_memcpy(scsi_get_in_buffer(cmd), &alloc_len,
+				buf, sizeof(buf));
+	scsi_set_in_resid_by_actual(cmd, actual_len);
+
+	return SAM_STAT_GOOD;
+}
+
+static int xcopy_rod_token_info(int host_no, struct scsi_cmd *cmd)
+{
+	uint32_t alloc_len = get_unaligned_be32(cmd->scb + 10), actual_len;
+	uint32_t list_id = get_unaligned_be32(cmd->scb + 2);
+	struct copy_result r;
+	uint8_t buf[32 + 18 + 4 + 2 + ROD_TOKEN_LEN], *p;
+	int i, found = 0;
+
+	if (!xcopy_supported(cmd->dev))
+		return spc_illegal_op(host_no, cmd);
+
+	pthread_mutex_lock(&xcopy_lock);
+	for (i = 0; i < XCOPY_RESULTS; i++) {
+		if (results[i].lu == cmd->dev &&
+		    results[i].addr == cmd->subnet_addr &&
+		    results[i].list_id == list_id) {
+			r = results[i];
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&xcopy_lock);
+
+	if (!found) {
+		scsi_set_in_resid_by_actual(cmd, 0);
+		sense_data_build(cmd, ILLEGAL_REQUEST,
+				 ASC_INVALID_FIELD_IN_CDB);
+		return SAM_STAT_CHECK_CONDITION;
+	}
+
+	memset(buf, 0, sizeof(buf));
+	buf[4] = r.sa;
+	buf[5] = r.key == NO_SENSE ? COPY_STATUS_OK : COPY_STATUS_ERROR;
+	buf[15] = TRANSFER_UNITS_BLOCKS;
+	put_unaligned_be64(r.transfer_count, buf + 16);
+	p = buf + 32;
+
+	if (r.key != NO_SENSE) {
+		/* fixed format sense data */
+		buf[12] = SAM_STAT_CHECK_CONDITION;
+		buf[13] = buf[14] = 18;
+		p[0] = 0x70;
+		p[2] = r.key;
+		p[7] = 10;
+		p[12] = r.asc >> 8;
+		p[13] = r.asc & 0xff;
+		p += 18;
+	}
+
+	if (r.sa == XCOPY_SA_POPULATE_TOKEN && r.key == NO_SENSE) {
+		put_unaligned_be32(2 + ROD_TOKEN_LEN, p);
+		rod_token_build(cmd->dev, r.slot, r.token_id, r.transfer_count,
+				p + 6);
+		p += 6 + ROD_TOKEN_LEN;
+	} else
+		p += 4;
+
+	put_unaligned_be32(p - buf - 4, buf);
+
+	actual_len = spc_memcpy(scsi_get_in_buffer(cmd), &alloc_len,
+				buf, p - buf);
+	scsi_set_in_resid_by_actual(cmd, actual_len);
+
+	return SAM_STAT_GOOD;
+}
+
+struct service_action xcopy_out_actions[] = {
+	{XCOPY_SA_LID1, xcopy_submit},
+	{XCOPY_SA_POPULATE_TOKEN, xcopy_populate_token},
+	{XCOPY_SA_WRITE_USING_TOKEN, xcopy_submit},
+	{0, NULL}
+};
+
+struct service_action xcopy_in_actions[] = {
+	{RCR_SA_OPERATING_PARAMETERS, xcopy_operating_parameters},
+	{RCR_SA_ROD_TOKEN_INFO, xcopy_rod_token_info},
+	{0, NULL}
+};
+
+static void update_vpd_8f(struct scsi_lu *lu, void *id)
+{
+	struct vpd *vpd_pg = lu->attrs.lu_vpd[PCODE_OFFSET(0x8f)];
+	uint8_t *data = vpd_pg->data;
+	uint64_t max_blocks = ROD_MAX_BYTES >> lu->blk_shift;
+
+	memset(data, 0, vpd_pg->size);
+
+	/* block device ROD token limits */
+	put_unaligned_be16(0x0000, data);
+	put_unaligned_be16(0x20, data + 2);
+	put_unaligned_be16(ROD_MAX_RANGES, data + 10);
+	put_unaligned_be32(ROD_MAX_TIMEOUT, data + 12);
+	put_unaligned_be32(ROD_DEFAULT_TIMEOUT, data + 16);
+	put_unaligned_be64(max_blocks, data + 20);
+	put_unaligned_be64(max_blocks, data + 28);
+	data += 36;
+
+	/* supported commands */
+	put_unaligned_be16(0x0001, data);
+	put_unaligned_be16(12, data + 2);
+	data[4] = 9;
+	data[5] = EXTENDED_COPY;
+	data[6] = 3;
+	data[7] = XCOPY_SA_LID1;
+	data[8] = XCOPY_SA_POPULATE_TOKEN;
+	data[9] = XCOPY_SA_WRITE_USING_TOKEN;
+	data[10] = RECEIVE_COPY_RESULTS;
+	data[11] = 2;
+	data[12] = RCR_SA_OPERATING_PARAMETERS;
+	data[13] = RCR_SA_ROD_TOKEN_INFO;
+	data += 16;
+
+	/* supported descriptors */
+	put_unaligned_be16(0x0004, data);
+	put_unaligned_be16(4, data + 2);
+	data[4] = 2;
+	data[5] = DESC_BLOCK_TO_BLOCK;
+	data[6] = DESC_IDENTIFICATION;
+}
+
+/* VPD page 0x8f THIRD-PARTY COPY */
+int xcopy_lu_init(struct scsi_lu *lu)
+{
+	struct vpd **lu_vpd = lu->attrs.lu_vpd;
+	int pg = PCODE_OFFSET(0x8f);
+
+	lu_vpd[pg] = alloc_vpd(TPC_VPD_LEN);
+	if (!lu_vpd[pg])
+		return -ENOMEM;
+	lu_vpd[pg]->vpd_update = update_vpd_8f;
+	lu_vpd[pg]->vpd_update(lu, NULL);
+
+	return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef __XCOPY_H
+#define __XCOPY_H
+
+/* Service actions for opcode 0x83 */
+#define XCOPY_SA_LID1			0x00
+#define XCOPY_SA_POPULATE_TOKEN		0x10
+#define XCOPY_SA_WRITE_USING_TOKEN	0x11
+
+/* Service actions for opcode 0x84 */
+#define RCR_SA_OPERATING_PARAMETERS	0x03
+#define RCR_SA_ROD_TOKEN_INFO		0x07
+
+/* source offset passed to the copy function to write zeros */
+#define XCOPY_ZEROES			UINT64_MAX
+
+/*
+ * Copies length bytes from src to dst within the logical unit of cmd,
+ * as the initiator of cmd sees it. Returns 0 or a negative errno.
+ */
+typedef int (xcopy_fn_t)(struct scsi_cmd *cmd, uint64_t src, uint64_t dst,
+			 uint64_t length);
+
+extern struct service_action xcopy_out_actions[], xcopy_in_actions[];
+
+extern int xcopy_lu_init(struct scsi_lu *lu);
+extern int xcopy_execute(struct scsi_cmd *cmd, xcopy_fn_t *copy,
+			 uint8_t *key, uint16_t *asc);
+extern void xcopy_cancel_tokens(struct scsi_lu *lu, int addr, uint64_t lba,
+				uint64_t nr_blocks);
+
+#endif